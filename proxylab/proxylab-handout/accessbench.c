@@ -0,0 +1,117 @@
+/*
+* accessbench.c - cost per request of the access log. threads log
+*     records in bursts of half a ring and pause, untimed, while the
+*     writer drains them, so what is timed is the request path and not
+*     the drop path. the same bursts then go through line-buffered stdio,
+*     a fprintf and a flush per record as the servers used to print. the
+*     log file is checked to hold one line per record
+*
+* usage: accessbench [-t threads] [-i records] [-f file]
+*/
+#include "csapp.h"
+#include "accesslog.h"
+
+#define BURST (ACCESS_RING_SIZE / 2)
+#define PAUSE_MSECS (ACCESS_FLUSH_MSECS * 3) // long enough for a writer pass
+
+static int threads = 4;
+static int records = 1 << 16; // per thread
+static char *path = "accessbench.log";
+static int use_stdio; // which logger the threads below drive
+static FILE *stdio_file;
+static long long timed_ns; // summed over every thread
+
+static void *log_thread(void *vargp)
+{
+    struct timespec pause = { 0, PAUSE_MSECS * 1000000L };
+    char uri[64];
+    long long start, spent = 0;
+    int i, j;
+
+    sprintf(uri, "http://localhost:15214/lg/%d.dat", (int)(long)vargp);
+    for (i = 0; i < records; i += BURST) {
+        start = access_now();
+        for (j = i; j < i + BURST && j < records; j++) {
+            if (use_stdio) {
+                fprintf(stdio_file, "GET %s %d %d %lldus %s\n", uri, 200, j, 0LL, "HIT");
+                fflush(stdio_file);
+            } else {
+                access_log("GET", uri, 200, j, start, "HIT");
+            }
+        }
+        spent += access_now() - start;
+        nanosleep(&pause, NULL);
+    }
+    __sync_add_and_fetch(&timed_ns, spent);
+    return NULL;
+}
+
+// log records from every thread, return the mean ns per record
+static double run(void)
+{
+    pthread_t tid[threads];
+    int i;
+
+    timed_ns = 0;
+    for (i = 0; i < threads; i++)
+        Pthread_create(&tid[i], NULL, log_thread, (void *)(long)i);
+    for (i = 0; i < threads; i++)
+        Pthread_join(tid[i], NULL);
+    return (double)timed_ns / ((double)threads * records);
+}
+
+static long count_lines(char *name)
+{
+    FILE *fp = fopen(name, "r");
+    long lines = 0;
+    int ch;
+
+    if (fp == NULL)
+        return -1;
+    while ((ch = getc(fp)) != EOF)
+        lines += ch == '\n';
+    fclose(fp);
+    return lines;
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+    long want, lines;
+    double ns;
+
+    while ((c = getopt(argc, argv, "t:i:f:")) != -1) {
+        switch (c) {
+        case 't': threads = atoi(optarg); break;
+        case 'i': records = atoi(optarg); break;
+        case 'f': path = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-t threads] [-i records] [-f file]\n", argv[0]);
+            exit(1);
+        }
+    }
+    printf("threads=%d records/thread=%d burst=%d\n", threads, records, BURST);
+    printf("%-10s %12s %10s\n", "logger", "ns/record", "dropped");
+
+    unlink(path);
+    if ((stdio_file = fopen(path, "a")) == NULL)
+        unix_error("fopen error");
+    use_stdio = 1;
+    ns = run();
+    fclose(stdio_file);
+    printf("%-10s %12.1f %10s\n", "stdio", ns, "-");
+
+    unlink(path);
+    if (access_log_open(path) < 0)
+        unix_error("access_log_open error");
+    use_stdio = 0;
+    ns = run();
+    access_log_flush();
+    printf("%-10s %12.1f %10lld\n", "accesslog", ns, access_log_dropped());
+
+    want = (long)threads * records - access_log_dropped();
+    lines = count_lines(path);
+    unlink(path);
+    printf("log %s: %ld lines, %ld expected\n", lines == want ? "ok" : "FAILED", lines, want);
+    return lines == want ? 0 : 1;
+}
@@ -0,0 +1,48 @@
+#ifndef __ACCESSLOG_H__
+#define __ACCESSLOG_H__
+
+/*
+* accesslog.h - asynchronous access log. a request thread copies one
+* fixed-size record into a ring of its own, which only it fills and only
+* the writer thread drains, so logging a request takes no lock and no
+* syscall. every ACCESS_FLUSH_MSECS the writer turns what the rings hold
+* into text lines and appends them to the log with one write(). the log
+* is rotated once it passes ACCESS_ROTATE_BYTES, and reopened on SIGHUP
+* for external rotation. a full ring drops records instead of blocking
+*/
+
+#define ACCESS_RING_SIZE 1024 // records per thread, a power of two
+#define ACCESS_URI_SIZE 208 // longer uris are cut
+#define ACCESS_FLUSH_MSECS 10 // writer pass interval while the rings are quiet
+#define ACCESS_BATCH_SIZE (256 * 1024) // text bytes per write()
+#define ACCESS_ROTATE_BYTES (64 << 20) // log size that triggers a rotation
+#define ACCESS_ROTATE_KEEP 4 // rotated logs kept, path.1 is the newest
+
+/* $begin accessrecord */
+typedef struct {
+    long long start_ns; // CLOCK_MONOTONIC when the request head was read
+    long long end_ns; // and when the response ended, the writer makes it wall time
+    long long bytes; // response bytes sent to the client, -1 if unknown
+    int status; // response status, 0 if unknown
+    char method[8];
+    char result[8]; // how the request was served, e.g. HIT or MISS
+    char uri[ACCESS_URI_SIZE];
+} access_record;
+/* $end accessrecord */
+
+// start logging to path, return -1 if it cannot be opened
+int access_log_open(const char *path);
+// CLOCK_MONOTONIC in ns, what start_ns of access_log() is measured on
+long long access_now(void);
+/*
+* log one finished request. start_ns is its CLOCK_MONOTONIC start; the
+* call does nothing until access_log_open() succeeded
+*/
+void access_log(const char *method, const char *uri, int status, long long bytes,
+                long long start_ns, const char *result);
+// write out every record logged so far
+void access_log_flush(void);
+// records dropped so far because a ring was full
+long long access_log_dropped(void);
+
+#endif /* __ACCESSLOG_H__ */
@@ -0,0 +1,112 @@
+/*
+* cachebench.c - multi-threaded hit-rate / throughput benchmark for the
+*     proxy object cache. Every thread draws uris from a skewed key space
+*     (hot_pct percent of the lookups go to the hottest 10% of the keys),
+*     fetches them from the cache and inserts them on a miss.
+*
+* usage: cachebench [-t max_threads] [-n keys] [-s object_size] [-i lookups]
+*/
+#include "csapp.h"
+#include "mycache.h"
+
+static s_cache cache;
+static int key_num = 64;
+static int object_size = 2048;
+static int lookups = 200000;
+static int hot_pct = 90;
+
+typedef struct {
+    unsigned int seed;
+    long hits;
+    long misses;
+} bench_arg;
+
+static void make_uri(char *uri, int key)
+{
+    sprintf(uri, "http://bench.example.com:8080/objects/%d.html", key);
+}
+
+static void *bench_thread(void *vargp)
+{
+    bench_arg *arg = (bench_arg *)vargp;
+    char uri[MAXLINE];
+    char *buf = Malloc(MAX_OBJECT_SIZE);
+    s_buf_block *cached;
+    int i, key, hot_num = key_num / 10 ? key_num / 10 : 1;
+
+    for (i = 0; i < lookups; i++) {
+        if ((int)(rand_r(&arg->seed) % 100) < hot_pct)
+            key = rand_r(&arg->seed) % hot_num;
+        else
+            key = rand_r(&arg->seed) % key_num;
+        make_uri(uri, key);
+        if ((cached = check_for_cache(uri, &cache)) != NULL) {
+            arg->hits++;
+            release_cache_block(cached);
+        } else {
+            arg->misses++;
+            memset(buf, key & 0xff, object_size);
+            insert_to_cache(uri, buf, object_size, &cache);
+        }
+    }
+    Free(buf);
+    return NULL;
+}
+
+static void run(int nthreads)
+{
+    pthread_t tid[nthreads];
+    bench_arg args[nthreads];
+    struct timeval start, end;
+    long hits = 0, misses = 0;
+    double secs;
+    int i;
+
+    init_cache(&cache);
+    gettimeofday(&start, NULL);
+    for (i = 0; i < nthreads; i++) {
+        args[i].seed = i + 1;
+        args[i].hits = args[i].misses = 0;
+        Pthread_create(&tid[i], NULL, bench_thread, &args[i]);
+    }
+    for (i = 0; i < nthreads; i++) {
+        Pthread_join(tid[i], NULL);
+        hits += args[i].hits;
+        misses += args[i].misses;
+    }
+    gettimeofday(&end, NULL);
+    delete_cache(&cache);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    printf("%7d %12.0f %12.0f %9.2f%%\n", nthreads,
+           (hits + misses) / secs, hits / secs,
+           100.0 * hits / (hits + misses));
+}
+
+int main(int argc, char **argv)
+{
+    int c, nthreads, max_threads = 8;
+
+    while ((c = getopt(argc, argv, "t:n:s:i:h:")) != -1) {
+        switch (c) {
+        case 't': max_threads = atoi(optarg); break;
+        case 'n': key_num = atoi(optarg); break;
+        case 's': object_size = atoi(optarg); break;
+        case 'i': lookups = atoi(optarg); break;
+        case 'h': hot_pct = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-t max_threads] [-n keys] "
+                    "[-s object_size] [-i lookups] [-h hot_pct]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (object_size > MAX_OBJECT_SIZE)
+        object_size = MAX_OBJECT_SIZE;
+
+    printf("keys=%d object_size=%d lookups/thread=%d hot=%d%%\n",
+           key_num, object_size, lookups, hot_pct);
+    printf("%7s %12s %12s %10s\n", "threads", "lookups/s", "hits/s", "hit rate");
+    for (nthreads = 1; nthreads <= max_threads; nthreads *= 2)
+        run(nthreads);
+    return 0;
+}
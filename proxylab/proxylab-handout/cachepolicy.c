@@ -0,0 +1,330 @@
+#include "mycache.h"
+
+/*
+* replacement policies of the object cache. a policy keeps the blocks
+* of a shard on up to CACHE_LIST_NUM lists and decides which one goes
+* when the shard is over its byte budget
+*
+*   lru       one list, the least recently used block goes
+*   slru      new blocks enter a probation list and move to a protected
+*             list (80% of the shard) on their second hit, so a scan of
+*             one-hit objects only churns probation
+*   wtinylfu  new blocks enter a small lru window (1%); a block leaving
+*             the window is admitted into the slru main area only if a
+*             count-min sketch has seen it more often than the block it
+*             would push out, which keeps hot objects through a scan
+*
+* hits hold only the shard read lock, so they never move blocks: a hit
+* sets the referenced bit of its block and the lists are ordered when
+* space is needed, under the write lock. a list tail hit since it got
+* there gets a second chance at the head (clock), and in slru a marked
+* probation tail is promoted then, which stands for its second hit
+*/
+
+#define PROBATION 0
+#define PROTECTED 1
+#define WINDOW 2
+
+#define PROTECTED_PCT 80 // share of the slru area for blocks hit twice
+#define WINDOW_PCT 1 // share of the shard for the w-tinylfu window
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 4096 // counters per row, power of two
+#define SKETCH_MAX 15 // counters saturate here
+#define SKETCH_SAMPLE (10 * SKETCH_WIDTH) // additions before all counters halve
+
+typedef struct
+{
+	unsigned char count[SKETCH_DEPTH][SKETCH_WIDTH]; // updated atomically
+	int additions;
+	s_buf_block* candidate; // last block that left the window for probation
+} s_tinylfu;
+
+static const unsigned int sketch_seed[SKETCH_DEPTH] = {
+	0x9e3779b1u, 0x85ebca6bu, 0xc2b2ae35u, 0x27d4eb2fu
+};
+
+void cache_list_unlink(s_cache_list* plist, s_buf_block* pblock) {
+	if (pblock->prev)
+		pblock->prev->next = pblock->next;
+	else
+		plist->head = pblock->next;
+	if (pblock->next)
+		pblock->next->prev = pblock->prev;
+	else
+		plist->tail = pblock->prev;
+	pblock->prev = pblock->next = NULL;
+	plist->size -= pblock->valid_buf_size;
+}
+
+void cache_list_push_front(s_cache_list* plist, s_buf_block* pblock, int list) {
+	pblock->list = list;
+	pblock->prev = NULL;
+	pblock->next = plist->head;
+	if (plist->head)
+		plist->head->prev = pblock;
+	else
+		plist->tail = pblock;
+	plist->head = pblock;
+	plist->size += pblock->valid_buf_size;
+}
+
+static void move_front(s_cache_shard* pshard, s_buf_block* pblock, int list) {
+	cache_list_unlink(&pshard->list[pblock->list], pblock);
+	cache_list_push_front(&pshard->list[list], pblock, list);
+}
+
+static void no_state(s_cache_shard* pshard) {
+	(void)pshard;
+}
+
+// runs under the read lock, the store is skipped once the bit is set
+static void mark_hit(s_buf_block* pblock) {
+	if (!__atomic_load_n(&pblock->referenced, __ATOMIC_RELAXED))
+	{
+		__atomic_store_n(&pblock->referenced, 1, __ATOMIC_RELAXED);
+	}
+}
+
+// give marked tails of list a second chance at its head, return the first unmarked one
+static s_buf_block* clock_tail(s_cache_shard* pshard, int list) {
+	s_buf_block* pblock;
+
+	while ((pblock = pshard->list[list].tail) != NULL && pblock->referenced)
+	{
+		pblock->referenced = 0;
+		move_front(pshard, pblock, list);
+	}
+	return pblock;
+}
+
+static void list_remove(s_cache_shard* pshard, s_buf_block* pblock) {
+	cache_list_unlink(&pshard->list[pblock->list], pblock);
+}
+
+/* lru */
+
+static void lru_hit(s_cache_shard* pshard, s_buf_block* pblock) {
+	(void)pshard;
+	mark_hit(pblock);
+}
+
+static void lru_insert(s_cache_shard* pshard, s_buf_block* pblock) {
+	cache_list_push_front(&pshard->list[PROBATION], pblock, PROBATION);
+}
+
+static s_buf_block* lru_victim(s_cache_shard* pshard) {
+	return clock_tail(pshard, PROBATION);
+}
+
+const s_cache_policy lru_policy = {
+	"lru", no_state, no_state, lru_hit, NULL, lru_insert, lru_victim, list_remove
+};
+
+/* slru */
+
+// a second hit protects the block, the protected overflow goes back on probation
+static void slru_promote(s_cache_shard* pshard, s_buf_block* pblock, long main_size) {
+	s_cache_list* protected = &pshard->list[PROTECTED];
+	long protected_max = main_size * PROTECTED_PCT / 100;
+
+	if (pblock->list == PROTECTED && protected->head == pblock)
+	{
+		return;
+	}
+	move_front(pshard, pblock, PROTECTED);
+	while (protected->size > protected_max && protected->tail != pblock)
+	{
+		move_front(pshard, protected->tail, PROBATION);
+	}
+}
+
+/*
+* promote the probation tail while it was hit since it got there, and
+* return the unmarked tail that is left. once probation is empty the
+* protected list gives its marked tails a second chance instead. a
+* promoted *candidate is cleared, it no longer duels
+*/
+static s_buf_block* slru_tail(s_cache_shard* pshard, long main_size, s_buf_block** candidate) {
+	s_buf_block* pblock;
+
+	while ((pblock = pshard->list[PROBATION].tail) != NULL && pblock->referenced)
+	{
+		pblock->referenced = 0;
+		if (candidate != NULL && *candidate == pblock)
+		{
+			*candidate = NULL;
+		}
+		slru_promote(pshard, pblock, main_size);
+	}
+	if (pblock != NULL)
+	{
+		return pblock;
+	}
+	return clock_tail(pshard, PROTECTED);
+}
+
+static s_buf_block* slru_victim(s_cache_shard* pshard) {
+	return slru_tail(pshard, pshard->max_size, NULL);
+}
+
+const s_cache_policy slru_policy = {
+	"slru", no_state, no_state, lru_hit, NULL, lru_insert, slru_victim, list_remove
+};
+
+/* w-tinylfu */
+
+static unsigned int sketch_index(unsigned int hash, int row) {
+	unsigned int h = hash * sketch_seed[row];
+	return (h ^ (h >> 15)) & (SKETCH_WIDTH - 1);
+}
+
+/*
+* count one access of hash, halving every counter once per sample period.
+* runs under the read lock, so a racing update may lose a count or push
+* a counter a little past SKETCH_MAX; estimates are capped there
+*/
+static void sketch_add(s_tinylfu* plfu, unsigned int hash) {
+	int i, j;
+
+	for (i = 0; i < SKETCH_DEPTH; i++)
+	{
+		unsigned char* c = &plfu->count[i][sketch_index(hash, i)];
+		if (__atomic_load_n(c, __ATOMIC_RELAXED) < SKETCH_MAX)
+			__atomic_fetch_add(c, 1, __ATOMIC_RELAXED);
+	}
+	// only the access that completes the sample halves
+	if (__atomic_add_fetch(&plfu->additions, 1, __ATOMIC_RELAXED) == SKETCH_SAMPLE)
+	{
+		for (i = 0; i < SKETCH_DEPTH; i++)
+			for (j = 0; j < SKETCH_WIDTH; j++)
+				__atomic_store_n(&plfu->count[i][j],
+					__atomic_load_n(&plfu->count[i][j], __ATOMIC_RELAXED) >> 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&plfu->additions, SKETCH_SAMPLE / 2, __ATOMIC_RELAXED);
+	}
+}
+
+static int sketch_estimate(s_tinylfu* plfu, unsigned int hash) {
+	int i, min = SKETCH_MAX;
+
+	for (i = 0; i < SKETCH_DEPTH; i++)
+	{
+		int c = plfu->count[i][sketch_index(hash, i)];
+		if (c < min)
+			min = c;
+	}
+	return min;
+}
+
+/*
+* 1% of a shard of the default cache is about 1.3KB, so there the window
+* only stages the newest object until the next insert and the policy is
+* plain tinylfu admission into slru. a window of MAX_OBJECT_SIZE was
+* tried and lost hits in cachesim at every size it was given (20.6% of
+* objects at 1%, 16.7% at MAX_OBJECT_SIZE), so the share stays; larger
+* caches get a real window
+*/
+static long window_max(s_cache_shard* pshard) {
+	return pshard->max_size * WINDOW_PCT / 100;
+}
+
+static void tinylfu_init(s_cache_shard* pshard) {
+	pshard->policy_data = calloc(1, sizeof(s_tinylfu));
+	if (pshard->policy_data == NULL)
+	{
+		unix_error("calloc error");
+	}
+}
+
+static void tinylfu_destroy(s_cache_shard* pshard) {
+	free(pshard->policy_data);
+	pshard->policy_data = NULL;
+}
+
+static void tinylfu_miss(s_cache_shard* pshard, unsigned int hash) {
+	sketch_add((s_tinylfu *)pshard->policy_data, hash);
+}
+
+static void tinylfu_hit(s_cache_shard* pshard, s_buf_block* pblock) {
+	sketch_add((s_tinylfu *)pshard->policy_data, pblock->hash);
+	mark_hit(pblock);
+}
+
+static void tinylfu_insert(s_cache_shard* pshard, s_buf_block* pblock) {
+	cache_list_push_front(&pshard->list[WINDOW], pblock, WINDOW);
+}
+
+/*
+* the window overflows into probation, marked window tails getting a
+* second chance first, and while the main area is then over its budget
+* the latest such candidate duels the main lru victim: the one the
+* sketch has seen less often goes. a candidate hit meanwhile is promoted
+*/
+static s_buf_block* tinylfu_victim(s_cache_shard* pshard) {
+	s_tinylfu* plfu = (s_tinylfu *)pshard->policy_data;
+	s_cache_list* window = &pshard->list[WINDOW];
+	long main_size = pshard->max_size - window_max(pshard);
+	s_buf_block* candidate;
+	s_buf_block* victim;
+
+	while (window->size > window_max(pshard) && clock_tail(pshard, WINDOW) != NULL)
+	{
+		plfu->candidate = window->tail;
+		move_front(pshard, window->tail, PROBATION);
+	}
+	if ((candidate = plfu->candidate) != NULL && candidate->referenced)
+	{
+		candidate->referenced = 0;
+		plfu->candidate = NULL;
+		slru_promote(pshard, candidate, main_size);
+	}
+	victim = slru_tail(pshard, main_size, &plfu->candidate);
+	if ((candidate = plfu->candidate) == NULL)
+	{
+		return victim;
+	}
+	if (victim == candidate)
+	{
+		victim = candidate->prev != NULL ? candidate->prev : pshard->list[PROTECTED].tail;
+	}
+	if (victim == NULL)
+	{
+		return candidate;
+	}
+	if (sketch_estimate(plfu, candidate->hash) > sketch_estimate(plfu, victim->hash))
+	{
+		return victim;
+	}
+	return candidate;
+}
+
+static void tinylfu_remove(s_cache_shard* pshard, s_buf_block* pblock) {
+	s_tinylfu* plfu = (s_tinylfu *)pshard->policy_data;
+
+	if (plfu->candidate == pblock)
+	{
+		plfu->candidate = NULL;
+	}
+	cache_list_unlink(&pshard->list[pblock->list], pblock);
+}
+
+const s_cache_policy wtinylfu_policy = {
+	"wtinylfu", tinylfu_init, tinylfu_destroy, tinylfu_hit, tinylfu_miss,
+	tinylfu_insert, tinylfu_victim, tinylfu_remove
+};
+
+static const s_cache_policy* policies[] = {
+	&lru_policy, &slru_policy, &wtinylfu_policy, NULL
+};
+
+// the policy called name, or NULL
+const s_cache_policy* find_cache_policy(const char* name) {
+	int i;
+	for (i = 0; policies[i] != NULL; i++)
+	{
+		if (!strcmp(policies[i]->name, name))
+		{
+			return policies[i];
+		}
+	}
+	return NULL;
+}
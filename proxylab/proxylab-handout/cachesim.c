@@ -0,0 +1,166 @@
+/*
+* cachesim.c - trace driven simulator for the cache replacement policies.
+*     Replays one trace against the object cache once per policy and
+*     reports object and byte hit ratios. A trace has one access per
+*     line, "key [size]": the key is any token without blanks (an uri
+*     from an access log works) and size defaults to -s bytes. Without a
+*     trace file, -g generates a zipf distributed trace in which every
+*     -S accesses a scan of one-hit keys passes through the cache.
+*
+* usage: cachesim [-c capacity] [-s size] [-g accesses] [-n keys]
+*                 [-a alpha] [-S scan_every] [-L scan_len] [trace]
+*/
+#include <math.h>
+#include "csapp.h"
+#include "mycache.h"
+
+typedef struct {
+    char *key;
+    int size;
+} access_t;
+
+static access_t *trace;
+static int trace_len, trace_cap;
+static long capacity = MAX_CACHE_SIZE;
+static int default_size = 4096;
+
+static void add_access(const char *key, int size)
+{
+    if (trace_len == trace_cap) {
+        trace_cap = trace_cap ? trace_cap * 2 : 4096;
+        trace = Realloc(trace, trace_cap * sizeof(access_t));
+    }
+    trace[trace_len].key = strdup(key);
+    trace[trace_len].size = size;
+    trace_len++;
+}
+
+static void read_trace(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    char line[MAXLINE], key[MAXLINE];
+    int size;
+
+    if (fp == NULL)
+        unix_error("cannot open trace");
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        int n = sscanf(line, "%s %d", key, &size);
+        if (n < 1)
+            continue;
+        add_access(key, n == 2 && size > 0 ? size : default_size);
+    }
+    fclose(fp);
+}
+
+/* size of a generated key, fixed per key and spread over 1KB..32KB */
+static int key_size(int key)
+{
+    unsigned int h = (unsigned int)key * 2654435761u;
+    return 1024 << ((h >> 16) % 6);
+}
+
+static void gen_trace(int accesses, int keys, double alpha,
+                      int scan_every, int scan_len)
+{
+    double *cdf = Malloc(keys * sizeof(double));
+    double sum = 0;
+    char key[64];
+    unsigned int seed = 1;
+    int i, j, scan = 0;
+
+    for (i = 0; i < keys; i++)
+        cdf[i] = sum += 1.0 / pow(i + 1, alpha);
+    for (i = 0; i < accesses; i++) {
+        double r = (double)rand_r(&seed) / RAND_MAX * sum;
+        int lo = 0, hi = keys - 1;
+
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (cdf[mid] < r)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        sprintf(key, "http://sim.example.com/k/%d", lo);
+        add_access(key, key_size(lo));
+        if (scan_every > 0 && (i + 1) % scan_every == 0) {
+            for (j = 0; j < scan_len; j++, scan++) {
+                sprintf(key, "http://sim.example.com/scan/%d", scan);
+                add_access(key, default_size);
+            }
+        }
+    }
+    Free(cdf);
+}
+
+static void simulate(const s_cache_policy *policy, char *buf)
+{
+    s_cache cache;
+    s_buf_block *cached;
+    long hits = 0, hit_bytes = 0, total_bytes = 0;
+    struct timeval start, end;
+    double secs;
+    int i;
+
+    init_cache_policy(&cache, policy, capacity);
+    gettimeofday(&start, NULL);
+    for (i = 0; i < trace_len; i++) {
+        total_bytes += trace[i].size;
+        if ((cached = check_for_cache(trace[i].key, &cache)) != NULL) {
+            hits++;
+            hit_bytes += trace[i].size;
+            release_cache_block(cached);
+        } else {
+            insert_to_cache(trace[i].key, buf, trace[i].size, &cache);
+        }
+    }
+    gettimeofday(&end, NULL);
+    delete_cache(&cache);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    printf("%-10s %11.2f%% %11.2f%% %12.0f\n", policy->name,
+           100.0 * hits / trace_len, 100.0 * hit_bytes / total_bytes,
+           trace_len / secs);
+}
+
+int main(int argc, char **argv)
+{
+    static const char *names[] = { "lru", "slru", "wtinylfu", NULL };
+    int c, i, accesses = 1000000, keys = 100000, scan_every = 50000, scan_len = 20000;
+    double alpha = 0.9;
+    char *buf;
+
+    while ((c = getopt(argc, argv, "c:s:g:n:a:S:L:")) != -1) {
+        switch (c) {
+        case 'c': capacity = atol(optarg); break;
+        case 's': default_size = atoi(optarg); break;
+        case 'g': accesses = atoi(optarg); break;
+        case 'n': keys = atoi(optarg); break;
+        case 'a': alpha = atof(optarg); break;
+        case 'S': scan_every = atoi(optarg); break;
+        case 'L': scan_len = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-c capacity] [-s size] [-g accesses] "
+                    "[-n keys] [-a alpha] [-S scan_every] [-L scan_len] [trace]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+    if (optind < argc) {
+        read_trace(argv[optind]);
+        printf("trace=%s accesses=%d capacity=%ld\n", argv[optind], trace_len, capacity);
+    } else {
+        gen_trace(accesses, keys, alpha, scan_every, scan_len);
+        printf("zipf keys=%d alpha=%.2f accesses=%d scan=%d/%d capacity=%ld\n",
+               keys, alpha, trace_len, scan_len, scan_every, capacity);
+    }
+    if (trace_len == 0)
+        return 0;
+
+    buf = Calloc(1, MAX_OBJECT_SIZE);
+    printf("%-10s %12s %12s %12s\n", "policy", "object hits", "byte hits", "accesses/s");
+    for (i = 0; names[i] != NULL; i++)
+        simulate(find_cache_policy(names[i]), buf);
+    Free(buf);
+    return 0;
+}
@@ -0,0 +1,374 @@
+/*
+* diskcache.c - append-only disk tier behind the memory cache
+*
+* layout of the cache directory:
+*
+*   index      header + DISK_INDEX_SLOTS entries, mmap'd shared, so every
+*              update is in the page cache and outlives the process
+*   seg.N      records of segment N: header, uri, payload
+*
+* records are only ever appended to the newest segment. once it passes
+* DISK_SEGMENT_SIZE a new one is started, and beyond DISK_SEGMENT_NUM
+* segments the oldest is deleted; index entries that point into a
+* deleted segment are simply treated as misses. the index is direct
+* mapped on the uri hash, a collision overwrites the older entry, and
+* every hit checks the uri stored in the record, so a stale or torn
+* entry can only cost a miss.
+*
+* one disk thread does the appends and the lookups of the event loops.
+* an evicted block is pinned and queued for it; while the queue is full
+* further spills are dropped, and a block still queued is a miss
+*/
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include "csapp.h"
+#include "diskcache.h"
+
+#define DISK_MAGIC 0x70786332 // "pxc2"
+
+typedef struct {
+    unsigned int magic;
+    unsigned int slots;
+    unsigned int first_seg; // oldest live segment
+    unsigned int cur_seg; // segment being appended to
+} disk_index_head;
+
+typedef struct {
+    unsigned int hash;
+    unsigned int seg;
+    unsigned int offset; // of the record in the segment
+    unsigned int size; // payload bytes, 0 for an empty slot
+} disk_index_entry;
+
+typedef struct {
+    unsigned int magic;
+    unsigned int hash;
+    int uri_len;
+    int size;
+    int framed;
+    time_t expires; // of the memory block, 0 if it never goes stale
+} disk_record;
+
+static char *disk_dir; // NULL while the tier is off
+static disk_index_head *head;
+static disk_index_entry *index_slot;
+static int seg_fd[DISK_SEGMENT_NUM]; // by seg % DISK_SEGMENT_NUM
+static off_t seg_size; // bytes in the current segment
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER; // index and segments
+static pthread_mutex_t append_lock = PTHREAD_MUTEX_INITIALIZER; // one appender
+
+// a lookup for an event loop, or an evicted block to append
+typedef struct disk_job {
+    s_buf_block *pblock; // pinned, NULL for a lookup
+    char *uri; // copy of the uri to look up
+    disk_hit *hit;
+    disk_callback done;
+    void *arg;
+    struct disk_job *next;
+} disk_job;
+
+static disk_job *lookups_head, *lookups_tail; // served before the spills
+static disk_job *spills_head, *spills_tail;
+static int spill_num;
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+
+static int open_segment(unsigned int seg, int create);
+static int next_segment(void);
+static void *disk_thread(void *vargp);
+static void append_record(s_buf_block *pblock);
+
+int init_disk_cache(char *dir)
+{
+    char path[MAXLINE];
+    size_t len = sizeof(disk_index_head) + DISK_INDEX_SLOTS * sizeof(disk_index_entry);
+    struct stat st;
+    unsigned int seg;
+    void *map;
+    pthread_t tid;
+    int fd, fresh;
+
+    mkdir(dir, 0755);
+    snprintf(path, sizeof(path), "%s/index", dir);
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || (st.st_size != len && ftruncate(fd, len) < 0)) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    head = (disk_index_head *)map;
+    index_slot = (disk_index_entry *)(head + 1);
+    disk_dir = Malloc(strlen(dir) + 1);
+    strcpy(disk_dir, dir);
+
+    fresh = head->magic != DISK_MAGIC || head->slots != DISK_INDEX_SLOTS
+        || head->cur_seg - head->first_seg >= DISK_SEGMENT_NUM;
+    if (fresh) {
+        memset(map, 0, len);
+        head->magic = DISK_MAGIC;
+        head->slots = DISK_INDEX_SLOTS;
+    }
+    for (seg = 0; seg < DISK_SEGMENT_NUM; seg++)
+        seg_fd[seg] = -1;
+    // reopen the live segments, a missing one just loses its records
+    for (seg = head->first_seg; seg != head->cur_seg + 1; seg++)
+        seg_fd[seg % DISK_SEGMENT_NUM] = open_segment(seg, fresh || seg == head->cur_seg);
+    if (seg_fd[head->cur_seg % DISK_SEGMENT_NUM] < 0
+        || fstat(seg_fd[head->cur_seg % DISK_SEGMENT_NUM], &st) < 0) {
+        Free(disk_dir);
+        disk_dir = NULL;
+        return -1;
+    }
+    seg_size = st.st_size;
+    Pthread_create(&tid, NULL, disk_thread, NULL);
+    return 0;
+}
+
+int disk_cache_enabled(void)
+{
+    return disk_dir != NULL;
+}
+
+static int open_segment(unsigned int seg, int create)
+{
+    char path[MAXLINE];
+
+    snprintf(path, sizeof(path), "%s/seg.%08u", disk_dir, seg);
+    return open(path, O_RDWR | (create ? O_CREAT : 0), 0644);
+}
+
+int disk_cache_lookup(char *uri, disk_hit *hit)
+{
+    unsigned int hash = cache_hash(uri);
+    disk_index_entry e;
+    disk_record rec;
+    char stored[MAXLINE];
+    int uri_len = strlen(uri), fd = -1;
+
+    if (disk_dir == NULL || uri_len >= MAXLINE)
+        return 0;
+    pthread_rwlock_rdlock(&index_lock);
+    e = index_slot[hash & (DISK_INDEX_SLOTS - 1)];
+    if (e.size > 0 && e.hash == hash && e.seg - head->first_seg <= head->cur_seg - head->first_seg
+        && seg_fd[e.seg % DISK_SEGMENT_NUM] >= 0)
+        fd = dup(seg_fd[e.seg % DISK_SEGMENT_NUM]); // survives the segment being dropped
+    pthread_rwlock_unlock(&index_lock);
+    if (fd < 0)
+        return 0;
+
+    if (pread(fd, &rec, sizeof(rec), e.offset) != sizeof(rec)
+        || rec.magic != DISK_MAGIC || rec.hash != hash || rec.uri_len != uri_len
+        || rec.size != e.size
+        || (rec.expires != 0 && rec.expires <= time(NULL)) // stale, refetch it
+        || pread(fd, stored, uri_len, e.offset + sizeof(rec)) != uri_len
+        || memcmp(stored, uri, uri_len)) {
+        close(fd);
+        return 0;
+    }
+    hit->fd = fd;
+    hit->offset = e.offset + sizeof(rec) + uri_len;
+    hit->size = rec.size;
+    hit->framed = rec.framed;
+    return 1;
+}
+
+void disk_cache_lookup_async(char *uri, disk_hit *hit, disk_callback done, void *arg)
+{
+    disk_job *job = Malloc(sizeof(disk_job));
+
+    job->pblock = NULL;
+    job->uri = Malloc(strlen(uri) + 1);
+    strcpy(job->uri, uri);
+    job->hit = hit;
+    job->done = done;
+    job->arg = arg;
+    job->next = NULL;
+    pthread_mutex_lock(&jobs_lock);
+    if (lookups_tail)
+        lookups_tail->next = job;
+    else
+        lookups_head = job;
+    lookups_tail = job;
+    pthread_cond_signal(&jobs_cond);
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+// runs wherever the memory cache evicts, so it only pins and queues
+void disk_cache_store(s_buf_block *pblock)
+{
+    disk_job *job;
+
+    if (disk_dir == NULL || pblock->valid_buf_size == 0)
+        return;
+    pthread_mutex_lock(&jobs_lock);
+    if (spill_num == DISK_SPILL_QUEUE) {
+        pthread_mutex_unlock(&jobs_lock);
+        return;
+    }
+    spill_num++;
+    pthread_mutex_unlock(&jobs_lock);
+    job = Malloc(sizeof(disk_job));
+    __sync_add_and_fetch(&pblock->refcnt, 1);
+    job->pblock = pblock;
+    job->next = NULL;
+    pthread_mutex_lock(&jobs_lock);
+    if (spills_tail)
+        spills_tail->next = job;
+    else
+        spills_head = job;
+    spills_tail = job;
+    pthread_cond_signal(&jobs_cond);
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+// take jobs off the queues, lookups first, and do their I/O outside the lock
+static void *disk_thread(void *vargp)
+{
+    disk_job *job;
+    int found;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&jobs_lock);
+        while (lookups_head == NULL && spills_head == NULL)
+            pthread_cond_wait(&jobs_cond, &jobs_lock);
+        if ((job = lookups_head) != NULL) {
+            if ((lookups_head = job->next) == NULL)
+                lookups_tail = NULL;
+        } else {
+            job = spills_head;
+            if ((spills_head = job->next) == NULL)
+                spills_tail = NULL;
+            spill_num--;
+        }
+        pthread_mutex_unlock(&jobs_lock);
+
+        if (job->pblock != NULL) {
+            append_record(job->pblock);
+            release_cache_block(job->pblock);
+        } else {
+            found = disk_cache_lookup(job->uri, job->hit);
+            job->done(job->arg, found);
+            Free(job->uri);
+        }
+        Free(job);
+    }
+    return NULL;
+}
+
+/*
+* append_record - append the record of pblock to the current segment
+* and point the index at it. the record is on disk before the index
+* entry is written, so a crash in between leaves the old entry
+*/
+static void append_record(s_buf_block *pblock)
+{
+    disk_record rec;
+    struct iovec iov[3];
+    unsigned int seg;
+    off_t offset;
+    ssize_t len;
+    int fd;
+
+    if (disk_dir == NULL)
+        return;
+    rec.magic = DISK_MAGIC;
+    rec.hash = pblock->hash;
+    rec.uri_len = strlen(pblock->uri);
+    rec.size = pblock->valid_buf_size;
+    rec.framed = pblock->framed;
+    rec.expires = cache_block_expires(pblock);
+    if (rec.size == 0 || rec.uri_len >= MAXLINE)
+        return;
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    iov[1].iov_base = pblock->uri;
+    iov[1].iov_len = rec.uri_len;
+    iov[2].iov_base = pblock->buf;
+    iov[2].iov_len = rec.size;
+    len = sizeof(rec) + rec.uri_len + rec.size;
+
+    pthread_mutex_lock(&append_lock);
+    if (seg_size > 0 && seg_size + len > DISK_SEGMENT_SIZE && next_segment() < 0) {
+        pthread_mutex_unlock(&append_lock);
+        return;
+    }
+    seg = head->cur_seg;
+    fd = seg_fd[seg % DISK_SEGMENT_NUM];
+    offset = seg_size;
+    if (pwritev(fd, iov, 3, offset) != len) {
+        pthread_mutex_unlock(&append_lock);
+        return;
+    }
+    seg_size += len;
+
+    pthread_rwlock_wrlock(&index_lock);
+    index_slot[rec.hash & (DISK_INDEX_SLOTS - 1)].hash = rec.hash;
+    index_slot[rec.hash & (DISK_INDEX_SLOTS - 1)].seg = seg;
+    index_slot[rec.hash & (DISK_INDEX_SLOTS - 1)].offset = offset;
+    index_slot[rec.hash & (DISK_INDEX_SLOTS - 1)].size = rec.size;
+    pthread_rwlock_unlock(&index_lock);
+    pthread_mutex_unlock(&append_lock);
+}
+
+// seal the current segment and start the next, dropping the oldest one
+// when there are too many. call with append_lock held
+static int next_segment(void)
+{
+    char path[MAXLINE];
+    unsigned int seg = head->cur_seg + 1;
+    int fd, old = -1;
+
+    // a leftover file from an earlier run must not be appended to
+    snprintf(path, sizeof(path), "%s/seg.%08u", disk_dir, seg);
+    unlink(path);
+    if ((fd = open_segment(seg, 1)) < 0)
+        return -1;
+    pthread_rwlock_wrlock(&index_lock);
+    if (seg - head->first_seg >= DISK_SEGMENT_NUM) {
+        old = seg_fd[head->first_seg % DISK_SEGMENT_NUM];
+        snprintf(path, sizeof(path), "%s/seg.%08u", disk_dir, head->first_seg);
+        unlink(path);
+        head->first_seg++;
+    }
+    seg_fd[seg % DISK_SEGMENT_NUM] = fd;
+    head->cur_seg = seg;
+    pthread_rwlock_unlock(&index_lock);
+    if (old >= 0)
+        close(old);
+    seg_size = 0;
+    return 0;
+}
+
+int disk_cache_peek(disk_hit *hit, char *buf, int size)
+{
+    ssize_t n;
+
+    while ((n = pread(hit->fd, buf, size < hit->size ? size : hit->size, hit->offset)) < 0
+           && errno == EINTR)
+        ;
+    return n;
+}
+
+int disk_cache_send(int fd, disk_hit *hit)
+{
+    off_t offset = hit->offset;
+    int left = hit->size;
+    ssize_t n;
+
+    while (left > 0) {
+        if ((n = sendfile(fd, hit->fd, &offset, left)) <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        left -= n;
+    }
+    close(hit->fd);
+    return left == 0 ? 0 : -1;
+}
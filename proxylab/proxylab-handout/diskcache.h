@@ -0,0 +1,47 @@
+#ifndef __DISKCACHE_H__
+#define __DISKCACHE_H__
+
+#include "csapp.h"
+#include "mycache.h"
+
+/*
+* diskcache.h - optional second cache tier on disk. blocks evicted from
+* the memory cache are appended to segment files in a directory and an
+* mmap'd index maps the uri hash to the record, so the tier survives a
+* restart. hits are sent straight from the segment with sendfile().
+* spills and the lookups of event loops run on a disk thread, so a slow
+* disk never holds up a request thread or a loop
+*/
+
+#define DISK_INDEX_SLOTS 65536 // direct mapped index entries, power of two
+#define DISK_SEGMENT_SIZE (16 << 20) // a segment is sealed past this size
+#define DISK_SEGMENT_NUM 16 // live segments, the oldest is dropped beyond
+#define DISK_SPILL_QUEUE 64 // evicted blocks waiting for the disk thread, more are dropped
+
+// where a cached object lies on disk
+typedef struct {
+    int fd; // private descriptor of the segment, close it when done
+    off_t offset; // of the payload in the segment
+    int size;
+    int framed;
+} disk_hit;
+
+// called from the disk thread once an asynchronous lookup ends
+typedef void (*disk_callback)(void *arg, int found);
+
+// open or create the tier in dir and start the disk thread, 0 on success and -1 on error
+int init_disk_cache(char *dir);
+// the tier is open
+int disk_cache_enabled(void);
+// find a fresh copy of uri, 1 with hit filled in or 0 on a miss
+int disk_cache_lookup(char *uri, disk_hit *hit);
+// look uri up on the disk thread, which fills in hit and then calls done
+void disk_cache_lookup_async(char *uri, disk_hit *hit, disk_callback done, void *arg);
+// queue an evicted block for the disk thread to append, suits the evict_hook of s_cache
+void disk_cache_store(s_buf_block *pblock);
+// send a whole hit to a blocking fd and close it, -1 on error
+int disk_cache_send(int fd, disk_hit *hit);
+// read the first size bytes of a hit into buf, return how many or -1
+int disk_cache_peek(disk_hit *hit, char *buf, int size);
+
+#endif /* __DISKCACHE_H__ */
@@ -0,0 +1,192 @@
+/*
+* dnscache.c - TTL bounded DNS cache with collapsed lookups
+*
+* every host has one entry. the first miss marks it pending and queues it
+* for the resolver threads; later misses for the same host wait on that
+* entry instead of calling getaddrinfo themselves. blocking callers sleep
+* on the entry's condition variable, event loops register a callback.
+* failures are cached for DNS_NEG_TTL_SECS so a dead name is not asked
+* again on every request
+*/
+#include "csapp.h"
+#include "dnscache.h"
+
+typedef enum { DNS_PENDING, DNS_OK, DNS_FAIL } dns_state;
+
+typedef struct dns_waiter {
+    dns_callback done;
+    void *arg;
+    struct dns_waiter *next;
+} dns_waiter;
+
+typedef struct dns_entry {
+    char *host_name;
+    dns_state state;
+    struct in_addr addr;
+    time_t expires;
+    pthread_cond_t cond; // broadcast when a pending lookup ends
+    dns_waiter *waiters; // asynchronous callers of a pending lookup
+    struct dns_entry *next; // next in the hash bucket
+    struct dns_entry *next_job; // next in the resolver queue
+} dns_entry;
+
+static dns_entry *table[DNS_BUCKET_NUM];
+static dns_entry *jobs_head, *jobs_tail;
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+
+static void *resolver_thread(void *vargp);
+static dns_entry *get_entry(char *host_name, time_t now);
+
+void init_dns_cache(int resolver_num)
+{
+    int i;
+    pthread_t tid;
+
+    for (i = 0; i < resolver_num; i++)
+        Pthread_create(&tid, NULL, resolver_thread, NULL);
+}
+
+int dns_lookup(char *host_name, struct in_addr *addr)
+{
+    dns_entry *e;
+    int rc;
+
+    if (inet_aton(host_name, addr))
+        return 0;
+    pthread_mutex_lock(&dns_lock);
+    e = get_entry(host_name, time(NULL));
+    while (e->state == DNS_PENDING)
+        pthread_cond_wait(&e->cond, &dns_lock);
+    rc = e->state == DNS_OK ? 0 : -1;
+    *addr = e->addr;
+    pthread_mutex_unlock(&dns_lock);
+    return rc;
+}
+
+int dns_lookup_async(char *host_name, struct in_addr *addr, dns_callback done, void *arg)
+{
+    dns_entry *e;
+    dns_waiter *w;
+    int rc;
+
+    if (inet_aton(host_name, addr))
+        return 1;
+    pthread_mutex_lock(&dns_lock);
+    e = get_entry(host_name, time(NULL));
+    if (e->state == DNS_PENDING) {
+        w = Malloc(sizeof(dns_waiter));
+        w->done = done;
+        w->arg = arg;
+        w->next = e->waiters;
+        e->waiters = w;
+        rc = 0;
+    } else {
+        rc = e->state == DNS_OK ? 1 : -1;
+        *addr = e->addr;
+    }
+    pthread_mutex_unlock(&dns_lock);
+    return rc;
+}
+
+/*
+* get_entry - the live entry of host_name, call with dns_lock held. a
+* missing or expired entry is (re)queued as pending, expired idle entries
+* of the same bucket are dropped on the way
+*/
+static dns_entry *get_entry(char *host_name, time_t now)
+{
+    unsigned int hash = 0;
+    char *p;
+    dns_entry **pp, *e, *found = NULL;
+
+    for (p = host_name; *p; p++)
+        hash = hash * 31 + (unsigned char)tolower(*p);
+    pp = &table[hash % DNS_BUCKET_NUM];
+    while ((e = *pp) != NULL) {
+        if (!strcasecmp(e->host_name, host_name)) {
+            found = e;
+        } else if (e->state != DNS_PENDING && e->expires <= now) {
+            *pp = e->next;
+            pthread_cond_destroy(&e->cond);
+            Free(e->host_name);
+            Free(e);
+            continue;
+        }
+        pp = &e->next;
+    }
+    if (found != NULL && (found->state == DNS_PENDING || found->expires > now))
+        return found;
+
+    if (found == NULL) {
+        found = Malloc(sizeof(dns_entry));
+        found->host_name = Malloc(strlen(host_name) + 1);
+        strcpy(found->host_name, host_name);
+        pthread_cond_init(&found->cond, NULL);
+        found->waiters = NULL;
+        found->next = table[hash % DNS_BUCKET_NUM];
+        table[hash % DNS_BUCKET_NUM] = found;
+    }
+    found->state = DNS_PENDING;
+    found->next_job = NULL;
+    if (jobs_tail)
+        jobs_tail->next_job = found;
+    else
+        jobs_head = found;
+    jobs_tail = found;
+    pthread_cond_signal(&jobs_cond);
+    return found;
+}
+
+// take pending entries off the queue and resolve them outside the lock
+static void *resolver_thread(void *vargp)
+{
+    struct addrinfo hints, *addlist;
+    struct in_addr addr;
+    dns_entry *e;
+    dns_waiter *w;
+    char host_name[MAXLINE];
+    int ok;
+
+    Pthread_detach(pthread_self());
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    while (1) {
+        pthread_mutex_lock(&dns_lock);
+        while (jobs_head == NULL)
+            pthread_cond_wait(&jobs_cond, &dns_lock);
+        e = jobs_head;
+        if ((jobs_head = e->next_job) == NULL)
+            jobs_tail = NULL;
+        // pending entries are never freed, but copy the name for clarity
+        strncpy(host_name, e->host_name, MAXLINE - 1);
+        host_name[MAXLINE - 1] = '\0';
+        pthread_mutex_unlock(&dns_lock);
+
+        ok = getaddrinfo(host_name, NULL, &hints, &addlist) == 0;
+        if (ok) {
+            addr = ((struct sockaddr_in *)addlist->ai_addr)->sin_addr;
+            freeaddrinfo(addlist);
+        } else {
+            memset(&addr, 0, sizeof(addr));
+        }
+
+        pthread_mutex_lock(&dns_lock);
+        e->state = ok ? DNS_OK : DNS_FAIL;
+        e->addr = addr;
+        e->expires = time(NULL) + (ok ? DNS_TTL_SECS : DNS_NEG_TTL_SECS);
+        w = e->waiters;
+        e->waiters = NULL;
+        pthread_cond_broadcast(&e->cond);
+        pthread_mutex_unlock(&dns_lock);
+
+        while (w != NULL) {
+            dns_waiter *next = w->next;
+            w->done(w->arg, ok, addr);
+            Free(w);
+            w = next;
+        }
+    }
+    return NULL;
+}
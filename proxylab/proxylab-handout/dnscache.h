@@ -0,0 +1,28 @@
+#ifndef __DNSCACHE_H__
+#define __DNSCACHE_H__
+
+#include "csapp.h"
+
+/*
+* dnscache.h - shared host name -> IPv4 address cache with positive and
+* negative TTLs, filled by a small pool of resolver threads
+*/
+
+#define DNS_BUCKET_NUM 256 // hash buckets of the host table
+#define DNS_TTL_SECS 60 // lifetime of a resolved address
+#define DNS_NEG_TTL_SECS 5 // lifetime of a failed lookup
+#define DNS_RESOLVER_NUM 2 // resolver threads
+
+// called from a resolver thread once an asynchronous lookup ends
+typedef void (*dns_callback)(void *arg, int ok, struct in_addr addr);
+
+void init_dns_cache(int resolver_num);
+// resolve host_name into addr, blocking; 0 on success, -1 on failure
+int dns_lookup(char *host_name, struct in_addr *addr);
+/*
+* resolve without blocking: 1 with addr filled in, -1 on failure, or 0
+* if the lookup is still running and done will be called with the result
+*/
+int dns_lookup_async(char *host_name, struct in_addr *addr, dns_callback done, void *arg);
+
+#endif /* __DNSCACHE_H__ */
@@ -0,0 +1,1122 @@
+/*
+* event.c - epoll based serving mode of the proxy
+*
+* every loop thread owns an SO_REUSEPORT listener, so the kernel spreads
+* new connections over the loops, and its own epoll instance. sockets
+* are non-blocking and registered edge-triggered; each event re-runs the
+* state machine of its connection until some socket would block:
+*
+*   READ_REQUEST -> RESOLVE -> CONNECT -> SEND_REQUEST -> RELAY -> DONE
+*        \---------> WRITE_CACHED / WRITE_DISK / WRITE_STATS -------/
+*
+* pooled keep-alive server connections skip RESOLVE and CONNECT, and go
+* back to the pool once the framer sees the end of the response. with
+* the disk tier on, a memory miss parks in DISK while the disk thread
+* looks it up. a host missing from the DNS cache parks its connection in
+* RESOLVE, and a miss on a uri that another connection is already
+* fetching parks it in COALESCE; the disk or resolver thread or the fetch
+* leader posts it back to the mailbox of its loop and wakes the loop through an eventfd. once per
+* EVENT_TICK_MSECS a loop closes the connections that are past their
+* head deadline or idle, so slow clients cannot hold buffers forever
+*/
+#define _GNU_SOURCE
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include "csapp.h"
+#include "proxy.h"
+#include "event.h"
+#include "http.h"
+#include "request.h"
+#include "upstream.h"
+#include "dnscache.h"
+#include "flight.h"
+#include "diskcache.h"
+#include "stats.h"
+#include "log.h"
+#include "accesslog.h"
+#include "range.h"
+
+typedef enum {
+    CONN_READ_REQUEST, // reading the request header from the client
+    CONN_DISK, // waiting for the disk thread to look the uri up
+    CONN_COALESCE, // waiting for another fetch of the same uri to land
+    CONN_RESOLVE, // waiting for a resolver thread to look up the server
+    CONN_CONNECT, // waiting for the non-blocking connect to the server
+    CONN_SEND_REQUEST, // writing the forward request to the server
+    CONN_RELAY, // copying the response from the server to the client
+    CONN_WRITE_CACHED, // writing a pinned cache block to the client
+    CONN_WRITE_DISK, // sending an object from the disk tier to the client
+    CONN_WRITE_STATS, // writing the statistics response in out to the client
+    CONN_DONE // closed, freed after the current batch of events
+} conn_state;
+
+struct conn;
+struct event_loop;
+
+// epoll user data, tells which socket of the connection fired
+typedef struct {
+    struct conn *c;
+    int fd;
+} conn_end;
+
+typedef struct conn {
+    conn_state state;
+    conn_end client;
+    conn_end server;
+    char req[REQ_HEAD_SIZE + 1]; // request header, nul terminated
+    int req_len;
+    char *out; // forward request, kept to retry a stale pooled connection
+    int out_len, out_off;
+    char buf[EVENT_RELAY_SIZE]; // server bytes not yet sent to the client
+    int buf_len, buf_off;
+    char *uri; // cache key
+    char *host_name; // origin, the key of the upstream pool
+    int port;
+    struct in_addr addr; // server address once resolved
+    int dns_ok;
+    int disk_found; // the disk lookup filled in disk
+    int leader; // c fetches uri for the connections parked in COALESCE
+    int parked; // a resolver or disk thread or a fetch leader still refers to c
+    struct event_loop *lp;
+    int reused; // the server connection came from the pool
+    int resp_started; // some response bytes arrived
+    resp_framer framer;
+    s_cache_builder builder; // response assembled for the cache
+    s_buf_block *cached; // pinned block on a cache hit
+    int cached_start, cached_off, cached_end; // the part of it to send, after out
+    req_span range; // Range and If-Range of the request in req
+    req_span if_range;
+    s_buf_block *stale; // pinned stale block the request revalidates
+    int held; // the response head stays in the builder until it is known
+    int held_len, held_off; // held bytes still to be sent to the client
+    disk_hit disk; // open segment of a disk tier hit, fd -1 otherwise
+    long long stage_start; // of the connect or the wait for the first byte
+    long long req_start; // of the request, for the access log
+    char *log_uri; // the uri in req, NULL until the request is parsed
+    const char *result; // how the request was served
+    int status; // response status sent, 0 if unknown
+    long long sent; // response bytes sent to the client
+    time_t accepted; // loop clock at accept, for the head deadline
+    time_t active; // and when c last made progress
+    struct conn *prev_live; // on the live list of its loop
+    struct conn *next_live;
+    struct conn *next_dead;
+    struct conn *next_mail;
+} conn;
+
+typedef struct event_loop {
+    int epfd;
+    int listenfd;
+    int port;
+    int spare_fd; // kept open to accept and drop a client once out of fds
+    time_t now; // CLOCK_MONOTONIC seconds, read after every epoll_wait
+    conn *live; // open connections, looked at by the timeout sweep
+    conn *dead; // closed connections, freed after the batch
+    int wakefd; // eventfd, signalled when mail arrives
+    pthread_mutex_t mail_lock;
+    conn *mail; // connections whose lookup finished
+} event_loop;
+
+static void *loop_thread(void *vargp);
+static void loop_start(event_loop *lp);
+static int open_reuseport_listenfd(int port);
+static void accept_all(event_loop *lp);
+static int drop_client(event_loop *lp);
+static void sweep_timeouts(event_loop *lp);
+static time_t loop_clock(void);
+static void conn_drive(event_loop *lp, conn *c, int server_ready);
+static void conn_close(event_loop *lp, conn *c);
+static int read_request(conn *c);
+static int start_request(event_loop *lp, conn *c);
+static int join_flight(event_loop *lp, conn *c);
+static int fetch_server(event_loop *lp, conn *c);
+static int connect_server(event_loop *lp, conn *c);
+static void post_mail(conn *c);
+static void flight_done(void *arg);
+static void dns_done(void *arg, int ok, struct in_addr addr);
+static void disk_done(void *arg, int found);
+static void read_mail(event_loop *lp);
+static int rejoin(event_loop *lp, conn *c);
+static void land_early(conn *c);
+static void rule_out_cache(conn *c);
+static int connect_addr(event_loop *lp, conn *c);
+static int watch_server(event_loop *lp, conn *c, int fd);
+static int retry_server(event_loop *lp, conn *c);
+static int relay_head(conn *c);
+static void write_cached(conn *c);
+static void write_disk(conn *c);
+static void finish_response(event_loop *lp, conn *c);
+static void not_modified(event_loop *lp, conn *c);
+static void release_server(event_loop *lp, conn *c);
+static int flush_out(int fd, char *buf, int len, int *off);
+
+/*
+* event_main - start loop_num event loops on port, the calling thread
+* runs the last one
+*/
+void event_main(int port, int loop_num)
+{
+    int i;
+    pthread_t tid;
+    event_loop *lp;
+
+    for (i = 0; i < loop_num; i++) {
+        lp = Malloc(sizeof(event_loop));
+        lp->port = port;
+        lp->dead = NULL;
+        lp->mail = NULL;
+        pthread_mutex_init(&lp->mail_lock, NULL);
+        if (i == loop_num - 1)
+            loop_start(lp);
+        else
+            Pthread_create(&tid, NULL, loop_thread, lp);
+    }
+}
+
+static void *loop_thread(void *vargp)
+{
+    Pthread_detach(pthread_self());
+    loop_start((event_loop *)vargp);
+    return NULL;
+}
+
+// open the listener and the epoll instance of lp and serve forever
+static void loop_start(event_loop *lp)
+{
+    struct epoll_event events[EVENT_MAX_EVENTS];
+    struct epoll_event ev;
+    int i, n;
+    time_t next_sweep;
+
+    lp->listenfd = open_reuseport_listenfd(lp->port);
+    lp->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    lp->live = NULL;
+    lp->now = next_sweep = loop_clock();
+    if ((lp->epfd = epoll_create1(0)) < 0)
+        unix_error("epoll_create1 error");
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL; // the listener
+    if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, lp->listenfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    if ((lp->wakefd = eventfd(0, EFD_NONBLOCK)) < 0)
+        unix_error("eventfd error");
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = lp; // the mailbox
+    if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, lp->wakefd, &ev) < 0)
+        unix_error("epoll_ctl error");
+
+    while (1) {
+        n = epoll_wait(lp->epfd, events, EVENT_MAX_EVENTS, EVENT_TICK_MSECS);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("epoll_wait error");
+        }
+        lp->now = loop_clock();
+        for (i = 0; i < n; i++) {
+            conn_end *end = (conn_end *)events[i].data.ptr;
+            if (end == NULL) {
+                accept_all(lp);
+                continue;
+            }
+            if (events[i].data.ptr == lp) {
+                read_mail(lp);
+                continue;
+            }
+            if (end->c->state == CONN_DONE)
+                continue; // closed earlier in this batch
+            conn_drive(lp, end->c, end == &end->c->server &&
+                       (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)));
+        }
+        if (lp->now >= next_sweep) {
+            sweep_timeouts(lp);
+            next_sweep = lp->now + EVENT_TICK_MSECS / 1000;
+        }
+        // nothing in this batch refers to the closed connections any more
+        while (lp->dead != NULL) {
+            conn *c = lp->dead;
+            lp->dead = c->next_dead;
+            Free(c);
+        }
+    }
+}
+
+// non-blocking listener that shares its port with the other loops
+static int open_reuseport_listenfd(int port)
+{
+    int listenfd, optval = 1;
+    struct sockaddr_in serveraddr;
+
+    if ((listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        unix_error("socket error");
+    Setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+    Setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int));
+    bzero((char *) &serveraddr, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serveraddr.sin_port = htons((unsigned short)port);
+    Bind(listenfd, (SA *)&serveraddr, sizeof(serveraddr));
+    Listen(listenfd, LISTENQ);
+    return listenfd;
+}
+
+/*
+* accept_all - accept until the backlog is empty, as the listener is
+* edge-triggered and will not fire again for clients already waiting.
+* out of descriptors, the waiting clients are dropped instead of left
+* in the backlog; the sweep calls here too in case one was missed
+*/
+static void accept_all(event_loop *lp)
+{
+    int connfd;
+    conn *c;
+    struct epoll_event ev;
+
+    while (1) {
+        if ((connfd = accept4(lp->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+            if ((errno == EMFILE || errno == ENFILE) && drop_client(lp))
+                continue;
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return; // EAGAIN, the backlog is empty, or no fd to drop with
+        }
+        c = Malloc(sizeof(conn));
+        c->state = CONN_READ_REQUEST;
+        c->client.c = c;
+        c->client.fd = connfd;
+        c->server.c = c;
+        c->server.fd = -1;
+        c->req_len = 0;
+        c->out = NULL;
+        c->buf_len = c->buf_off = 0;
+        c->uri = NULL;
+        c->host_name = NULL;
+        c->leader = c->parked = 0;
+        c->lp = lp;
+        c->reused = c->resp_started = 0;
+        init_resp_framer(&c->framer);
+        init_cache_builder(&c->builder);
+        c->cached = NULL;
+        c->stale = NULL;
+        c->held = c->held_len = c->held_off = 0;
+        c->disk.fd = -1;
+        c->disk_found = 0;
+        c->log_uri = NULL;
+        c->status = 0;
+        c->sent = 0;
+        c->accepted = c->active = lp->now;
+        c->next_dead = NULL;
+        stats_add(STAT_CONNECTIONS, 1);
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = &c->client;
+        if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+            close(connfd);
+            Free(c);
+            continue;
+        }
+        c->prev_live = NULL;
+        c->next_live = lp->live;
+        if (lp->live != NULL)
+            lp->live->prev_live = c;
+        lp->live = c;
+    }
+}
+
+/*
+* drop_client - free the spare descriptor for one accept and close that
+* client at once. return 0 if no client could be dropped, the next sweep
+* tries again
+*/
+static int drop_client(event_loop *lp)
+{
+    int fd;
+
+    if (lp->spare_fd < 0 && (lp->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;
+    log_info("out of file descriptors, dropping a client");
+    close(lp->spare_fd);
+    if ((fd = accept4(lp->listenfd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+        close(fd);
+    // taken back before any accept can have the descriptor
+    lp->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return fd >= 0;
+}
+
+/*
+* sweep_timeouts - close the connections of lp still without a request
+* head EVENT_HEAD_SECS after accept, or without progress for
+* EVENT_IDLE_SECS, stop the ones coalesced for FLIGHT_WAIT_SECS from
+* waiting, and pick up clients a missed edge left in the backlog
+*/
+static void sweep_timeouts(event_loop *lp)
+{
+    conn *c, *next;
+
+    for (c = lp->live; c != NULL; c = next) {
+        next = c->next_live;
+        // a coalesced connection gives up on a stuck leader and fetches itself
+        if (c->state == CONN_COALESCE) {
+            if (lp->now - c->active >= FLIGHT_WAIT_SECS && flight_leave(c->uri, flight_done, c)) {
+                c->parked = 0;
+                if (rejoin(lp, c) < 0)
+                    conn_close(lp, c);
+                else
+                    conn_drive(lp, c, 0);
+            }
+            continue;
+        }
+        if ((c->state == CONN_READ_REQUEST && lp->now - c->accepted >= EVENT_HEAD_SECS)
+            || lp->now - c->active >= EVENT_IDLE_SECS) {
+            log_debug("closing a timed out connection");
+            conn_close(lp, c);
+        }
+    }
+    accept_all(lp);
+}
+
+static time_t loop_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+/*
+* conn_drive - advance c until it finishes or a socket would block.
+* server_ready is set when the server socket reported writable or an
+* error, which is how a pending connect completes
+*/
+static void conn_drive(event_loop *lp, conn *c, int server_ready)
+{
+    int rc, n, used, err;
+    socklen_t errlen = sizeof(err);
+
+    c->active = lp->now;
+    while (1) {
+        switch (c->state) {
+        case CONN_READ_REQUEST:
+            if ((rc = read_request(c)) == 0)
+                return;
+            if (rc < 0 || start_request(lp, c) < 0) {
+                conn_close(lp, c);
+                return;
+            }
+            break;
+
+        case CONN_DISK:
+        case CONN_COALESCE:
+        case CONN_RESOLVE:
+            return;
+
+        case CONN_CONNECT:
+            if (!server_ready)
+                return;
+            if (getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0
+                || err != 0) {
+                stats_add(STAT_UPSTREAM_ERRORS, 1);
+                conn_close(lp, c);
+                return;
+            }
+            stats_time(STAGE_CONNECT, stats_now() - c->stage_start);
+            c->state = CONN_SEND_REQUEST;
+            break;
+
+        case CONN_SEND_REQUEST:
+            rc = flush_out(c->server.fd, c->out, c->out_len, &c->out_off);
+            if (rc < 0 && c->reused) {
+                if (retry_server(lp, c) < 0) {
+                    conn_close(lp, c);
+                    return;
+                }
+                break;
+            }
+            if (rc <= 0) {
+                if (rc < 0)
+                    conn_close(lp, c);
+                return;
+            }
+            c->stage_start = stats_now();
+            c->state = CONN_RELAY;
+            break;
+
+        case CONN_RELAY:
+            // the rewritten head in out, then the body bytes held with it
+            if (c->out_off < c->out_len || c->held_off < c->held_len) {
+                if ((rc = flush_out(c->client.fd, c->out, c->out_len, &c->out_off)) > 0)
+                    rc = flush_out(c->client.fd, c->builder.pblock->buf, c->held_len,
+                                   &c->held_off);
+                if (rc <= 0) {
+                    if (rc < 0)
+                        conn_close(lp, c);
+                    return;
+                }
+                if (!resp_is_cacheable(&c->framer))
+                    rule_out_cache(c); // the held head is out, nothing left to keep
+            }
+            if (c->buf_off < c->buf_len) {
+                if ((rc = flush_out(c->client.fd, c->buf, c->buf_len, &c->buf_off)) <= 0) {
+                    if (rc < 0)
+                        conn_close(lp, c);
+                    return;
+                }
+            }
+            if (c->framer.state == RESP_DONE) {
+                finish_response(lp, c);
+                return;
+            }
+            n = read(c->server.fd, c->buf, EVENT_RELAY_SIZE);
+            if (n > 0) {
+                if (!c->resp_started)
+                    stats_time(STAGE_TTFB, stats_now() - c->stage_start);
+                c->resp_started = 1;
+                used = feed_resp_framer(&c->framer, c->buf, n);
+                if (used < n)
+                    c->framer.keep_alive = 0; // bytes past the response
+                c->buf_len = used;
+                c->buf_off = 0;
+                if (!append_to_cache_builder(&c->builder, c->buf, used)) {
+                    if (c->held) {
+                        conn_close(lp, c); // an absurdly long head
+                        return;
+                    }
+                    land_early(c);
+                }
+                if (c->held) {
+                    c->buf_off = used; // kept in the builder instead
+                    if (c->framer.state != RESP_HEAD) {
+                        c->held = 0;
+                        if (c->stale != NULL && c->framer.status == 304) {
+                            not_modified(lp, c);
+                            break;
+                        }
+                        // the object changed or was never cached, relay the new response
+                        if (!resp_is_cacheable(&c->framer))
+                            land_early(c);
+                        if (relay_head(c) < 0) {
+                            conn_close(lp, c);
+                            return;
+                        }
+                    }
+                }
+                else if (c->framer.state != RESP_HEAD && !resp_is_cacheable(&c->framer))
+                    rule_out_cache(c);
+                // held bytes are counted once the head is known
+                stats_add(STAT_BYTES_RELAYED, c->buf_len - c->buf_off);
+                c->sent += c->buf_len - c->buf_off;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            } else if (n < 0 && errno == EINTR) {
+                break;
+            } else if (c->reused && !c->resp_started) {
+                // the pooled connection went stale, use a fresh one
+                if (retry_server(lp, c) < 0) {
+                    conn_close(lp, c);
+                    return;
+                }
+            } else if (n == 0 && c->framer.state == RESP_UNTIL_CLOSE) {
+                c->framer.state = RESP_DONE; // an unframed body ends with EOF
+            } else {
+                conn_close(lp, c);
+                return;
+            }
+            break;
+
+        case CONN_WRITE_CACHED:
+            if ((rc = flush_out(c->client.fd, c->out, c->out_len, &c->out_off)) > 0)
+                rc = flush_out(c->client.fd, c->cached->buf, c->cached_end, &c->cached_off);
+            c->sent = c->out_off + c->cached_off - c->cached_start;
+            if (rc > 0)
+                stats_add(STAT_BYTES_CACHED, c->sent);
+            if (rc != 0)
+                conn_close(lp, c);
+            return;
+
+        case CONN_WRITE_STATS:
+            if (flush_out(c->client.fd, c->out, c->out_len, &c->out_off) != 0)
+                conn_close(lp, c);
+            return;
+
+        case CONN_WRITE_DISK:
+            if ((rc = flush_out(c->client.fd, c->out, c->out_len, &c->out_off)) <= 0) {
+                if (rc < 0)
+                    conn_close(lp, c);
+                return;
+            }
+            c->sent = c->out_off;
+            while (c->disk.size > 0) {
+                n = sendfile(c->client.fd, c->disk.fd, &c->disk.offset, c->disk.size);
+                if (n > 0) {
+                    c->disk.size -= n;
+                    stats_add(STAT_BYTES_CACHED, n);
+                    c->sent += n;
+                }
+                else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    return;
+                else if (n < 0 && errno == EINTR)
+                    continue;
+                else
+                    break;
+            }
+            conn_close(lp, c);
+            return;
+
+        case CONN_DONE:
+            return;
+        }
+    }
+}
+
+// close both sockets and queue c to be freed after the batch
+static void conn_close(event_loop *lp, conn *c)
+{
+    if (c->log_uri != NULL) {
+        if (c->status == 0 && c->sent > 0)
+            c->status = c->framer.status; // relayed from the origin
+        access_log("GET", c->log_uri, c->status, c->sent, c->req_start, c->result);
+    }
+    close(c->client.fd);
+    if (c->server.fd >= 0)
+        close(c->server.fd);
+    if (c->cached != NULL)
+        release_cache_block(c->cached);
+    if (c->stale != NULL)
+        release_cache_block(c->stale);
+    // the disk thread may be filling disk in, read_mail() closes that fd
+    if (c->disk.fd >= 0 && c->state != CONN_DISK)
+        close(c->disk.fd);
+    if (c->out != NULL)
+        Free(c->out);
+    if (c->leader)
+        flight_land(c->uri); // after finish_response() cached the object
+    if (c->uri != NULL)
+        Free(c->uri);
+    if (c->host_name != NULL)
+        Free(c->host_name);
+    free_cache_builder(&c->builder);
+    c->state = CONN_DONE;
+    if (c->prev_live != NULL)
+        c->prev_live->next_live = c->next_live;
+    else
+        lp->live = c->next_live;
+    if (c->next_live != NULL)
+        c->next_live->prev_live = c->prev_live;
+    // a parked connection is still referenced, read_mail() frees it
+    if (c->parked)
+        return;
+    c->next_dead = lp->dead;
+    lp->dead = c;
+}
+
+/*
+* read_request - read what the client sent so far, return 1 once the
+* header is complete, 0 if more is needed and -1 on error or overflow
+*/
+static int read_request(conn *c)
+{
+    int n;
+
+    while (1) {
+        n = read(c->client.fd, c->req + c->req_len, REQ_HEAD_SIZE - c->req_len);
+        if (n > 0) {
+            c->req_len += n;
+            c->req[c->req_len] = '\0';
+            if (req_head_len(c->req, c->req_len, c->req_len - n) > 0)
+                return 1;
+            if (c->req_len == REQ_HEAD_SIZE)
+                return -1;
+        } else if (n == 0) {
+            return -1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+/*
+* start_request - parse the complete request header, then either pin a
+* cached object or build the forward request and fetch it, unless the
+* same uri is already being fetched
+*/
+static int start_request(event_loop *lp, conn *c)
+{
+    http_request r;
+    struct iovec iov[FORWARD_IOV_MAX];
+    char host_name[MAXLINE];
+    char *uri, *p;
+    int i, iovcnt, format, rc;
+    long long start;
+
+    // the endpoint is asked of the proxy itself, not through it
+    if ((format = stats_request(c->req, c->req_len)) != 0) {
+        c->out = Malloc(STATS_RESPONSE_SIZE);
+        c->out_len = stats_render(c->out, STATS_RESPONSE_SIZE, format);
+        c->out_off = 0;
+        c->state = CONN_WRITE_STATS;
+        return 0;
+    }
+    stats_add(STAT_REQUESTS, 1);
+    start = stats_now();
+    rc = parse_http_request(&r, c->req, c->req_len);
+    stats_time(STAGE_PARSE, stats_now() - start);
+    if (rc <= 0 || !req_span_is(c->req, r.method, "GET")) {
+        log_info("malformed or not a GET request, closing the connection");
+        return -1;
+    }
+    // the blank after the uri is never forwarded, terminate it in place
+    uri = c->req + r.uri.off;
+    uri[r.uri.len] = '\0';
+    c->req_start = start;
+    c->log_uri = uri;
+    c->result = "ERROR";
+    c->range = r.range;
+    c->if_range = r.if_range;
+    req_span_str(c->req, r.host, host_name, MAXLINE);
+    log_debug("uri: %s", uri);
+
+    start = stats_now();
+    if ((c->cached = check_for_cache(uri, &cache)) != NULL) {
+        if (is_cache_block_fresh(c->cached)) {
+            stats_time(STAGE_LOOKUP, stats_now() - start);
+            stats_add(STAT_HITS, 1);
+            c->result = "HIT";
+            write_cached(c);
+            return 0;
+        }
+        // revalidate a stale object if the origin gave it a validator
+        if (c->cached->etag != NULL || c->cached->last_modified != NULL)
+            c->stale = c->cached;
+        else
+            release_cache_block(c->cached);
+        c->cached = NULL;
+    }
+    stats_time(STAGE_LOOKUP, stats_now() - start);
+    c->uri = Malloc(strlen(uri) + 1);
+    strcpy(c->uri, uri);
+    c->host_name = Malloc(strlen(host_name) + 1);
+    strcpy(c->host_name, host_name);
+    c->port = r.port;
+
+    // flatten the gathered request, it is written out nonblocking
+    c->held = 1;
+    iovcnt = forward_request_iov(&r, c->req, c->stale, iov);
+    for (i = 0, c->out_len = 0; i < iovcnt; i++)
+        c->out_len += iov[i].iov_len;
+    p = c->out = Malloc(c->out_len);
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    c->out_off = 0;
+
+    // the disk tier is read on the disk thread, read_mail() goes on
+    if (c->stale == NULL && disk_cache_enabled()) {
+        c->parked = 1;
+        c->state = CONN_DISK;
+        disk_cache_lookup_async(c->uri, &c->disk, disk_done, c);
+        return 0;
+    }
+    return join_flight(lp, c);
+}
+
+// fetch the uri of c, or wait for the fetch already under way
+static int join_flight(event_loop *lp, conn *c)
+{
+    if (!flight_join(c->uri, flight_done, c)) {
+        stats_add(STAT_COALESCED, 1);
+        c->parked = 1;
+        c->state = CONN_COALESCE;
+        return 0;
+    }
+    c->leader = 1;
+    stats_add(STAT_MISSES, 1);
+    c->result = "MISS";
+    return fetch_server(lp, c);
+}
+
+// send the request of c over a pooled server connection or a new one
+static int fetch_server(event_loop *lp, conn *c)
+{
+    int fd;
+
+    if ((fd = upstream_take(c->host_name, c->port)) >= 0) {
+        c->reused = 1;
+        if (watch_server(lp, c, fd) < 0)
+            return -1;
+        c->state = CONN_SEND_REQUEST;
+        return 0;
+    }
+    return connect_server(lp, c);
+}
+
+/*
+* connect_server - resolve the origin of c through the DNS cache, and
+* connect right away on a hit. on a miss c waits in CONN_RESOLVE until
+* read_mail() picks up the result
+*/
+static int connect_server(event_loop *lp, conn *c)
+{
+    int rc = dns_lookup_async(c->host_name, &c->addr, dns_done, c);
+
+    if (rc < 0)
+        return -1;
+    if (rc == 0) {
+        c->parked = 1;
+        c->state = CONN_RESOLVE;
+        return 0;
+    }
+    return connect_addr(lp, c);
+}
+
+// post c to the mailbox of its loop and wake the loop up
+static void post_mail(conn *c)
+{
+    event_loop *lp = c->lp;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&lp->mail_lock);
+    c->next_mail = lp->mail;
+    lp->mail = c;
+    pthread_mutex_unlock(&lp->mail_lock);
+    if (write(lp->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        unix_error("eventfd write error");
+}
+
+// runs on the thread of the fetch leader once it has landed
+static void flight_done(void *arg)
+{
+    post_mail((conn *)arg);
+}
+
+// runs on a resolver thread, the mail lock orders the result before c
+static void dns_done(void *arg, int ok, struct in_addr addr)
+{
+    conn *c = (conn *)arg;
+
+    c->addr = addr;
+    c->dns_ok = ok;
+    post_mail(c);
+}
+
+// runs on the disk thread, which has filled in c->disk on a hit
+static void disk_done(void *arg, int found)
+{
+    conn *c = (conn *)arg;
+
+    c->disk_found = found;
+    post_mail(c);
+}
+
+/*
+* read_mail - resume the connections whose lookup or coalesced fetch
+* finished, free the ones closed meanwhile. a disk miss goes on to
+* fetch, and a coalesced connection looks in the cache again and fetches
+* on its own if the leader cached nothing
+*/
+static void read_mail(event_loop *lp)
+{
+    uint64_t count;
+    conn *c, *next;
+
+    while (read(lp->wakefd, &count, sizeof(count)) > 0)
+        ;
+    pthread_mutex_lock(&lp->mail_lock);
+    c = lp->mail;
+    lp->mail = NULL;
+    pthread_mutex_unlock(&lp->mail_lock);
+    for (; c != NULL; c = next) {
+        next = c->next_mail;
+        c->parked = 0;
+        if (c->state == CONN_DONE) {
+            // closed while parked, free it with the rest of the batch
+            if (c->disk_found)
+                close(c->disk.fd);
+            c->next_dead = lp->dead;
+            lp->dead = c;
+            continue;
+        }
+        if (c->state == CONN_DISK) {
+            if (c->disk_found) {
+                stats_add(STAT_DISK_HITS, 1);
+                log_debug("disk cache hit: %s", c->uri);
+                c->result = "DISK";
+                write_disk(c);
+            } else if (join_flight(lp, c) < 0) {
+                conn_close(lp, c);
+                continue;
+            }
+        } else if (c->state == CONN_COALESCE) {
+            if (rejoin(lp, c) < 0) {
+                conn_close(lp, c);
+                continue;
+            }
+        } else if (!c->dns_ok || connect_addr(lp, c) < 0) {
+            stats_add(STAT_UPSTREAM_ERRORS, 1);
+            conn_close(lp, c);
+            continue;
+        }
+        conn_drive(lp, c, 0);
+    }
+}
+
+// a coalesced c looks in the cache again, and fetches on its own on a miss
+static int rejoin(event_loop *lp, conn *c)
+{
+    if ((c->cached = check_for_cache(c->uri, &cache)) != NULL
+        && !is_cache_block_fresh(c->cached)) {
+        release_cache_block(c->cached);
+        c->cached = NULL;
+    }
+    if (c->cached != NULL) {
+        c->result = "JOINED";
+        write_cached(c);
+        return 0;
+    }
+    stats_add(STAT_MISSES, 1); // the leader cached nothing, or is stuck
+    c->result = "MISS";
+    return fetch_server(lp, c);
+}
+
+// the fetch of c will not fill the cache, release its followers now
+static void land_early(conn *c)
+{
+    if (c->leader) {
+        flight_land(c->uri);
+        c->leader = 0;
+    }
+}
+
+/*
+* rule_out_cache - the response of c will not be cached: release the
+* followers and stop copying it into the builder
+*/
+static void rule_out_cache(conn *c)
+{
+    land_early(c);
+    abandon_cache_builder(&c->builder);
+}
+
+/*
+* connect_addr - start a non-blocking connect to the resolved address of
+* c, the state machine waits in CONN_CONNECT until the socket turns
+* writable
+*/
+static int connect_addr(event_loop *lp, conn *c)
+{
+    struct sockaddr_in serveraddr;
+    int fd, rc;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (watch_server(lp, c, fd) < 0)
+        return -1;
+    bzero((char *) &serveraddr, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_addr = c->addr;
+    serveraddr.sin_port = htons((unsigned short)c->port);
+    c->stage_start = stats_now();
+    rc = connect(fd, (SA *)&serveraddr, sizeof(serveraddr));
+    if (rc < 0 && errno != EINPROGRESS)
+        return -1;
+    if (rc == 0)
+        stats_time(STAGE_CONNECT, stats_now() - c->stage_start);
+    c->state = rc == 0 ? CONN_SEND_REQUEST : CONN_CONNECT;
+    return 0;
+}
+
+// make fd the non-blocking server socket of c and register it
+static int watch_server(event_loop *lp, conn *c, int fd)
+{
+    struct epoll_event ev;
+
+    c->server.fd = fd;
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+        return -1;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = &c->server;
+    return epoll_ctl(lp->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// drop a stale pooled connection and send the request on a new one
+static int retry_server(event_loop *lp, conn *c)
+{
+    close(c->server.fd);
+    c->server.fd = -1;
+    c->reused = 0;
+    c->out_off = 0;
+    c->held = 1;
+    init_resp_framer(&c->framer);
+    free_cache_builder(&c->builder);
+    return connect_server(lp, c);
+}
+
+/*
+* finish_response - the whole response reached the client: cache it,
+* hand a keep-alive server connection back to the pool and close c
+*/
+static void finish_response(event_loop *lp, conn *c)
+{
+    s_cache_meta meta;
+
+    if (resp_is_cacheable(&c->framer)
+        && (!c->framer.chunked || resp_dechunk(&c->builder))) {
+        resp_cache_meta(&c->framer, &meta);
+        commit_cache_builder(&c->builder, c->uri, resp_is_framed(&c->framer),
+                             &meta, &cache);
+    }
+    release_server(lp, c);
+    conn_close(lp, c);
+}
+
+/*
+* relay_head - the response head held for c is complete: strip it in the
+* builder and put the head the client gets in out, in place of the
+* forward request. every response ends the client connection of a loop
+*/
+static int relay_head(conn *c)
+{
+    long head_len;
+
+    if ((head_len = resp_strip_head(&c->builder, &c->framer)) < 0)
+        return -1; // too long to relay
+    Free(c->out);
+    c->out = Malloc(RESP_HEAD_SIZE);
+    c->out_len = resp_connection_head(c->builder.pblock->buf, head_len, 0,
+                                      c->out, RESP_HEAD_SIZE);
+    c->out_off = 0;
+    c->held_off = head_len;
+    c->held_len = c->builder.pblock->valid_buf_size;
+    stats_add(STAT_BYTES_RELAYED, c->out_len + c->held_len - c->held_off);
+    c->sent += c->out_len + c->held_len - c->held_off;
+    return 0;
+}
+
+// a 304 for the stale object: refresh it and send it to the client
+static void not_modified(event_loop *lp, conn *c)
+{
+    s_cache_meta meta;
+
+    resp_cache_meta(&c->framer, &meta);
+    refresh_cache_block(c->stale, meta.expires);
+    land_early(c);
+    stats_add(STAT_REVALIDATED, 1);
+    c->result = "REVAL";
+    log_debug("revalidated: %s", c->uri);
+    free_cache_builder(&c->builder);
+    release_server(lp, c);
+    c->cached = c->stale;
+    c->stale = NULL;
+    write_cached(c);
+}
+
+/*
+* write_cached - send the pinned c->cached to the client: its head with a
+* Connection header, or a 206 head, in out followed by the body or the
+* requested range of it. out no longer holds the forward request, which
+* was sent or never will be
+*/
+static void write_cached(conn *c)
+{
+    range_reply reply;
+    long head_len;
+
+    if (c->out != NULL)
+        Free(c->out);
+    c->status = 200; // only 200 responses are cached
+    if (range_reply_for(c->req, c->range, c->if_range, c->cached->buf,
+                        c->cached->valid_buf_size, c->cached->valid_buf_size, 0, &reply)) {
+        c->status = reply.status;
+        stats_add(STAT_PARTIAL, 1);
+    } else {
+        head_len = resp_head_len(c->cached->buf, c->cached->valid_buf_size);
+        reply.head_len = resp_connection_head(c->cached->buf, head_len, 0,
+                                              reply.head, RANGE_HEAD_SIZE);
+        reply.body_off = head_len;
+        reply.body_len = c->cached->valid_buf_size - head_len;
+    }
+    if (reply.head_len < 0)
+        reply.head_len = reply.body_len = 0; // cannot happen to a cached head, send nothing
+    c->out = Malloc(reply.head_len);
+    memcpy(c->out, reply.head, reply.head_len);
+    c->out_len = reply.head_len;
+    c->out_off = 0;
+    c->cached_start = c->cached_off = reply.body_off;
+    c->cached_end = reply.body_off + reply.body_len;
+    c->state = CONN_WRITE_CACHED;
+}
+
+/*
+* write_disk - send the disk tier hit in c->disk to the client, its head
+* with a Connection header or a 206 head in out, then the body or the
+* requested range of it. the head is read back from the segment to build
+* the one sent
+*/
+static void write_disk(conn *c)
+{
+    range_reply reply;
+    char resp[RANGE_HEAD_SIZE];
+    long head_len = 0;
+    int n;
+
+    if (c->out != NULL)
+        Free(c->out);
+    c->status = 200;
+    if ((n = disk_cache_peek(&c->disk, resp, sizeof(resp))) > 0)
+        head_len = resp_head_len(resp, n);
+    if (head_len > 0
+        && range_reply_for(c->req, c->range, c->if_range, resp, n, c->disk.size, 0, &reply)) {
+        c->disk.offset += reply.body_off;
+        c->disk.size = reply.body_len;
+        c->status = reply.status;
+        stats_add(STAT_PARTIAL, 1);
+    } else {
+        reply.head_len = resp_connection_head(resp, head_len, 0, reply.head, RANGE_HEAD_SIZE);
+        c->disk.offset += head_len;
+        c->disk.size -= head_len;
+    }
+    if (reply.head_len < 0)
+        reply.head_len = c->disk.size = 0; // the segment could not be read, send nothing
+    c->out = Malloc(reply.head_len);
+    memcpy(c->out, reply.head, reply.head_len);
+    c->out_len = reply.head_len;
+    c->out_off = 0;
+    c->state = CONN_WRITE_DISK;
+}
+
+// hand the server connection back to the pool, or close it
+static void release_server(event_loop *lp, conn *c)
+{
+    int fd = c->server.fd;
+
+    epoll_ctl(lp->epfd, EPOLL_CTL_DEL, fd, NULL);
+    // pooled connections are shared with the blocking threads
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    upstream_release(c->host_name, c->port, fd, c->framer.keep_alive);
+    c->server.fd = -1;
+}
+
+/*
+* flush_out - write buf[*off..len) to fd, return 1 when all of it is
+* written, 0 if the socket would block and -1 on error
+*/
+static int flush_out(int fd, char *buf, int len, int *off)
+{
+    int n;
+
+    while (*off < len) {
+        n = write(fd, buf + *off, len - *off);
+        if (n > 0) {
+            *off += n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return -1;
+        }
+    }
+    return 1;
+}
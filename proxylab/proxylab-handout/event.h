@@ -0,0 +1,19 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+/*
+* event.h - non-blocking, edge-triggered epoll serving mode of the proxy.
+* every loop thread owns an SO_REUSEPORT listener and an epoll instance
+* and drives each connection through a small state machine
+*/
+
+#define EVENT_MAX_EVENTS 64 // events handled per epoll_wait
+#define EVENT_RELAY_SIZE MAXBUF // relay buffer per connection
+#define EVENT_TICK_MSECS 1000 // how often a loop looks for timed out connections
+#define EVENT_HEAD_SECS 10 // time a client has to send its request head
+#define EVENT_IDLE_SECS 30 // connections without any progress for longer are closed
+
+// run loop_num event loops on port, never returns
+void event_main(int port, int loop_num);
+
+#endif /* __EVENT_H__ */
@@ -0,0 +1,154 @@
+/*
+* flight.c - request coalescing for concurrent cache misses
+*
+* a uri has an entry here only while its leader fetches it from the
+* origin. blocking followers sleep on the entry's condition variable,
+* event loop followers leave a callback. the leader commits the response
+* to the cache before landing, so a woken follower normally hits; when
+* the response turns out not to be cacheable the leader lands at once and
+* the followers fetch on their own. no follower waits on a stuck leader
+* for longer than FLIGHT_WAIT_SECS
+*/
+#include "csapp.h"
+#include "mycache.h"
+#include "flight.h"
+
+typedef struct flight_waiter {
+    flight_callback done;
+    void *arg;
+    struct flight_waiter *next;
+} flight_waiter;
+
+typedef struct flight {
+    char *uri;
+    unsigned int hash;
+    int landed;
+    int sleepers; // blocking followers still on cond
+    pthread_cond_t cond;
+    flight_waiter *waiters;
+    struct flight *next;
+} flight;
+
+static flight *flights[FLIGHT_BUCKET_NUM];
+static pthread_mutex_t flight_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static flight **find_flight(char *uri, unsigned int hash);
+static void free_flight(flight *f);
+
+int flight_join(char *uri, flight_callback done, void *arg)
+{
+    unsigned int hash = cache_hash(uri);
+    flight *f;
+    flight_waiter *w;
+    pthread_condattr_t attr;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&flight_lock);
+    if ((f = *find_flight(uri, hash)) == NULL) {
+        f = Malloc(sizeof(flight));
+        f->uri = Malloc(strlen(uri) + 1);
+        strcpy(f->uri, uri);
+        f->hash = hash;
+        f->landed = 0;
+        f->sleepers = 0;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&f->cond, &attr);
+        pthread_condattr_destroy(&attr);
+        f->waiters = NULL;
+        f->next = flights[hash % FLIGHT_BUCKET_NUM];
+        flights[hash % FLIGHT_BUCKET_NUM] = f;
+        pthread_mutex_unlock(&flight_lock);
+        return 1;
+    }
+    if (done != NULL) {
+        w = Malloc(sizeof(flight_waiter));
+        w->done = done;
+        w->arg = arg;
+        w->next = f->waiters;
+        f->waiters = w;
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += FLIGHT_WAIT_SECS;
+        f->sleepers++;
+        while (!f->landed) {
+            if (pthread_cond_timedwait(&f->cond, &flight_lock, &deadline) == ETIMEDOUT)
+                break; // the leader is stuck, fetch without it
+        }
+        // the last sleeper out frees a landed flight, the leader frees one in the air
+        if (--f->sleepers == 0 && f->landed)
+            free_flight(f);
+    }
+    pthread_mutex_unlock(&flight_lock);
+    return 0;
+}
+
+void flight_land(char *uri)
+{
+    unsigned int hash = cache_hash(uri);
+    flight **pp, *f;
+    flight_waiter *w;
+
+    pthread_mutex_lock(&flight_lock);
+    pp = find_flight(uri, hash);
+    if ((f = *pp) == NULL) {
+        pthread_mutex_unlock(&flight_lock);
+        return;
+    }
+    *pp = f->next;
+    f->landed = 1;
+    w = f->waiters;
+    f->waiters = NULL;
+    if (f->sleepers > 0)
+        pthread_cond_broadcast(&f->cond);
+    else
+        free_flight(f);
+    pthread_mutex_unlock(&flight_lock);
+
+    while (w != NULL) {
+        flight_waiter *next = w->next;
+        w->done(w->arg);
+        Free(w);
+        w = next;
+    }
+}
+
+int flight_leave(char *uri, flight_callback done, void *arg)
+{
+    flight *f;
+    flight_waiter **pw, *w = NULL;
+
+    pthread_mutex_lock(&flight_lock);
+    if ((f = *find_flight(uri, cache_hash(uri))) != NULL) {
+        for (pw = &f->waiters; (w = *pw) != NULL; pw = &w->next) {
+            if (w->done == done && w->arg == arg) {
+                *pw = w->next;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&flight_lock);
+    if (w == NULL)
+        return 0;
+    Free(w);
+    return 1;
+}
+
+// the link to the flight of uri in its bucket, to NULL if there is none
+static flight **find_flight(char *uri, unsigned int hash)
+{
+    flight **pp, *f;
+
+    for (pp = &flights[hash % FLIGHT_BUCKET_NUM]; (f = *pp) != NULL; pp = &f->next) {
+        if (f->hash == hash && !strcmp(f->uri, uri))
+            break;
+    }
+    return pp;
+}
+
+static void free_flight(flight *f)
+{
+    pthread_cond_destroy(&f->cond);
+    Free(f->uri);
+    Free(f);
+}
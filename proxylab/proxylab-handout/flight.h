@@ -0,0 +1,31 @@
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+/*
+* flight.h - single-flight tracking of cache misses. the first request
+* that misses on a uri fetches it, later requests for the same uri wait
+* until that fetch lands and then look in the cache again
+*/
+
+#define FLIGHT_BUCKET_NUM 256 // hash buckets of the in-flight table
+#define FLIGHT_WAIT_SECS 10 // followers stop waiting for a leader this slow
+
+// called by the landing thread when the fetch of the joined uri ends
+typedef void (*flight_callback)(void *arg);
+
+/*
+* return 1 if the caller leads the fetch of uri and must call
+* flight_land() when it is done. otherwise another fetch is in flight
+* and 0 is returned: with done NULL once that fetch has landed or after
+* FLIGHT_WAIT_SECS, else at once, and done(arg) is called when it lands
+*/
+int flight_join(char *uri, flight_callback done, void *arg);
+/*
+* end the fetch of uri and release everyone waiting on it. a leader lands
+* as soon as it knows whether the response will be in the cache
+*/
+void flight_land(char *uri);
+// stop waiting on the fetch of uri, 0 if it already landed and done(arg) is due
+int flight_leave(char *uri, flight_callback done, void *arg);
+
+#endif /* __FLIGHT_H__ */
@@ -0,0 +1,416 @@
+/*
+* http.c - incremental HTTP/1.x response framing
+*
+* bytes are fed as they arrive from the server, in chunks of any size.
+* the framer follows the status line and headers, then the body as
+* announced by Content-Length or chunked encoding, and stops exactly at
+* the end of the response. the caching headers are picked up on the way
+*/
+#define _GNU_SOURCE
+#include "csapp.h"
+#include "http.h"
+
+static void handle_line(resp_framer *f);
+static void end_of_head(resp_framer *f);
+static char *header_value(char *line, char *name);
+static void copy_value(char *dst, char *value);
+static time_t parse_http_date(char *value);
+static long dechunk_body(char *p, char *end, char *dst);
+
+// what a relayed head ends with, the first one is the longest
+static const char keep_alive_line[] = "Connection: keep-alive\r\n\r\n";
+static const char close_line[] = "Connection: close\r\n\r\n";
+
+void init_resp_framer(resp_framer *f)
+{
+    f->state = RESP_HEAD;
+    f->status = 0;
+    f->chunked = 0;
+    f->keep_alive = 0;
+    f->content_length = -1;
+    f->remaining = 0;
+    f->head_len = 0;
+    f->interim_len = 0;
+    f->line_len = 0;
+    f->no_store = 0;
+    f->max_age = -1;
+    f->has_expires = 0;
+    f->expires = f->date = f->last_modified_time = 0;
+    f->etag[0] = f->last_modified[0] = '\0';
+}
+
+int feed_resp_framer(resp_framer *f, char *buf, int n)
+{
+    int i = 0, take;
+    char *nl;
+
+    while (i < n && f->state != RESP_DONE) {
+        switch (f->state) {
+        case RESP_BODY:
+        case RESP_CHUNK_DATA:
+            take = n - i < f->remaining ? n - i : f->remaining;
+            i += take;
+            f->remaining -= take;
+            if (f->remaining == 0)
+                f->state = f->state == RESP_BODY ? RESP_DONE : RESP_CHUNK_END;
+            break;
+
+        case RESP_UNTIL_CLOSE:
+            i = n;
+            break;
+
+        default: // line oriented states
+            nl = memchr(buf + i, '\n', n - i);
+            take = nl ? nl - (buf + i) + 1 : n - i;
+            if (f->state == RESP_HEAD)
+                f->head_len += take;
+            // overlong lines are truncated, only their prefix matters
+            if (f->line_len + take < RESP_LINE_SIZE) {
+                memcpy(f->line + f->line_len, buf + i, take);
+                f->line_len += take;
+            }
+            i += take;
+            if (nl) {
+                f->line[f->line_len] = '\0';
+                handle_line(f);
+                f->line_len = 0;
+            }
+            break;
+        }
+    }
+    return i;
+}
+
+long resp_body_left(resp_framer *f)
+{
+    if (f->state == RESP_BODY || f->state == RESP_CHUNK_DATA)
+        return f->remaining;
+    if (f->state == RESP_UNTIL_CLOSE)
+        return -1;
+    return 0;
+}
+
+int resp_is_framed(resp_framer *f)
+{
+    return f->chunked || f->content_length >= 0
+        || f->status == 204 || f->status == 304;
+}
+
+void resp_body_moved(resp_framer *f, long n)
+{
+    if (f->state == RESP_BODY || f->state == RESP_CHUNK_DATA) {
+        f->remaining -= n;
+        if (f->remaining <= 0)
+            f->state = f->state == RESP_BODY ? RESP_DONE : RESP_CHUNK_END;
+    }
+}
+
+int resp_is_cacheable(resp_framer *f)
+{
+    return f->status == 200 && !f->no_store
+        && (f->content_length < 0 || f->head_len + f->content_length <= MAX_OBJECT_SIZE);
+}
+
+/*
+* resp_cache_meta - the lifetime is max-age if given, else Expires
+* relative to Date, else a tenth of the age since Last-Modified, else
+* RESP_DEFAULT_FRESH_SECS. meta points into f
+*/
+void resp_cache_meta(resp_framer *f, s_cache_meta *meta)
+{
+    time_t now = time(NULL), base = f->date ? f->date : now;
+    long lifetime;
+
+    if (f->max_age >= 0) {
+        lifetime = f->max_age;
+    } else if (f->has_expires) {
+        lifetime = f->expires ? f->expires - base : 0;
+    } else if (f->last_modified_time && f->last_modified_time < base) {
+        lifetime = (base - f->last_modified_time) / 10;
+        if (lifetime > RESP_HEURISTIC_MAX_SECS)
+            lifetime = RESP_HEURISTIC_MAX_SECS;
+    } else {
+        lifetime = RESP_DEFAULT_FRESH_SECS;
+    }
+    // 0 would mean never stale, so an expired object gets a past time
+    meta->expires = lifetime > 0 ? now + lifetime : 1;
+    meta->etag = f->etag[0] ? f->etag : NULL;
+    meta->last_modified = f->last_modified[0] ? f->last_modified : NULL;
+}
+
+// act on one complete line of the current state
+static void handle_line(resp_framer *f)
+{
+    int minor = 0;
+    char *value, *p;
+
+    switch (f->state) {
+    case RESP_HEAD:
+        if (f->status == 0) {
+            if (sscanf(f->line, "HTTP/1.%d %d", &minor, &f->status) != 2) {
+                f->status = 500;
+                minor = 0; // a malformed status line ends the connection
+            }
+            f->keep_alive = minor >= 1; // HTTP/1.1 defaults to persistent
+        } else if (!strcmp(f->line, "\r\n") || !strcmp(f->line, "\n")) {
+            end_of_head(f);
+        } else if ((value = header_value(f->line, "Content-Length:")) != NULL) {
+            f->content_length = atol(value);
+        } else if ((value = header_value(f->line, "Transfer-Encoding:")) != NULL) {
+            f->chunked = strcasestr(value, "chunked") != NULL;
+        } else if ((value = header_value(f->line, "Connection:")) != NULL) {
+            if (strcasestr(value, "close"))
+                f->keep_alive = 0;
+            else if (strcasestr(value, "keep-alive"))
+                f->keep_alive = 1;
+        } else if ((value = header_value(f->line, "Cache-Control:")) != NULL) {
+            if (strcasestr(value, "no-store") || strcasestr(value, "private"))
+                f->no_store = 1;
+            if (strcasestr(value, "no-cache"))
+                f->max_age = 0; // stored, but revalidated on every use
+            else if ((p = strcasestr(value, "s-maxage=")) != NULL)
+                f->max_age = atol(p + 9);
+            else if ((p = strcasestr(value, "max-age=")) != NULL && f->max_age < 0)
+                f->max_age = atol(p + 8);
+        } else if ((value = header_value(f->line, "Expires:")) != NULL) {
+            f->has_expires = 1;
+            f->expires = parse_http_date(value);
+        } else if ((value = header_value(f->line, "Date:")) != NULL) {
+            f->date = parse_http_date(value);
+        } else if ((value = header_value(f->line, "ETag:")) != NULL) {
+            copy_value(f->etag, value);
+        } else if ((value = header_value(f->line, "Last-Modified:")) != NULL) {
+            copy_value(f->last_modified, value);
+            f->last_modified_time = parse_http_date(value);
+        }
+        break;
+
+    case RESP_CHUNK_SIZE:
+        f->remaining = strtol(f->line, NULL, 16);
+        f->state = f->remaining > 0 ? RESP_CHUNK_DATA : RESP_TRAILER;
+        break;
+
+    case RESP_CHUNK_END:
+        f->state = RESP_CHUNK_SIZE;
+        break;
+
+    case RESP_TRAILER:
+        if (!strcmp(f->line, "\r\n") || !strcmp(f->line, "\n"))
+            f->state = RESP_DONE;
+        break;
+
+    default:
+        break;
+    }
+}
+
+// the blank line after the headers, pick how the body is delimited
+static void end_of_head(resp_framer *f)
+{
+    long interim;
+
+    if (f->status >= 100 && f->status < 200) {
+        interim = f->interim_len + f->head_len;
+        init_resp_framer(f); // interim response, the real one follows
+        f->interim_len = interim;
+        return;
+    }
+    if (f->status == 204 || f->status == 304) {
+        f->state = RESP_DONE;
+    } else if (f->chunked) {
+        f->state = RESP_CHUNK_SIZE;
+    } else if (f->content_length >= 0) {
+        f->remaining = f->content_length;
+        f->state = f->remaining > 0 ? RESP_BODY : RESP_DONE;
+    } else {
+        f->state = RESP_UNTIL_CLOSE;
+        f->keep_alive = 0;
+    }
+}
+
+long resp_head_len(const char *resp, long len)
+{
+    const char *p, *eol;
+
+    for (p = resp; (eol = memchr(p, '\n', resp + len - p)) != NULL; p = eol + 1) {
+        if (p > resp && (eol == p || (eol == p + 1 && *p == '\r')))
+            return eol + 1 - resp;
+    }
+    return 0;
+}
+
+/*
+* resp_strip_head - rewrite the complete head that f framed, which starts
+* pbuilder after any 1xx interim responses, the way the proxy relays and
+* caches it: in HTTP/1.1, the version the proxy speaks, and without the
+* hop-by-hop headers Connection, Keep-Alive and Proxy-Connection, which
+* only describe the server connection. the interim responses are
+* dropped: a GET has no body to continue, an HTTP/1.0 client cannot
+* read them and a cached copy must start with its own head. the body
+* bytes behind it move up. return the new head length, or -1 if it is
+* too long to relay within RESP_HEAD_SIZE
+*/
+long resp_strip_head(s_cache_builder *pbuilder, resp_framer *f)
+{
+    s_buf_block *pblock = pbuilder->pblock;
+    char *buf = pblock->buf, *head = buf + f->interim_len, *end = head + f->head_len;
+    char *p, *next;
+    long n = 0;
+
+    if (f->head_len > 9 && !strncmp(head, "HTTP/1.0 ", 9))
+        head[7] = '1';
+    for (p = head; p < end; p = next) {
+        next = (char *)memchr(p, '\n', end - p) + 1;
+        if (p == head || (header_value(p, "Connection:") == NULL
+                          && header_value(p, "Keep-Alive:") == NULL
+                          && header_value(p, "Proxy-Connection:") == NULL)) {
+            memmove(buf + n, p, next - p);
+            n += next - p;
+        }
+    }
+    memmove(buf + n, end, pblock->valid_buf_size - (end - buf));
+    pblock->valid_buf_size -= (end - buf) - n;
+    // so resp_connection_head() can never fail on it, cached or not
+    return n + (long)sizeof(keep_alive_line) <= RESP_HEAD_SIZE ? n : -1;
+}
+
+/*
+* resp_connection_head - copy the head of head_len bytes, which holds no
+* Connection header of its own, to dst with one that tells the client
+* whether the proxy keeps the connection open after this response
+*/
+int resp_connection_head(const char *head, long head_len, int keep_alive, char *dst, int size)
+{
+    const char *line = keep_alive ? keep_alive_line : close_line;
+    int line_len = strlen(line);
+    long len;
+
+    if (head_len < 2)
+        return -1;
+    // the blank line goes, it may be a bare LF
+    len = head_len - (head[head_len - 2] == '\r' ? 2 : 1);
+    if (len + line_len > size)
+        return -1;
+    memcpy(dst, head, len);
+    memcpy(dst + len, line, line_len);
+    return len + line_len;
+}
+
+/*
+* resp_dechunk - rewrite the complete chunked response assembled in
+* pbuilder with its decoded body and a Content-Length, so the cache only
+* holds bodies an HTTP/1.0 client can read and a range can index.
+* trailers are dropped. a response in another transfer coding, or
+* malformed, is abandoned
+*/
+int resp_dechunk(s_cache_builder *pbuilder)
+{
+    s_buf_block *pblock = pbuilder->pblock;
+    char *buf, *end, *p, *next, *eol, *blank, *value, *out;
+    long body_len;
+    int n = 0;
+
+    if (pblock == NULL)
+        return 0;
+    buf = pblock->buf;
+    end = buf + pblock->valid_buf_size;
+    // the head: status line, then headers up to the blank line
+    for (p = buf; (eol = memchr(p, '\n', end - p)) != NULL; p = eol + 1) {
+        if (eol == p || (eol == p + 1 && *p == '\r'))
+            break;
+    }
+    blank = p;
+    if (eol == NULL || (body_len = dechunk_body(eol + 1, end, NULL)) < 0) {
+        free_cache_builder(pbuilder);
+        return 0;
+    }
+    out = Malloc(eol - buf + RESP_LINE_SIZE + body_len);
+    for (p = buf; p < blank; p = next) {
+        next = (char *)memchr(p, '\n', end - p) + 1;
+        if ((value = header_value(p, "Transfer-Encoding:")) != NULL
+            && strncasecmp(value, "chunked", 7)) {
+            Free(out);
+            free_cache_builder(pbuilder);
+            return 0;
+        }
+        if (value == NULL && header_value(p, "Content-Length:") == NULL) {
+            memcpy(out + n, p, next - p);
+            n += next - p;
+        }
+    }
+    n += sprintf(out + n, "Content-Length: %ld\r\n\r\n", body_len);
+    n += dechunk_body(eol + 1, end, out + n);
+    // never longer: the Transfer-Encoding line and the last chunk are gone
+    if (n > pbuilder->cap) {
+        Free(out);
+        free_cache_builder(pbuilder);
+        return 0;
+    }
+    memcpy(buf, out, n);
+    pblock->valid_buf_size = n;
+    Free(out);
+    return 1;
+}
+
+/*
+* dechunk_body - the length of the chunked body in [p, end), copied
+* without its framing into dst unless dst is NULL. -1 if malformed or
+* incomplete
+*/
+static long dechunk_body(char *p, char *end, char *dst)
+{
+    char *eol, *stop;
+    long size, len = 0;
+
+    while ((eol = memchr(p, '\n', end - p)) != NULL) {
+        size = strtol(p, &stop, 16);
+        if (stop == p || size < 0 || size > end - eol - 1)
+            return -1;
+        if (size == 0)
+            return len; // the last chunk, what follows is trailers
+        if (dst != NULL)
+            memcpy(dst + len, eol + 1, size);
+        len += size;
+        // the CRLF that closes the chunk
+        p = eol + 1 + size;
+        if ((eol = memchr(p, '\n', end - p)) == NULL)
+            return -1;
+        p = eol + 1;
+    }
+    return -1;
+}
+
+// the value of header line if it is the header name, else NULL
+static char *header_value(char *line, char *name)
+{
+    size_t len = strlen(name);
+
+    if (strncasecmp(line, name, len))
+        return NULL;
+    line += len;
+    while (*line == ' ' || *line == '\t')
+        line++;
+    return line;
+}
+
+// keep a header value without its line end, truncated to RESP_TAG_SIZE
+static void copy_value(char *dst, char *value)
+{
+    int len = strcspn(value, "\r\n");
+
+    if (len >= RESP_TAG_SIZE)
+        len = 0; // a truncated validator would never match, drop it
+    memcpy(dst, value, len);
+    dst[len] = '\0';
+}
+
+// an IMF-fixdate such as "Sun, 06 Nov 1994 08:49:37 GMT", 0 if invalid
+static time_t parse_http_date(char *value)
+{
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL)
+        return 0;
+    return timegm(&tm);
+}
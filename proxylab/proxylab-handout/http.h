@@ -0,0 +1,76 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "csapp.h"
+#include "mycache.h"
+
+/*
+* http.h - incremental framing of HTTP/1.x responses, so a keep-alive
+* connection can tell where one response ends without waiting for EOF,
+* and the caching headers needed to decide how long it stays fresh
+*/
+
+#define RESP_LINE_SIZE 512 // longest line prefix the framer keeps
+#define RESP_TAG_SIZE 128 // longest ETag or Last-Modified value kept
+#define RESP_DEFAULT_FRESH_SECS 300 // lifetime without any freshness header
+#define RESP_HEURISTIC_MAX_SECS 86400 // cap of the Last-Modified heuristic
+#define RESP_HEAD_SIZE MAXBUF // longest response head the proxy relays
+
+typedef enum {
+    RESP_HEAD, // status line and headers
+    RESP_BODY, // Content-Length delimited body
+    RESP_CHUNK_SIZE, // chunk size line of a chunked body
+    RESP_CHUNK_DATA, // chunk payload
+    RESP_CHUNK_END, // CRLF that closes a chunk
+    RESP_TRAILER, // trailer lines after the last chunk
+    RESP_UNTIL_CLOSE, // no framing, the body ends when the server closes
+    RESP_DONE
+} resp_state;
+
+typedef struct {
+    resp_state state;
+    int status; // status code, 0 until the status line is seen
+    int chunked;
+    int keep_alive; // the server lets us reuse the connection
+    long content_length; // -1 if not announced
+    long remaining; // bytes left in the body or the current chunk
+    long head_len; // bytes of the status line and headers
+    long interim_len; // bytes of the 1xx interim responses before them
+    int no_store; // Cache-Control no-store or private
+    long max_age; // Cache-Control s-maxage or max-age, -1 if absent
+    int has_expires;
+    time_t expires; // Expires, 0 if unparsable, which means already stale
+    time_t date; // Date, 0 if absent
+    time_t last_modified_time; // Last-Modified, 0 if absent
+    char etag[RESP_TAG_SIZE]; // validators, empty if absent
+    char last_modified[RESP_TAG_SIZE];
+    int line_len;
+    char line[RESP_LINE_SIZE]; // current line, possibly partial or truncated
+} resp_framer;
+
+void init_resp_framer(resp_framer *f);
+// consume buf, return how many bytes belong to this response
+int feed_resp_framer(resp_framer *f, char *buf, int n);
+/*
+* body bytes that can be moved blindly: >0 known, the rest of a
+* Content-Length body or of the current chunk, -1 until close, 0 none
+*/
+long resp_body_left(resp_framer *f);
+// the response announced its length, so its end is known without EOF
+int resp_is_framed(resp_framer *f);
+// account for n body bytes moved outside of feed_resp_framer()
+void resp_body_moved(resp_framer *f, long n);
+// the response of a complete head may be stored by a shared cache and fits it
+int resp_is_cacheable(resp_framer *f);
+// freshness and validators of a complete head, for the cache
+void resp_cache_meta(resp_framer *f, s_cache_meta *meta);
+// the length of the head that starts resp, blank line included, 0 if incomplete
+long resp_head_len(const char *resp, long len);
+// rewrite the head framed by f at the start of pbuilder as relayed, return its new length
+long resp_strip_head(s_cache_builder *pbuilder, resp_framer *f);
+// copy head to dst with a Connection header for keep_alive, -1 if longer than size
+int resp_connection_head(const char *head, long head_len, int keep_alive, char *dst, int size);
+// turn a chunked response in pbuilder into a Content-Length one, 0 if it was abandoned
+int resp_dechunk(s_cache_builder *pbuilder);
+
+#endif /* __HTTP_H__ */
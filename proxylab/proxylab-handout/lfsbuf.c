@@ -0,0 +1,154 @@
+/*
+* lfsbuf.c - lock-free bounded MPMC ring (D. Vyukov's sequence number
+* design) with futex based blocking
+*
+* a producer claims position pos by moving rear forward with a CAS once
+* the slot's seq equals pos, writes the item and publishes it by setting
+* seq to pos + 1. a consumer claims the same position from front when
+* seq is pos + 1 and hands the slot to the next lap by setting seq to
+* pos + n. a thread that finds the ring full or empty registers as a
+* waiter, tries once more and only then sleeps; the other side bumps the
+* event word and wakes one sleeper only when waiters are registered
+*/
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "csapp.h"
+#include "lfsbuf.h"
+
+static int try_insert(lfsbuf_t *sp, int item);
+static int try_remove(lfsbuf_t *sp, int *item);
+static void wait_on(volatile int *ev, volatile int *waiters, lfsbuf_t *sp,
+                    int (*ready)(lfsbuf_t *sp, int *item), int *item);
+static void wake_one(volatile int *ev, volatile int *waiters);
+
+static void futex_wait(volatile int *addr, int val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(volatile int *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* Create an empty ring with at least n slots */
+void lfsbuf_init(lfsbuf_t *sp, int n)
+{
+    unsigned int i, size = 1;
+
+    while (size < (unsigned int)n)
+        size <<= 1;
+    memset(sp, 0, sizeof(lfsbuf_t));
+    sp->buf = Calloc(size, sizeof(lfsbuf_cell));
+    sp->mask = size - 1;
+    for (i = 0; i < size; i++)
+        sp->buf[i].seq = i;
+}
+
+void lfsbuf_deinit(lfsbuf_t *sp)
+{
+    Free(sp->buf);
+}
+
+static int insert_ready(lfsbuf_t *sp, int *item)
+{
+    return try_insert(sp, *item);
+}
+
+/* Insert item at the rear, sleeping while the ring is full */
+void lfsbuf_insert(lfsbuf_t *sp, int item)
+{
+    if (!try_insert(sp, item))
+        wait_on(&sp->slots_ev, &sp->slots_waiters, sp, insert_ready, &item);
+    wake_one(&sp->items_ev, &sp->items_waiters);
+}
+
+/* Remove and return the first item, sleeping while the ring is empty */
+int lfsbuf_remove(lfsbuf_t *sp)
+{
+    int item;
+
+    if (!try_remove(sp, &item))
+        wait_on(&sp->items_ev, &sp->items_waiters, sp, try_remove, &item);
+    wake_one(&sp->slots_ev, &sp->slots_waiters);
+    return item;
+}
+
+static int try_insert(lfsbuf_t *sp, int item)
+{
+    unsigned int pos = sp->rear, seq;
+    lfsbuf_cell *cell;
+    int dif;
+
+    while (1) {
+        cell = &sp->buf[pos & sp->mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        dif = (int)(seq - pos);
+        if (dif == 0) {
+            if (__sync_bool_compare_and_swap(&sp->rear, pos, pos + 1))
+                break;
+            pos = sp->rear;
+        } else if (dif < 0) {
+            return 0; // the slot still holds the item of the previous lap
+        } else {
+            pos = sp->rear; // another producer took pos
+        }
+    }
+    cell->item = item;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static int try_remove(lfsbuf_t *sp, int *item)
+{
+    unsigned int pos = sp->front, seq;
+    lfsbuf_cell *cell;
+    int dif;
+
+    while (1) {
+        cell = &sp->buf[pos & sp->mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        dif = (int)(seq - (pos + 1));
+        if (dif == 0) {
+            if (__sync_bool_compare_and_swap(&sp->front, pos, pos + 1))
+                break;
+            pos = sp->front;
+        } else if (dif < 0) {
+            return 0; // not filled yet
+        } else {
+            pos = sp->front;
+        }
+    }
+    *item = cell->item;
+    __atomic_store_n(&cell->seq, pos + sp->mask + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+* wait_on - sleep on ev until ready() succeeds. the waiter count is raised
+* before the retry, and the other side reads it after publishing, so
+* either the retry sees the new slot or the other side sees the waiter
+*/
+static void wait_on(volatile int *ev, volatile int *waiters, lfsbuf_t *sp,
+                    int (*ready)(lfsbuf_t *sp, int *item), int *item)
+{
+    int val;
+
+    __sync_add_and_fetch(waiters, 1);
+    while (1) {
+        val = *ev;
+        if (ready(sp, item))
+            break;
+        futex_wait(ev, val);
+    }
+    __sync_sub_and_fetch(waiters, 1);
+}
+
+static void wake_one(volatile int *ev, volatile int *waiters)
+{
+    __sync_synchronize();
+    if (*waiters > 0) {
+        __sync_add_and_fetch(ev, 1);
+        futex_wake(ev);
+    }
+}
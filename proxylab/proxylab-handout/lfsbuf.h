@@ -0,0 +1,35 @@
+#ifndef __LFSBUF_H__
+#define __LFSBUF_H__
+
+#include "csapp.h"
+
+/*
+* lfsbuf.h - bounded lock-free multi-producer/multi-consumer FIFO with
+* the sbuf_t interface. every slot carries a sequence number that tells
+* producers and consumers whose turn it is, so the fast path is one
+* compare-and-swap; threads only sleep on a futex when the ring is full
+* or empty
+*/
+
+typedef struct {
+    volatile unsigned int seq; // pos when free for the insert at pos, pos + 1 once filled
+    int item;
+} lfsbuf_cell;
+
+typedef struct {
+    lfsbuf_cell *buf;
+    unsigned int mask; // slots - 1, the slot count is a power of two
+    volatile unsigned int rear __attribute__((aligned(64))); // next insert position
+    volatile unsigned int front __attribute__((aligned(64))); // next remove position
+    volatile int items_ev __attribute__((aligned(64))); // futex, bumped to wake consumers
+    volatile int items_waiters;
+    volatile int slots_ev; // futex, bumped to wake producers
+    volatile int slots_waiters;
+} lfsbuf_t;
+
+void lfsbuf_init(lfsbuf_t *sp, int n);
+void lfsbuf_deinit(lfsbuf_t *sp);
+void lfsbuf_insert(lfsbuf_t *sp, int item);
+int lfsbuf_remove(lfsbuf_t *sp);
+
+#endif /* __LFSBUF_H__ */
@@ -0,0 +1,392 @@
+/*
+* loadgen.c - load generator for the proxy with tiny as the origin. every
+*     connection runs in its own thread and sends GET requests through the
+*     proxy, one at a time, until the request budget is spent. a request goes
+*     to the hot set with probability -h percent and to the larger cold set
+*     otherwise, uniformly within the set. the objects are files created
+*     in tiny's directory.
+*
+*     the origin address in the uris is a relay in front of tiny that counts
+*     the requests reaching it, so the hit ratio reported is the share of
+*     requests the proxy answered without the origin. tiny answers one
+*     request per connection, so the relay counts connections. latency is
+*     taken per request, connect included in close mode, and kept in an HDR
+*     histogram (log buckets split linearly, under 1% error at any scale)
+*
+* usage: loadgen -p proxy_port -o tiny_port [-d tiny_dir] [-c conns]
+*     [-n requests] [-k] [-h hot_pct] [-H hot_objects] [-C cold_objects]
+*     [-s object_size] [-R]
+*/
+#include <poll.h>
+#include <netinet/tcp.h>
+#include "csapp.h"
+
+#define HDR_SUB_BITS 7 // 128 linear steps per power of two
+#define HDR_SUB (1 << HDR_SUB_BITS)
+#define HDR_HALF (HDR_SUB / 2)
+#define HDR_BUCKETS (HDR_SUB + (64 - HDR_SUB_BITS) * HDR_HALF)
+#define RESP_BUF_SIZE 65536
+
+typedef struct {
+    long long count[HDR_BUCKETS];
+    long long total;
+    long long max;
+} hdr_hist;
+
+typedef struct {
+    unsigned int seed;
+    int fd; // kept open between requests in keep-alive mode
+    long long ok, errors, bytes;
+    hdr_hist hist;
+    char buf[RESP_BUF_SIZE];
+} client;
+
+static int proxy_port, tiny_port, origin_port;
+static char *tiny_dir = "tiny";
+static int conn_num = 16, requests = 20000, keep_alive = 0;
+static int hot_pct = 90, hot_num = 32, cold_num = 4096, object_size = 4096;
+static int issued; // requests handed out so far
+static int origin_requests; // counted by the relay
+
+/* $begin hdr */
+// bucket of v: exact below HDR_SUB, then HDR_HALF steps per power of two
+static int hdr_index(long long v)
+{
+    int shift;
+
+    if (v < HDR_SUB)
+        return v;
+    shift = 63 - __builtin_clzll(v) - (HDR_SUB_BITS - 1);
+    return HDR_SUB + (shift - 1) * HDR_HALF + (int)(v >> shift) - HDR_HALF;
+}
+
+// highest value that falls in bucket i
+static long long hdr_value(int i)
+{
+    int shift;
+
+    if (i < HDR_SUB)
+        return i;
+    shift = (i - HDR_SUB) / HDR_HALF + 1;
+    return ((long long)((i - HDR_SUB) % HDR_HALF + HDR_HALF + 1) << shift) - 1;
+}
+
+static void hdr_record(hdr_hist *h, long long v)
+{
+    h->count[hdr_index(v)]++;
+    h->total++;
+    if (v > h->max)
+        h->max = v;
+}
+
+static void hdr_merge(hdr_hist *to, hdr_hist *from)
+{
+    int i;
+
+    for (i = 0; i < HDR_BUCKETS; i++)
+        to->count[i] += from->count[i];
+    to->total += from->total;
+    if (from->max > to->max)
+        to->max = from->max;
+}
+
+// smallest recorded value at or above the p quantile, within a bucket
+static long long hdr_percentile(hdr_hist *h, double p)
+{
+    long long seen = 0, want = (long long)(p * h->total + 0.999999);
+    int i;
+
+    if (want < 1)
+        want = 1;
+    for (i = 0; i < HDR_BUCKETS; i++) {
+        if ((seen += h->count[i]) >= want)
+            return hdr_value(i) < h->max ? hdr_value(i) : h->max;
+    }
+    return h->max;
+}
+/* $end hdr */
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int connect_local(int port)
+{
+    struct sockaddr_in addr;
+    int fd, one = 1;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, (SA *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// write the objects tiny serves, leaving the ones of the right size alone
+static void make_objects(void)
+{
+    char path[MAXLINE], *data;
+    struct stat st;
+    int i, fd;
+
+    snprintf(path, sizeof(path), "%s/lg", tiny_dir);
+    if (mkdir(path, 0755) < 0 && errno != EEXIST)
+        unix_error("mkdir error");
+    data = Malloc(object_size);
+    for (i = 0; i < hot_num + cold_num; i++) {
+        snprintf(path, sizeof(path), "%s/lg/%d.dat", tiny_dir, i);
+        if (stat(path, &st) == 0 && st.st_size == object_size)
+            continue;
+        memset(data, 'a' + i % 26, object_size);
+        fd = Open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        Rio_writen(fd, data, object_size);
+        Close(fd);
+    }
+    Free(data);
+}
+
+/* $begin relay */
+// copy both ways between the proxy and tiny until either side closes
+static void *relay_conn(void *vargp)
+{
+    int fd[2] = { *(int *)vargp, -1 };
+    struct pollfd pfd[2];
+    char buf[RESP_BUF_SIZE];
+    int i, n;
+
+    Free(vargp);
+    Pthread_detach(pthread_self());
+    if ((fd[1] = connect_local(tiny_port)) < 0) {
+        close(fd[0]);
+        return NULL;
+    }
+    while (1) {
+        for (i = 0; i < 2; i++) {
+            pfd[i].fd = fd[i];
+            pfd[i].events = POLLIN;
+        }
+        if (poll(pfd, 2, -1) < 0 && errno != EINTR)
+            break;
+        for (i = 0; i < 2; i++) {
+            if (!(pfd[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            if ((n = read(fd[i], buf, sizeof(buf))) <= 0
+                || rio_writen(fd[!i], buf, n) < 0)
+                goto done;
+        }
+    }
+done:
+    close(fd[0]);
+    close(fd[1]);
+    return NULL;
+}
+
+static void *relay_thread(void *vargp)
+{
+    int listenfd = *(int *)vargp, *connfdp;
+    pthread_t tid;
+
+    while (1) {
+        connfdp = Malloc(sizeof(int));
+        if ((*connfdp = accept(listenfd, NULL, NULL)) < 0) {
+            Free(connfdp);
+            continue;
+        }
+        __sync_add_and_fetch(&origin_requests, 1);
+        Pthread_create(&tid, NULL, relay_conn, connfdp);
+    }
+    return NULL;
+}
+
+// listen on a free loopback port and return it
+static int start_relay(void)
+{
+    static int listenfd;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    pthread_t tid;
+
+    listenfd = Socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    Bind(listenfd, (SA *)&addr, sizeof(addr));
+    Listen(listenfd, LISTENQ);
+    if (getsockname(listenfd, (SA *)&addr, &len) < 0)
+        unix_error("getsockname error");
+    Pthread_create(&tid, NULL, relay_thread, &listenfd);
+    return ntohs(addr.sin_port);
+}
+/* $end relay */
+
+/*
+* read_response - read one response from fd into cl->buf, return its
+*     status with *reusable set if the connection may carry the next
+*     request, or -1 on error. that takes a framed body and a server
+*     that declared the connection persistent, by HTTP/1.1 or a
+*     Connection header, as the event loops close after every response
+*/
+static int read_response(client *cl, int fd, int *reusable)
+{
+    char *head_end, *p;
+    long long body = -1, got;
+    int n, len = 0, status, minor, persistent;
+
+    *reusable = 0;
+    while (1) {
+        if ((n = read(fd, cl->buf + len, RESP_BUF_SIZE - 1 - len)) <= 0)
+            return -1;
+        len += n;
+        cl->buf[len] = '\0';
+        if ((head_end = strstr(cl->buf, "\r\n\r\n")) != NULL)
+            break;
+        if (len == RESP_BUF_SIZE - 1)
+            return -1;
+    }
+    if (sscanf(cl->buf, "HTTP/1.%d %d", &minor, &status) != 2)
+        return -1;
+    persistent = minor >= 1;
+    *head_end = '\0';
+    for (p = strstr(cl->buf, "\r\n"); p != NULL; p = strstr(p + 2, "\r\n")) {
+        if (!strncasecmp(p + 2, "Content-length:", 15))
+            body = atoll(p + 17);
+        else if (!strncasecmp(p + 2, "Connection:", 11))
+            persistent = strncasecmp(p + 13 + strspn(p + 13, " \t"), "close", 5) != 0;
+    }
+    got = len - (head_end + 4 - cl->buf);
+    while (body < 0 || got < body) {
+        if ((n = read(fd, cl->buf, RESP_BUF_SIZE)) < 0)
+            return -1;
+        if (n == 0) {
+            if (body >= 0)
+                return -1; // cut short
+            break; // an unframed body ends with EOF
+        }
+        got += n;
+    }
+    cl->bytes += got;
+    *reusable = keep_alive && persistent && body >= 0 && got == body;
+    return status;
+}
+
+static void *client_thread(void *vargp)
+{
+    client *cl = vargp;
+    char req[MAXLINE];
+    long long start;
+    int object, n, status, reusable;
+
+    while (__sync_fetch_and_add(&issued, 1) < requests) {
+        if (rand_r(&cl->seed) % 100 < hot_pct)
+            object = rand_r(&cl->seed) % hot_num;
+        else
+            object = hot_num + rand_r(&cl->seed) % cold_num;
+        n = snprintf(req, sizeof(req), "GET http://127.0.0.1:%d/lg/%d.dat HTTP/1.%d\r\n"
+                     "Host: 127.0.0.1:%d\r\n\r\n",
+                     origin_port, object, keep_alive, origin_port);
+
+        start = now_ns();
+        if (cl->fd < 0 && (cl->fd = connect_local(proxy_port)) < 0) {
+            cl->errors++;
+            continue;
+        }
+        status = -1;
+        if (rio_writen(cl->fd, req, n) == n)
+            status = read_response(cl, cl->fd, &reusable);
+        if (status < 0 || !reusable) {
+            close(cl->fd);
+            cl->fd = -1;
+        }
+        if (status == 200) {
+            hdr_record(&cl->hist, now_ns() - start);
+            cl->ok++;
+        } else {
+            cl->errors++;
+        }
+    }
+    if (cl->fd >= 0)
+        close(cl->fd);
+    return NULL;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s -p proxy_port -o tiny_port [-d tiny_dir] [-c conns] "
+            "[-n requests] [-k] [-h hot_pct] [-H hot_objects] [-C cold_objects] "
+            "[-s object_size] [-R]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int c, i, relay = 1;
+    long long start, elapsed, ok = 0, errors = 0, bytes = 0;
+    pthread_t *tid;
+    client *cl;
+    hdr_hist *all;
+
+    while ((c = getopt(argc, argv, "p:o:d:c:n:kh:H:C:s:R")) != -1) {
+        switch (c) {
+        case 'p': proxy_port = atoi(optarg); break;
+        case 'o': tiny_port = atoi(optarg); break;
+        case 'd': tiny_dir = optarg; break;
+        case 'c': conn_num = atoi(optarg); break;
+        case 'n': requests = atoi(optarg); break;
+        case 'k': keep_alive = 1; break;
+        case 'h': hot_pct = atoi(optarg); break;
+        case 'H': hot_num = atoi(optarg); break;
+        case 'C': cold_num = atoi(optarg); break;
+        case 's': object_size = atoi(optarg); break;
+        case 'R': relay = 0; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (proxy_port <= 0 || tiny_port <= 0 || conn_num <= 0 || hot_num <= 0
+        || cold_num <= 0 || object_size <= 0)
+        usage(argv[0]);
+
+    Signal(SIGPIPE, SIG_IGN);
+    make_objects();
+    origin_port = relay ? start_relay() : tiny_port;
+
+    cl = Calloc(conn_num, sizeof(client));
+    tid = Malloc(conn_num * sizeof(pthread_t));
+    start = now_ns();
+    for (i = 0; i < conn_num; i++) {
+        cl[i].seed = i + 1;
+        cl[i].fd = -1;
+        Pthread_create(&tid[i], NULL, client_thread, &cl[i]);
+    }
+    all = Calloc(1, sizeof(hdr_hist));
+    for (i = 0; i < conn_num; i++) {
+        Pthread_join(tid[i], NULL);
+        hdr_merge(all, &cl[i].hist);
+        ok += cl[i].ok;
+        errors += cl[i].errors;
+        bytes += cl[i].bytes;
+    }
+    elapsed = now_ns() - start;
+
+    printf("%d %s connections, %d%% of requests to %d hot objects, the rest to %d cold, %d bytes each\n",
+           conn_num, keep_alive ? "keep-alive" : "close-mode", hot_pct, hot_num, cold_num,
+           object_size);
+    printf("requests   %lld ok, %lld errors in %.2fs\n", ok, errors, elapsed / 1e9);
+    printf("throughput %.0f req/s, %.1f MB/s\n", ok * 1e9 / elapsed, bytes * 1e3 / elapsed);
+    printf("latency    p50 %.1fus  p99 %.1fus  p999 %.1fus  max %.1fus\n",
+           hdr_percentile(all, 0.5) / 1e3, hdr_percentile(all, 0.99) / 1e3,
+           hdr_percentile(all, 0.999) / 1e3, all->max / 1e3);
+    if (relay && ok > 0)
+        printf("cache      %d origin requests, hit ratio %.1f%%\n", origin_requests,
+               100.0 * (ok - origin_requests) / ok);
+    return errors > 0;
+}
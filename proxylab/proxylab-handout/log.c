@@ -0,0 +1,168 @@
+/*
+* log.c - asynchronous ring buffer logger
+*
+* producers claim a slot by moving rear forward with a CAS, format the
+* message into it and publish it through the slot's seq, as in lfsbuf.c.
+* seq counts laps in steps of two: 2 * lap while the slot is free for
+* position lap * LOG_RING_SIZE + index, one more once the message is in,
+* so the zeroed ring is ready before log_init() runs. a producer that
+* finds its slot still holding the previous lap drops the message. the
+* writer thread drains the ring in order, adds the time and the level,
+* and writes whole batches with one write(); it sleeps on a futex that
+* producers only touch while it is asleep
+*/
+#include <stdarg.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "csapp.h"
+#include "log.h"
+
+#define LOG_BATCH_SIZE 65536 // bytes the writer collects per write()
+
+typedef struct {
+    volatile unsigned int seq;
+    int level;
+    struct timespec ts;
+    char text[LOG_LINE_SIZE];
+} log_slot;
+
+int log_level = LOG_LEVEL_INFO;
+
+static log_slot ring[LOG_RING_SIZE];
+static volatile unsigned int rear __attribute__((aligned(64))); // next position to claim
+static unsigned int front; // next position to write out, under drain_lock
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int wake_ev __attribute__((aligned(64))); // futex, bumped to wake the writer
+static volatile int sleeping; // the writer is about to wait on wake_ev
+static long long dropped;
+static const char *level_name[] = { "error", "warn", "info", "debug" };
+
+static void *writer_thread(void *vargp);
+static int drain(void);
+static void flush_at_exit(void);
+
+void log_init(int level)
+{
+    pthread_t tid;
+
+    log_level = level;
+    Pthread_create(&tid, NULL, writer_thread, NULL);
+    atexit(flush_at_exit);
+}
+
+int log_find_level(const char *name)
+{
+    int i;
+
+    for (i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_DEBUG; i++)
+        if (!strcasecmp(name, level_name[i]))
+            return i;
+    return -1;
+}
+
+void log_write(int level, const char *fmt, ...)
+{
+    unsigned int pos = rear, seq, lap2;
+    log_slot *slot;
+    va_list ap;
+
+    while (1) {
+        slot = &ring[pos % LOG_RING_SIZE];
+        lap2 = pos / LOG_RING_SIZE * 2;
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == lap2) {
+            if (__atomic_compare_exchange_n(&rear, &pos, pos + 1, 0,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if ((int)(seq - lap2) < 0) {
+            __sync_add_and_fetch(&dropped, 1); // the writer is a lap behind
+            return;
+        } else {
+            pos = rear; // another producer took it
+        }
+    }
+    slot->level = level;
+    clock_gettime(CLOCK_REALTIME_COARSE, &slot->ts);
+    va_start(ap, fmt);
+    vsnprintf(slot->text, LOG_LINE_SIZE, fmt, ap);
+    va_end(ap);
+    __atomic_store_n(&slot->seq, lap2 + 1, __ATOMIC_RELEASE);
+
+    // the full barrier pairs with the writer's, either it sees the
+    // message or we see it asleep
+    __sync_synchronize();
+    if (sleeping) {
+        __sync_add_and_fetch(&wake_ev, 1);
+        syscall(SYS_futex, &wake_ev, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+long long log_dropped(void)
+{
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+static void *writer_thread(void *vargp)
+{
+    int ev;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        if (drain())
+            continue;
+        sleeping = 1;
+        __sync_synchronize();
+        ev = wake_ev;
+        if (!drain())
+            syscall(SYS_futex, &wake_ev, FUTEX_WAIT_PRIVATE, ev, NULL, NULL, 0);
+        sleeping = 0;
+    }
+    return NULL;
+}
+
+/*
+* drain - write out every published message in order, return how many
+* there were
+*/
+static int drain(void)
+{
+    static char out[LOG_BATCH_SIZE];
+    static time_t last_sec = -1;
+    static char stamp[16]; // HH:MM:SS of last_sec
+    unsigned int lap2;
+    log_slot *slot;
+    struct tm tm;
+    int len = 0, count = 0;
+
+    pthread_mutex_lock(&drain_lock);
+    while (1) {
+        slot = &ring[front % LOG_RING_SIZE];
+        lap2 = front / LOG_RING_SIZE * 2;
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != lap2 + 1)
+            break;
+        if (len + LOG_LINE_SIZE + 32 > LOG_BATCH_SIZE) {
+            rio_writen(STDOUT_FILENO, out, len);
+            len = 0;
+        }
+        if (slot->ts.tv_sec != last_sec) {
+            last_sec = slot->ts.tv_sec;
+            localtime_r(&last_sec, &tm);
+            strftime(stamp, sizeof(stamp), "%H:%M:%S", &tm);
+        }
+        len += snprintf(out + len, LOG_BATCH_SIZE - len, "%s.%03ld %-5s %s\n", stamp,
+                        slot->ts.tv_nsec / 1000000, level_name[slot->level], slot->text);
+        __atomic_store_n(&slot->seq, lap2 + 2, __ATOMIC_RELEASE);
+        front++;
+        count++;
+    }
+    if (len > 0)
+        rio_writen(STDOUT_FILENO, out, len);
+    pthread_mutex_unlock(&drain_lock);
+    return count;
+}
+
+// messages of a proxy exiting on an error are not lost
+static void flush_at_exit(void)
+{
+    drain();
+}
@@ -0,0 +1,40 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+/*
+* log.h - level gated asynchronous logger. a message below the level
+* costs one compare; one that passes is formatted into a slot of a
+* lock-free ring and written out by a background thread, so no request
+* thread ever waits on stdio or the terminal. when the ring is full new
+* messages are dropped and counted instead
+*/
+
+#define LOG_RING_SIZE 1024 // messages buffered, a power of two
+#define LOG_LINE_SIZE 256 // longer messages are cut
+
+enum {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+};
+
+extern int log_level; // messages above it are skipped unformatted
+
+#define LOG_AT(level, ...) \
+    do { if ((level) <= log_level) log_write((level), __VA_ARGS__); } while (0)
+#define log_error(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+// start the writer thread, messages go to stdout
+void log_init(int level);
+// the level called name (error, warn, info, debug), or -1
+int log_find_level(const char *name);
+// queue one message, use the level macros instead
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+// messages dropped so far because the ring was full
+long long log_dropped(void);
+
+#endif /* __LOG_H__ */
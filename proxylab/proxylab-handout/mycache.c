@@ -1,84 +1,355 @@
 #include "mycache.h"
 
+#define SHARD_OF(h) ((h) & (CACHE_SHARD_NUM - 1))
+#define BUCKET_OF(h) (((h) / CACHE_SHARD_NUM) & (CACHE_BUCKET_NUM - 1))
+
+static s_buf_block* find_block(s_cache_shard* pshard, char* uri, unsigned int hash);
+static void hash_unlink(s_cache_shard* pshard, s_buf_block* pblock);
+static void remove_block(s_cache* pcache, s_cache_shard* pshard, s_buf_block* pblock);
+static void link_block(s_cache* pcache, s_buf_block* pblock);
+static void seal_block(s_buf_block* pblock, char* uri, int size, int framed, s_cache_meta* meta);
+static int meta_size(s_cache_meta* meta);
+
 int init_cache(s_cache* pcache) {
+	return init_cache_policy(pcache, &lru_policy, MAX_CACHE_SIZE);
+}
+
+// a cache of max_size payload bytes whose shards evict by policy
+int init_cache_policy(s_cache* pcache, const s_cache_policy* policy, long max_size) {
 	int i;
-	pcache->pbuf = NULL;
-	pcache->buf_num = CACHE_SIZE / BUFFER_SIZE;
-	pcache->pbuf = (s_buf_block *)malloc(pcache->buf_num * sizeof(s_buf_block));
-	if (pcache->pbuf == NULL)
+	long shard_size = max_size / CACHE_SHARD_NUM;
+
+	// every shard must be able to hold the largest cacheable object
+	if (shard_size < MAX_OBJECT_SIZE)
 	{
-		printf("cache initialization failed\n");
-		return 0;
+		shard_size = MAX_OBJECT_SIZE;
 	}
-
-	for (i = 0; i < pcache->buf_num; i++)
+	memset(pcache, 0, sizeof(s_cache));
+	pcache->policy = policy;
+	for (i = 0; i < CACHE_SHARD_NUM; i++)
 	{
-		pcache->pbuf[i].valid = 1;
-		pcache->pbuf[i].access_freq_level = 1;
+		s_cache_shard* pshard = &pcache->shard[i];
+		pshard->max_size = shard_size;
+		pthread_rwlock_init(&pshard->lock, NULL);
+		policy->init(pshard);
 	}
 	return 1;
 }
 
-char* check_for_cache(char* uri, s_cache* pcache, int* buf_size) {
-	int i;
-	for (i = 0; i < pcache->buf_num; i++)
+// FNV-1a hash of the uri, the low bits pick the shard
+unsigned int cache_hash(const char* uri) {
+	unsigned int h = 2166136261u;
+	while (*uri)
+	{
+		h ^= (unsigned char)*uri++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static s_buf_block* find_block(s_cache_shard* pshard, char* uri, unsigned int hash) {
+	s_buf_block* pblock = pshard->bucket[BUCKET_OF(hash)];
+	while (pblock != NULL)
 	{
-		if (!strcmp(uri, pcache->pbuf[i].uri))
+		if (pblock->hash == hash && !strcmp(uri, pblock->uri))
 		{
-			update_freq_level(pcache, i);
-			*buf_size = pcache->pbuf[i].valid_buf_size;
-			return pcache->pbuf[i].buf;
+			return pblock;
 		}
+		pblock = pblock->hnext;
 	}
 	return NULL;
 }
 
-void insert_to_cache(char* uri, char* src_buf, int src_size, s_cache* pcache) {
-	int i;
-	for (i = 0; i < pcache->buf_num; i++)
+static void hash_unlink(s_cache_shard* pshard, s_buf_block* pblock) {
+	s_buf_block** pp = &pshard->bucket[BUCKET_OF(pblock->hash)];
+	while (*pp != pblock)
 	{
-		if (pcache->pbuf[i].valid == 1)
+		pp = &(*pp)->hnext;
+	}
+	*pp = pblock->hnext;
+	pblock->hnext = NULL;
+}
+
+// drop a block from the index and the policy lists, the caller frees it
+static void remove_block(s_cache* pcache, s_cache_shard* pshard, s_buf_block* pblock) {
+	pcache->policy->remove(pshard, pblock);
+	hash_unlink(pshard, pblock);
+	pshard->size -= pblock->valid_buf_size;
+	pshard->block_num--;
+}
+
+/*
+* look up uri and return its block pinned, or NULL on a miss. the caller
+* reads the block without any lock and calls release_cache_block() when
+* done. concurrent hits on the same shard only share the read lock: the
+* policy marks the block and reorders its lists at eviction time
+*/
+s_buf_block* check_for_cache(char* uri, s_cache* pcache) {
+	unsigned int hash = cache_hash(uri);
+	s_cache_shard* pshard = &pcache->shard[SHARD_OF(hash)];
+	s_buf_block* pblock;
+
+	pthread_rwlock_rdlock(&pshard->lock);
+	pblock = find_block(pshard, uri, hash);
+	if (pblock == NULL)
+	{
+		// frequency based policies count misses too
+		if (pcache->policy->miss != NULL)
 		{
-			memcpy(pcache->pbuf[i].buf, src_buf, src_size);
-			strcpy(pcache->pbuf[i].uri, uri);
-			pcache->pbuf[i].valid = 0;
-			pcache->pbuf[i].valid_buf_size = src_size;
-			update_freq_level(pcache, i);
-			return;
+			pcache->policy->miss(pshard, hash);
 		}
+		pthread_rwlock_unlock(&pshard->lock);
+		return NULL;
 	}
+	__sync_add_and_fetch(&pblock->refcnt, 1);
+	pcache->policy->hit(pshard, pblock);
+	pthread_rwlock_unlock(&pshard->lock);
+	return pblock;
+}
 
-	for (i = 0; i < pcache->buf_num; i++)
+// drop one reference, the last one frees the block
+void release_cache_block(s_buf_block* pblock) {
+	if (__sync_sub_and_fetch(&pblock->refcnt, 1) == 0)
 	{
-		if (pcache->pbuf[i].access_freq_level == 1)
+		free(pblock);
+	}
+}
+
+// a stale block may still be served after a successful revalidation
+int is_cache_block_fresh(s_buf_block* pblock) {
+	time_t expires = cache_block_expires(pblock);
+	return expires == 0 || time(NULL) < expires;
+}
+
+time_t cache_block_expires(s_buf_block* pblock) {
+	return __atomic_load_n(&pblock->expires, __ATOMIC_RELAXED);
+}
+
+/*
+* the origin confirmed the object with a 304, keep it for another
+* lifetime. expires is the only field that changes after insertion, so
+* it is stored and loaded atomically like refcnt; a reader sees the old
+* or the new lifetime, never a torn one
+*/
+void refresh_cache_block(s_buf_block* pblock, time_t expires) {
+	__atomic_store_n(&pblock->expires, expires, __ATOMIC_RELAXED);
+}
+
+/*
+* link a fully built block into its shard, evicting the victims of the
+* policy until the shard payload fits its byte budget. the evicted blocks go to the
+* evict hook and their cache references are dropped outside the write lock
+*/
+static void link_block(s_cache* pcache, s_buf_block* pblock) {
+	unsigned int hash = pblock->hash;
+	s_cache_shard* pshard = &pcache->shard[SHARD_OF(hash)];
+	s_buf_block* old;
+	s_buf_block* replaced = NULL;
+	s_buf_block* victims = NULL;
+
+	pthread_rwlock_wrlock(&pshard->lock);
+	// another thread may have fetched the same uri meanwhile
+	if ((replaced = find_block(pshard, pblock->uri, hash)) != NULL)
+	{
+		remove_block(pcache, pshard, replaced);
+	}
+	pblock->hnext = pshard->bucket[BUCKET_OF(hash)];
+	pshard->bucket[BUCKET_OF(hash)] = pblock;
+	pshard->size += pblock->valid_buf_size;
+	pshard->block_num++;
+	pcache->policy->insert(pshard, pblock);
+	// the victim may be pblock itself when the policy refuses it
+	while (pshard->size > pshard->max_size)
+	{
+		old = pcache->policy->victim(pshard);
+		remove_block(pcache, pshard, old);
+		old->hnext = victims;
+		victims = old;
+	}
+	pthread_rwlock_unlock(&pshard->lock);
+
+	if (replaced != NULL)
+	{
+		release_cache_block(replaced);
+	}
+	while (victims != NULL)
+	{
+		old = victims;
+		victims = old->hnext;
+		if (pcache->evict_hook != NULL)
 		{
-			memcpy(pcache->pbuf[i].buf, src_buf, src_size);
-			strcpy(pcache->pbuf[i].uri, uri);
-			pcache->pbuf[i].valid_buf_size = src_size;
-			update_freq_level(pcache, i);
-			return;
+			pcache->evict_hook(old);
 		}
+		release_cache_block(old);
 	}
 }
 
-void update_freq_level(s_cache* pcache, int indx) {
-	int i;
-	int cur_level;
-	int indx_level = pcache->pbuf[indx].access_freq_level;
-	for (i = 0; i < pcache->buf_num; i++)
+// bytes of the validators stored behind the uri
+static int meta_size(s_cache_meta* meta) {
+	int size = 0;
+	if (meta != NULL && meta->etag != NULL)
+		size += strlen(meta->etag) + 1;
+	if (meta != NULL && meta->last_modified != NULL)
+		size += strlen(meta->last_modified) + 1;
+	return size;
+}
+
+// set up the header of a block whose payload is already in place
+static void seal_block(s_buf_block* pblock, char* uri, int size, int framed, s_cache_meta* meta) {
+	char* tail;
+
+	pblock->hash = cache_hash(uri);
+	pblock->refcnt = 1; // owned by the cache
+	pblock->valid_buf_size = size;
+	pblock->framed = framed;
+	pblock->expires = meta ? meta->expires : 0;
+	pblock->etag = pblock->last_modified = NULL;
+	pblock->list = 0;
+	pblock->referenced = 0;
+	pblock->hnext = pblock->prev = pblock->next = NULL;
+	pblock->uri = pblock->buf + size;
+	strcpy(pblock->uri, uri);
+	tail = pblock->uri + strlen(uri) + 1;
+	if (meta != NULL && meta->etag != NULL)
 	{
-		cur_level = pcache->pbuf[i].access_freq_level;
-		if ( (i!=indx) && (cur_level>indx_level) )
+		pblock->etag = tail;
+		strcpy(tail, meta->etag);
+		tail += strlen(tail) + 1;
+	}
+	if (meta != NULL && meta->last_modified != NULL)
+	{
+		pblock->last_modified = tail;
+		strcpy(tail, meta->last_modified);
+	}
+}
+
+// insert a copy of src_buf as the object of uri
+void insert_to_cache(char* uri, char* src_buf, int src_size, s_cache* pcache) {
+	s_buf_block* pblock;
+
+	if (src_size > MAX_OBJECT_SIZE)
+	{
+		return;
+	}
+	pblock = (s_buf_block *)malloc(sizeof(s_buf_block) + src_size + strlen(uri) + 1);
+	if (pblock == NULL)
+	{
+		return;
+	}
+	memcpy(pblock->buf, src_buf, src_size);
+	seal_block(pblock, uri, src_size, 0, NULL);
+	link_block(pcache, pblock);
+}
+
+void init_cache_builder(s_cache_builder* pbuilder) {
+	pbuilder->pblock = NULL;
+	pbuilder->cap = 0;
+}
+
+/*
+* append a relayed chunk, growing the block geometrically
+* return 1 while the object is still cacheable and 0 once abandoned
+*/
+int append_to_cache_builder(s_cache_builder* pbuilder, char* src_buf, int src_size) {
+	s_buf_block* pblock = pbuilder->pblock;
+	int size = pblock ? pblock->valid_buf_size : 0;
+	int cap = pbuilder->cap;
+
+	if (cap < 0)
+	{
+		return 0;
+	}
+	if (size + src_size > MAX_OBJECT_SIZE)
+	{
+		free_cache_builder(pbuilder);
+		pbuilder->cap = -1;
+		return 0;
+	}
+	if (size + src_size > cap)
+	{
+		cap = cap ? cap : MAXBUF;
+		while (cap < size + src_size)
 		{
-			pcache->pbuf[i].access_freq_level --;
+			cap *= 2;
 		}
+		if (cap > MAX_OBJECT_SIZE)
+		{
+			cap = MAX_OBJECT_SIZE;
+		}
+		pblock = (s_buf_block *)realloc(pblock, sizeof(s_buf_block) + cap);
+		if (pblock == NULL)
+		{
+			free_cache_builder(pbuilder);
+			pbuilder->cap = -1;
+			return 0;
+		}
+		pblock->valid_buf_size = size;
+		pbuilder->pblock = pblock;
+		pbuilder->cap = cap;
+	}
+	memcpy(pblock->buf + size, src_buf, src_size);
+	pblock->valid_buf_size = size + src_size;
+	return 1;
+}
+
+// hand the assembled object of uri to the cache and reset the builder
+void commit_cache_builder(s_cache_builder* pbuilder, char* uri, int framed, s_cache_meta* meta, s_cache* pcache) {
+	s_buf_block* pblock = pbuilder->pblock;
+	s_buf_block* fitted;
+	int size;
+
+	init_cache_builder(pbuilder);
+	if (pblock == NULL)
+	{
+		return;
+	}
+	size = pblock->valid_buf_size;
+	// shrink to fit and make room for the uri and validators behind the payload
+	fitted = (s_buf_block *)realloc(pblock, sizeof(s_buf_block) + size + strlen(uri) + 1 + meta_size(meta));
+	if (fitted == NULL)
+	{
+		free(pblock);
+		return;
+	}
+	seal_block(fitted, uri, size, framed, meta);
+	link_block(pcache, fitted);
+}
+
+void free_cache_builder(s_cache_builder* pbuilder) {
+	if (pbuilder->pblock != NULL)
+	{
+		free(pbuilder->pblock);
 	}
-	pcache->pbuf[indx].access_freq_level = pcache->buf_num;
+	init_cache_builder(pbuilder);
+}
+
+// the object will not be cached, drop what was assembled and refuse the rest
+void abandon_cache_builder(s_cache_builder* pbuilder) {
+	free_cache_builder(pbuilder);
+	pbuilder->cap = -1;
 }
 
 void delete_cache(s_cache* pcache) {
-	if (pcache->pbuf != NULL)
+	int i;
+	for (i = 0; i < CACHE_SHARD_NUM; i++)
 	{
-		free(pcache->pbuf);
+		s_cache_shard* pshard = &pcache->shard[i];
+		int j;
+		for (j = 0; j < CACHE_LIST_NUM; j++)
+		{
+			while (pshard->list[j].head != NULL)
+			{
+				s_buf_block* pblock = pshard->list[j].head;
+				pshard->list[j].head = pblock->next;
+				release_cache_block(pblock);
+			}
+			pshard->list[j].tail = NULL;
+			pshard->list[j].size = 0;
+		}
+		pcache->policy->destroy(pshard);
+		pshard->size = 0;
+		pshard->block_num = 0;
+		memset(pshard->bucket, 0, sizeof(pshard->bucket));
+		pthread_rwlock_destroy(&pshard->lock);
 	}
-}
\ No newline at end of file
+}
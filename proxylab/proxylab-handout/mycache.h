@@ -1,3 +1,6 @@
+#ifndef __MYCACHE_H__
+#define __MYCACHE_H__
+
 #include <stdio.h>
 #include <getopt.h>
 #include <stdlib.h>
@@ -6,27 +9,137 @@
 #include "csapp.h"
 
 
-#define CACHE_SIZE 1049000
-#define BUFFER_SIZE 102400
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
 #define URI_SIZE 1024
+#define CACHE_SHARD_NUM 8 // independently locked shards, power of two
+#define CACHE_BUCKET_NUM 1024 // hash buckets per shard, power of two
+#define CACHE_LIST_NUM 3 // replacement lists a policy may use in each shard
 
-typedef struct
+/*
+* a block is allocated to fit its object exactly, the payload is followed
+* by the nul terminated uri and validators in the same allocation. the
+* object is immutable once inserted; expires, refcnt and referenced may
+* change under readers and are only accessed atomically there, the list
+* links only under the shard write lock. blocks are reference counted: the cache holds one reference while
+* the block is indexed and every hit pins another one, so eviction only
+* frees the memory after the last reader has released it
+*/
+typedef struct s_buf_block
 {
-	int valid;
-	int access_freq_level;
+	unsigned int hash; // full cache_hash() of the uri
+	int refcnt;
 	int valid_buf_size;
-	char uri[MAXLINE];
-	char buf[BUFFER_SIZE];
+	int framed; // the object carries its own length, the client may stay connected
+	int list; // replacement list of the shard that holds the block
+	int referenced; // hit since the policy last looked, set without the write lock
+	time_t expires; // fresh until then and revalidated after, 0 if it never goes stale; atomic
+	char* etag; // validators of the object, NULL if the origin sent none
+	char* last_modified;
+	struct s_buf_block* hnext; // next block in the same hash bucket
+	struct s_buf_block* prev; // neighbours on its list, head is most recently used
+	struct s_buf_block* next;
+	char* uri;
+	char buf[];
 } s_buf_block;
 
 typedef struct
 {
-	int buf_num;
-	s_buf_block* pbuf;
+	s_buf_block* head; // most recently used
+	s_buf_block* tail; // least recently used
+	long size; // payload bytes on the list
+} s_cache_list;
+
+/*
+* one shard owns a slice of the blocks and its own reader/writer lock,
+* so lookups for unrelated uris never touch the same lock. each shard
+* gets an equal slice of the cache size, at least MAX_OBJECT_SIZE
+*/
+typedef struct
+{
+	pthread_rwlock_t lock;
+	long max_size; // payload byte budget of this shard
+	long size; // payload bytes currently cached
+	int block_num;
+	s_cache_list list[CACHE_LIST_NUM]; // ordered by the replacement policy
+	void* policy_data; // private state of the policy
+	s_buf_block* bucket[CACHE_BUCKET_NUM];
+} __attribute__((aligned(64))) s_cache_shard;
+
+/*
+* a replacement policy orders the blocks of every shard on its lists.
+* hit runs on every cache hit and miss (if not NULL) on every miss, both
+* under the shard read lock only and alongside other hits, so they just
+* set the referenced bit of the block or update counters atomically.
+* insert, victim and remove run under the write lock: victim reorders
+* the lists by the referenced bits, second chance style, and names the
+* next block to drop while the shard is over budget. it may name the
+* block just inserted to refuse its admission
+*/
+typedef struct s_cache_policy
+{
+	const char* name;
+	void (*init)(s_cache_shard* pshard);
+	void (*destroy)(s_cache_shard* pshard);
+	void (*hit)(s_cache_shard* pshard, s_buf_block* pblock);
+	void (*miss)(s_cache_shard* pshard, unsigned int hash);
+	void (*insert)(s_cache_shard* pshard, s_buf_block* pblock);
+	s_buf_block* (*victim)(s_cache_shard* pshard);
+	void (*remove)(s_cache_shard* pshard, s_buf_block* pblock);
+} s_cache_policy;
+
+extern const s_cache_policy lru_policy; // plain recency
+extern const s_cache_policy slru_policy; // probation and protected segments
+extern const s_cache_policy wtinylfu_policy; // lru window, frequency sketch admission into slru
+
+typedef struct
+{
+	s_cache_shard shard[CACHE_SHARD_NUM];
+	const s_cache_policy* policy;
+	// called for every block pushed out of the lru tail, outside the shard
+	// lock and before the cache drops its reference. NULL to just drop it
+	void (*evict_hook)(s_buf_block* pblock);
 } s_cache;
 
+/*
+* freshness and validators of a response, parsed from its headers
+*/
+typedef struct
+{
+	time_t expires; // 0 if it never goes stale
+	char* etag; // NULL if absent
+	char* last_modified;
+} s_cache_meta;
+
+/*
+* a response assembled for the cache while it is being relayed. chunks
+* are appended straight into a growing block, which is handed to the
+* cache without another copy or dropped once it passes MAX_OBJECT_SIZE
+*/
+typedef struct
+{
+	s_buf_block* pblock; // NULL until the first chunk or once abandoned
+	int cap; // payload capacity of pblock, -1 once abandoned
+} s_cache_builder;
+
 int init_cache(s_cache* pcache);
+int init_cache_policy(s_cache* pcache, const s_cache_policy* policy, long max_size);
+const s_cache_policy* find_cache_policy(const char* name);
+void cache_list_unlink(s_cache_list* plist, s_buf_block* pblock);
+void cache_list_push_front(s_cache_list* plist, s_buf_block* pblock, int list);
 void delete_cache(s_cache* pcache);
-char* check_for_cache(char* uri, s_cache* pcache, int* buf_size);
+unsigned int cache_hash(const char* uri);
+s_buf_block* check_for_cache(char* uri, s_cache* pcache);
+void release_cache_block(s_buf_block* pblock);
+int is_cache_block_fresh(s_buf_block* pblock);
+void refresh_cache_block(s_buf_block* pblock, time_t expires);
+time_t cache_block_expires(s_buf_block* pblock);
 void insert_to_cache(char* uri, char* src_buf, int src_size, s_cache* pcache);
-void update_freq_level(s_cache* pcache, int indx);
\ No newline at end of file
+void init_cache_builder(s_cache_builder* pbuilder);
+int append_to_cache_builder(s_cache_builder* pbuilder, char* src_buf, int src_size);
+void commit_cache_builder(s_cache_builder* pbuilder, char* uri, int framed, s_cache_meta* meta, s_cache* pcache);
+void free_cache_builder(s_cache_builder* pbuilder);
+void abandon_cache_builder(s_cache_builder* pbuilder);
+
+#endif /* __MYCACHE_H__ */
@@ -0,0 +1,138 @@
+/*
+* poolbench.c - hand-off benchmark of the connection queues. one producer
+*     inserts items as fast as it can and every item records the time from
+*     its insert to the moment a worker dequeued it. compares the semaphore
+*     sbuf_t with a fixed size and an auto-sizing wpool_t
+*
+* usage: poolbench [-t threads] [-i items] [-w work_ns]
+*/
+#include "csapp.h"
+#include "sbuf.h"
+#include "wpool.h"
+
+#define SBUF_SIZE 16 // the proxy's old queue depth
+
+static int items = 200000;
+static int work_ns = 0; // busy work per item, to make workers block
+static long long *stamp; // insert time of every item
+static long long *lat; // insert to dequeue latency of every item
+static volatile int done;
+static sbuf_t sbuf;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void handle(int item)
+{
+    long long t = now_ns();
+
+    lat[item] = t - stamp[item];
+    while (work_ns > 0 && now_ns() - t < work_ns)
+        ;
+    __sync_add_and_fetch(&done, 1);
+}
+
+static void *sbuf_thread(void *vargp)
+{
+    int item;
+
+    while ((item = sbuf_remove(&sbuf)) >= 0)
+        handle(item);
+    return NULL;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(char *name, long long start, long long end)
+{
+    double sum = 0;
+    int i;
+
+    for (i = 0; i < items; i++)
+        sum += lat[i];
+    qsort(lat, items, sizeof(long long), cmp_ll);
+    printf("%-18s %12.0f %10.0f %10lld %10lld\n", name,
+           items / ((end - start) / 1e9), sum / items,
+           lat[items / 2], lat[(long)items * 99 / 100]);
+}
+
+static void run_sbuf(int nthreads)
+{
+    pthread_t tid[nthreads];
+    long long start, end;
+    int i;
+
+    done = 0;
+    sbuf_init(&sbuf, SBUF_SIZE);
+    for (i = 0; i < nthreads; i++)
+        Pthread_create(&tid[i], NULL, sbuf_thread, NULL);
+    start = now_ns();
+    for (i = 0; i < items; i++) {
+        stamp[i] = now_ns();
+        sbuf_insert(&sbuf, i);
+    }
+    while (done < items)
+        usleep(100);
+    end = now_ns();
+    for (i = 0; i < nthreads; i++)
+        sbuf_insert(&sbuf, -1);
+    for (i = 0; i < nthreads; i++)
+        Pthread_join(tid[i], NULL);
+    sbuf_deinit(&sbuf);
+    report("sbuf", start, end);
+}
+
+// the pool has no shutdown, its workers stay idle until the process exits
+static void run_wpool(char *name, int min_workers, int max_workers)
+{
+    wpool_t *wp = Malloc(sizeof(wpool_t));
+    long long start, end;
+    int i;
+
+    done = 0;
+    wpool_init(wp, min_workers, max_workers, handle);
+    start = now_ns();
+    for (i = 0; i < items; i++) {
+        stamp[i] = now_ns();
+        wpool_insert(wp, i);
+    }
+    while (done < items)
+        usleep(100);
+    end = now_ns();
+    report(name, start, end);
+}
+
+int main(int argc, char **argv)
+{
+    int c, nthreads = 4;
+
+    while ((c = getopt(argc, argv, "t:i:w:")) != -1) {
+        switch (c) {
+        case 't': nthreads = atoi(optarg); break;
+        case 'i': items = atoi(optarg); break;
+        case 'w': work_ns = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-t threads] [-i items] [-w work_ns]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+    stamp = Malloc(items * sizeof(long long));
+    lat = Malloc(items * sizeof(long long));
+
+    printf("threads=%d items=%d work=%dns\n", nthreads, items, work_ns);
+    printf("%-18s %12s %10s %10s %10s\n", "queue", "items/s",
+           "mean ns", "p50 ns", "p99 ns");
+    run_sbuf(nthreads);
+    run_wpool("wpool fixed", nthreads, nthreads);
+    run_wpool("wpool auto", 1, nthreads);
+    return 0;
+}
@@ -2,278 +2,616 @@
 Author : Chengxiong Ruan
 AndrewID : cruan
 */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include "csapp.h"
-#include "sbuf.h"
+#include "wpool.h"
 #include "mycache.h"
+#include "proxy.h"
+#include "event.h"
+#include "relay.h"
+#include "http.h"
+#include "request.h"
+#include "upstream.h"
+#include "dnscache.h"
+#include "flight.h"
+#include "diskcache.h"
+#include "stats.h"
+#include "log.h"
+#include "accesslog.h"
+#include "range.h"
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
-
-// target server port
-#define SERVER_PORT 80 // default port of server
-#define THREAD_NUM 5 // the number of threads in pool
-#define SBUF_SIZE 16 // the size of buffer for producer and comsumer model
-
-/* You won't lose style points for including these long lines in your code */
-static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
-static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
-static const char *connection_hdr = "Connection: close\r\n";
-static const char *proxy_connection_hdr = "Proxy-Connection: close\r\n";
-
-// thread function
-void* thread_func(void *vargp);
-// do function for each thread
-void doit(int connfd);
-// parse request from client
-int parse_request(char* uri, char* host_name, char* new_uri, char* port);
-// get header name from each line of request read
-void get_header_name(char *header, char *header_name);
-// if the header is listed in the writeup, then ignore it
-int be_ignore_header(char *header_name);
-// generate a new request forwarded to server
-void generate_forward_request(rio_t* client_request_rio, char* client_request_buf, char* forward_request_buf, char* host_name, char* new_uri);
+#define THREAD_NUM 5 // default minimum number of threads in pool
+#define MAX_THREAD_NUM 64 // default maximum the pool grows to
+#define CLIENT_IDLE_SECS 5 // keep-alive client connections idle longer are closed
+
+// what the client got for a request, for the access log
+typedef struct {
+    int status; // response status, 0 if none was sent
+    long long bytes; // response bytes sent to the client
+    const char* result; // HIT, DISK, JOINED, MISS, REVAL or ERROR
+} req_outcome;
+
+// worker function, serves one client connection
+void serve_conn(int connfd);
+// serve the requests of one client connection in order
+void serve_client(int connfd);
+// do function for each request, return 1 if the connection stays open
+int doit(int connfd, rio_t* client_request_rio);
+// answer a parsed request from the caches or the origin
+int answer_request(int connfd, http_request* request, char* head, char* uri, req_outcome* out);
+// read the request head from the client into head, return its length or 0
+int read_request_head(rio_t* client_request_rio, char* head);
+// answer a request from a pinned cache block, or from the disk tier
+int send_cached(int connfd, s_buf_block* cached, http_request* request, char* head, int keep_alive, req_outcome* out);
+int send_disk(int connfd, disk_hit* hit, http_request* request, char* head, int keep_alive, req_outcome* out);
+// write a whole cached object to the client, return the bytes written or -1
+int send_object(int connfd, s_buf_block* block, int keep_alive);
+// answer a request for the statistics endpoint
+int send_stats(int connfd, int format);
+// send the request upstream and relay the response to the client
+int fetch_from_server(int connfd, char* host_name, int port, struct iovec* request, int request_iovcnt, char* uri, int* leader, char* buf, s_buf_block* stale, int keep_alive, req_outcome* out);
+// the fetch of uri will not fill the cache, let its followers fetch on their own
+void land_early(char* uri, int* leader);
 
 // for multi-thread
-sbuf_t sbuf;
-// for cache
+wpool_t pool;
+// for cache, each shard carries its own lock
 s_cache cache;
-pthread_mutex_t mutex;
 
 /*
 * main function
 */
 int main(int argc, char **argv)
 {
-	int i, listenfd, connfd, port;
+	int c, listenfd, connfd, port;
+    int event_mode = 0; // 1 to serve with epoll loops instead of the thread pool
+    int loop_num = sysconf(_SC_NPROCESSORS_ONLN); // event loops, one per core
+    int min_threads = THREAD_NUM, max_threads = MAX_THREAD_NUM; // pool bounds
+    char *disk_dir = NULL; // directory of the disk cache tier, off if NULL
+    const s_cache_policy *policy = &lru_policy; // replacement policy of the memory cache
+    int level = LOG_LEVEL_INFO; // log messages up to this level
+    char *access_path = NULL; // access log file, off if NULL
     struct sockaddr_in clientaddr;
     socklen_t clientlen = sizeof(clientaddr);
-    pthread_t tid;
 
     /* Check command line args */
-    if (argc != 2) {
-	   fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((c = getopt(argc, argv, "en:t:T:d:p:l:a:")) != -1) {
+        switch (c) {
+        case 'e':
+            event_mode = 1;
+            break;
+        case 'n':
+            loop_num = atoi(optarg);
+            break;
+        case 't':
+            min_threads = atoi(optarg);
+            break;
+        case 'T':
+            max_threads = atoi(optarg);
+            break;
+        case 'd':
+            disk_dir = optarg;
+            break;
+        case 'p':
+            if ((policy = find_cache_policy(optarg)) == NULL) {
+                fprintf(stderr, "unknown cache policy %s (lru, slru, wtinylfu)\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'l':
+            if ((level = log_find_level(optarg)) < 0) {
+                fprintf(stderr, "unknown log level %s (error, warn, info, debug)\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'a':
+            access_path = optarg;
+            break;
+        default:
+            optind = argc; // fall through to usage
+            break;
+        }
+    }
+    if (optind != argc - 1) {
+	   fprintf(stderr, "usage: %s [-e] [-n loops] [-t min_threads] [-T max_threads] [-d cache_dir] [-p policy] [-l level] [-a access_log] <port>\n", argv[0]);
 	   exit(1);
     }
-    port = atoi(argv[1]); // get proxy port
-    sbuf_init(&sbuf, SBUF_SIZE); // initialize producer and comsumer model
-    pthread_mutex_init(&mutex, NULL); // initialize mutext for cache access lock
+    port = atoi(argv[optind]); // get proxy port
     Signal(SIGPIPE, SIG_IGN); // ingore SIGPIPE signal
-    init_cache(&cache); // initialize cache
-
-    listenfd = Open_listenfd(port); // open proxy listen
+    log_init(level); // messages are written by a background thread
+    init_stats(); // per-thread counters behind STATS_PATH
+    // one line per request, written in batches by a background thread
+    if (access_path != NULL && access_log_open(access_path) < 0) {
+        fprintf(stderr, "cannot open access log %s\n", access_path);
+        exit(1);
+    }
+    init_cache_policy(&cache, policy, MAX_CACHE_SIZE); // initialize cache
+    if (disk_dir != NULL) {
+        // objects evicted from memory move to the disk tier
+        if (init_disk_cache(disk_dir) < 0) {
+            fprintf(stderr, "cannot open disk cache in %s\n", disk_dir);
+            exit(1);
+        }
+        cache.evict_hook = disk_cache_store;
+    }
+    init_upstream_pool(); // idle keep-alive connections to servers
+    init_dns_cache(DNS_RESOLVER_NUM); // shared host name lookups
 
-    // create thread pool
-    for ( i = 0; i < THREAD_NUM; i++) {
-        Pthread_create(&tid, NULL, thread_func, NULL);
+    if (event_mode) {
+        log_info("serving port %d with %d event loops", port, loop_num > 0 ? loop_num : 1);
+        event_main(port, loop_num > 0 ? loop_num : 1);
     }
 
+    listenfd = Open_listenfd(port); // open proxy listen
+    // the pool grows while every worker is busy and shrinks when idle
+    wpool_init(&pool, min_threads, max_threads, serve_conn);
+    log_info("serving port %d with %d to %d threads", port, min_threads, max_threads);
+
     // listen to request from client
     while (1) {
     	connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        sbuf_insert(&sbuf, connfd); // insert connfd into a available slot
+        stats_accepted(connfd); // starts its queue time
+        wpool_insert(&pool, connfd); // hand connfd to a worker
     }
 
     return 0;
 }
 
 /*
-* thread function
+* worker function
 */
-void *thread_func(void *vargp) {
-    // detach threads
-    Pthread_detach(pthread_self());
-    while (1) {
-        // get a connfd from slots
-        int connfd = sbuf_remove(&sbuf);
-        doit(connfd);
-        Close(connfd);
-    }
+void serve_conn(int connfd) {
+    stats_dequeued(connfd);
+    serve_client(connfd);
+    Close(connfd);
+}
+
+/*
+* serve_client - handle requests on connfd until the client or a response
+* ends the connection. pipelined requests wait in the rio buffer and are
+* answered in order; an idle client times out after CLIENT_IDLE_SECS
+*/
+void serve_client(int connfd)
+{
+    rio_t client_request_rio;
+    struct timeval idle = {CLIENT_IDLE_SECS, 0};
+
+    setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    Rio_readinitb(&client_request_rio, connfd);
+    while (doit(connfd, &client_request_rio))
+        ;
 }
 
 /*
 * response to request
 */
-void doit(int connfd)
+int doit(int connfd, rio_t* client_request_rio)
 {
-    int port = SERVER_PORT; // default server port
-    int port_flag = 0; // be 0 if there is no port information in url, otherwise, be 1
     int n; // how much byte read from io
-    int forward_client_fd; // fd created as client to send request to server
-	rio_t client_request_rio; // read from client request
-    rio_t server_recieve_rio; // read from server response 
-	char client_request_buf[MAXLINE]; // buf for reading client request
-    char forward_request_buf[MAX_OBJECT_SIZE]; // buf for sending request to server
-    char server_recieve_buf[MAX_OBJECT_SIZE]; // buf for recieving response from server
-	char method[MAXLINE]; // request method
-	char uri[MAXLINE]; //request uri
-	char version[MAXLINE]; // request version
-	char host_name[MAXLINE]; // request host name
-    char new_uri[MAXLINE]; // uri without host name
-    char port_name[10] = {0}; // port number read from client request if there is some
-
-    // read request from client through connection fd
-	Rio_readinitb(&client_request_rio, connfd);
-	n = Rio_readlineb(&client_request_rio, client_request_buf, MAXLINE);
-    client_request_buf[n] = '\0';
-	sscanf(client_request_buf, "%s %s %s", method, uri, version);
-    printf("method : %s\n", method);
-    printf("uri : %s\n", uri);
-    printf("version %s\n", version);
-	if (strcasecmp(method, "GET")) { 
-        printf("not get method\n");
-        return;
-    }
+    int format; // of a statistics request
+    long long start; // of the request, then of the stage being timed
+    http_request request; // where each part of the request lies in head
+    char head[REQ_HEAD_SIZE]; // request head as the client sent it
+    char* uri; // request uri, the cache key
+    req_outcome out = {0, 0, "ERROR"}; // what the client got, for the access log
 
-    // parse request from client
-    printf("parsing request .... \n");
-    port_flag = parse_request(uri, host_name, new_uri, port_name);
-    printf("uri : %s\n", new_uri);
-    printf("host_name : %s\n", host_name);
-
-    // read cache
-    int cache_size;
-    pthread_mutex_lock(&mutex);
-    printf("lock cache \n");
-    char* cache_buf = check_for_cache(uri, &cache, &cache_size);
-    // check if there is a cache hit
-    // if hit, read directly from cache
-    if (cache_buf != NULL) {
-        Rio_writen(connfd, cache_buf, cache_size);
-        printf("get cache\n");
-        printf("cache unlock \n");
-        return;
+    // read request from client, a timeout or EOF ends the connection
+    if ((n = read_request_head(client_request_rio, head)) == 0) {
+        return 0;
     }
-    pthread_mutex_unlock(&mutex);
-
-    // if there is flag in client request, use the port specified
-    if (port_flag) {
-        port = atoi(port_name);
-    }
-    generate_forward_request(&client_request_rio, client_request_buf,
-        forward_request_buf, host_name, new_uri);
-    if ( (forward_client_fd = Open_clientfd(host_name, port)) < 0 ) {
-        return;
+    // the endpoint is asked of the proxy itself, not through it
+    if ((format = stats_request(head, n)) != 0) {
+        return send_stats(connfd, format);
     }
-    // send request and get response
-    Rio_writen(forward_client_fd, forward_request_buf, strlen(forward_request_buf));
-    Rio_readinitb(&server_recieve_rio, forward_client_fd);
-    int data_size = 0;
-    while ((n = Rio_readnb(&server_recieve_rio, server_recieve_buf, MAX_OBJECT_SIZE)) > 0) {
-        Rio_writen(connfd, server_recieve_buf, n);
-        data_size += n;
+    stats_add(STAT_REQUESTS, 1);
+    // one pass over the head finds the uri parts and every header
+    start = stats_now();
+    n = parse_http_request(&request, head, n);
+    stats_time(STAGE_PARSE, stats_now() - start);
+    if (n <= 0) {
+        log_info("malformed request, closing the connection");
+        return 0;
     }
-    // if data size if smaller than MAX, cache it  
-    if (data_size <= MAX_OBJECT_SIZE) {
-        pthread_mutex_lock(&mutex);
-        insert_to_cache(uri, server_recieve_buf, data_size, &cache);
-        pthread_mutex_unlock(&mutex);
+	if (!req_span_is(head, request.method, "GET")) {
+        log_info("not a GET request, closing the connection");
+        return 0;
     }
-    printf("cache unlock \n");
-    Close(forward_client_fd);
+    // the blank after the uri is never forwarded, terminate it in place
+    uri = head + request.uri.off;
+    uri[request.uri.len] = '\0';
+    log_debug("uri: %s", uri);
+
+    n = answer_request(connfd, &request, head, uri, &out);
+    access_log("GET", uri, out.status, out.bytes, start, out.result);
+    return n;
 }
 
-// get host name, uri, port
-int parse_request(char* uri, char* host_name, char* new_uri, char* port)
+/*
+* answer_request - answer a parsed GET from the caches or the origin and
+* record in out what the client got. return 1 if the connection stays open
+*/
+int answer_request(int connfd, http_request* request, char* head, char* uri, req_outcome* out)
 {
-    char *p = uri+7;
-    char *p_port;
-    int end_idx = 0;
-    int port_flag = 0;
-
-    while (*p != '\0') {
-        if (*p == ':') {
-            port_flag = 1;
-            p_port = p;
+    int n;
+    int keep_alive = request->keep_alive; // the client wants the connection kept open
+    int leader; // this thread fetches uri for all concurrent misses
+    int iovcnt; // pieces of the forward request
+    int fresh, on_disk; // where the lookup found the object
+    long long start; // of the lookup
+    disk_hit hit; // where the object lies in the disk tier
+	char client_request_buf[MAXLINE]; // buf for relaying the response
+	char host_name[MAXLINE]; // request host name
+    struct iovec forward_request[FORWARD_IOV_MAX]; // request sent to server, mostly pieces of head
+
+    req_span_str(head, request->host, host_name, MAXLINE);
+
+    // read cache, a hit pins the object so it is streamed to the client
+    // without holding any lock and survives a concurrent eviction; then
+    // the disk tier, sent from its segment file without a copy
+    start = stats_now();
+    s_buf_block* cached = check_for_cache(uri, &cache);
+    fresh = cached != NULL && is_cache_block_fresh(cached);
+    on_disk = cached == NULL && disk_cache_lookup(uri, &hit);
+    stats_time(STAGE_LOOKUP, stats_now() - start);
+    if (fresh) {
+        stats_add(STAT_HITS, 1);
+        out->result = "HIT";
+        return send_cached(connfd, cached, request, head, keep_alive, out);
+    }
+    if (on_disk) {
+        log_debug("disk cache hit: %s", uri);
+        stats_add(STAT_DISK_HITS, 1);
+        out->result = "DISK";
+        return send_disk(connfd, &hit, request, head, keep_alive, out);
+    }
+    // a miss already being fetched by another thread waits for that fetch
+    if (!(leader = flight_join(uri, NULL, NULL))) {
+        stats_add(STAT_COALESCED, 1);
+        if (cached != NULL) {
+            release_cache_block(cached);
         }
-        if (*p == '/') {
-            break;
+        if ((cached = check_for_cache(uri, &cache)) != NULL && is_cache_block_fresh(cached)) {
+            out->result = "JOINED";
+            return send_cached(connfd, cached, request, head, keep_alive, out);
         }
-        end_idx++;
-        p++;
     }
-    strcpy(new_uri, p);
-    if (port_flag){
-        strncpy(host_name, uri+7, p_port - uri - 7);
-        host_name[p_port - uri - 7] = '\0';
-        strncpy(port, p_port+1, p - p_port);
-        port[p-p_port] = '\0';
-    } else {
-        strncpy(host_name, uri+7, end_idx);
-        host_name[end_idx] = '\0';
+    // a stale object is revalidated if the origin gave it a validator
+    if (cached != NULL && cached->etag == NULL && cached->last_modified == NULL) {
+        release_cache_block(cached);
+        cached = NULL;
     }
-    return port_flag;
+    iovcnt = forward_request_iov(request, head, cached, forward_request);
+    stats_add(STAT_MISSES, 1);
+
+    // only a response that delimits itself lets the connection stay open
+    n = fetch_from_server(connfd, host_name, request->port, forward_request, iovcnt,
+        uri, &leader, client_request_buf, cached, keep_alive, out) && keep_alive;
+    if (cached != NULL) {
+        release_cache_block(cached);
+    }
+    if (leader) {
+        flight_land(uri);
+    }
+    return n;
 }
 
-// get header name
-void get_header_name(char *header, char *header_name)
+/*
+* read_request_head - read lines up to and including the blank one into
+* head, which holds REQ_HEAD_SIZE bytes. return the head length, or 0 on
+* EOF, timeout or a head too long to forward
+*/
+int read_request_head(rio_t* client_request_rio, char* head)
 {
-    memset(header_name, 0x0, MAXLINE);
-    memcpy(header_name, header, (strchr(header, ':') - header));
+    int n, len = 0;
+
+    while (len < REQ_HEAD_SIZE - 1) {
+        if ((n = rio_readlineb(client_request_rio, head + len, REQ_HEAD_SIZE - len)) <= 0) {
+            return 0;
+        }
+        // the blank line ends the head, as in the event loops
+        if (req_head_len(head, len + n, len) > 0) {
+            return len + n;
+        }
+        len += n;
+    }
+    return 0;
 }
 
-// is the header should be ignore?
-int be_ignore_header(char *header_name)
+/*
+* send_cached - write a pinned cache block to the client and release it.
+* a request for a byte range gets a 206 with just that slice, which
+* carries its own length whether the object did or not
+*/
+int send_cached(int connfd, s_buf_block* cached, http_request* request, char* head, int keep_alive, req_outcome* out)
 {
-    if (!strcmp("User-Agent", header_name)) {
-        return 1;
+    int n;
+    range_reply reply;
+    struct iovec iov[2];
+
+    if (range_reply_for(head, request->range, request->if_range, cached->buf,
+                        cached->valid_buf_size, cached->valid_buf_size, keep_alive, &reply)) {
+        iov[0].iov_base = reply.head;
+        iov[0].iov_len = reply.head_len;
+        iov[1].iov_base = cached->buf + reply.body_off;
+        iov[1].iov_len = reply.body_len;
+        n = rio_writev(connfd, iov, 2);
+        out->status = reply.status;
+        stats_add(STAT_PARTIAL, 1);
+    } else {
+        keep_alive = keep_alive && cached->framed;
+        n = send_object(connfd, cached, keep_alive);
+        out->status = 200; // only 200 responses are cached
     }
-    else if (!strcmp("Accept", header_name)) {
-        return 1;
+    if (n >= 0) {
+        stats_add(STAT_BYTES_CACHED, n);
+        out->bytes = n;
+    }
+    release_cache_block(cached);
+    return keep_alive && n >= 0;
+}
+
+/*
+* send_disk - send a disk tier hit to the client from its segment file,
+* narrowed to the requested byte range behind a 206 head like a memory
+* hit. the head is read back from the segment to build the one sent
+*/
+int send_disk(int connfd, disk_hit* hit, http_request* request, char* head, int keep_alive, req_outcome* out)
+{
+    int n, off;
+    long head_len;
+    range_reply reply;
+    char resp[RANGE_HEAD_SIZE];
+
+    out->status = 200;
+    if ((n = disk_cache_peek(hit, resp, sizeof(resp))) <= 0
+        || (head_len = resp_head_len(resp, n)) == 0) {
+        close(hit->fd);
+        return 0;
     }
-    else if (!strcmp("Accept-Encoding", header_name)) {
-        return 1;
+    if (range_reply_for(head, request->range, request->if_range, resp, n, hit->size,
+                        keep_alive, &reply)) {
+        hit->offset += reply.body_off;
+        hit->size = reply.body_len;
+        out->status = reply.status;
+        stats_add(STAT_PARTIAL, 1);
+    } else {
+        keep_alive = keep_alive && hit->framed;
+        if ((reply.head_len = resp_connection_head(resp, head_len, keep_alive,
+                                                   reply.head, RANGE_HEAD_SIZE)) < 0) {
+            close(hit->fd);
+            return 0;
+        }
+        hit->offset += head_len;
+        hit->size -= head_len;
     }
-    else if (!strcmp("Connection", header_name)) {
-        return 1;
+    // held back to share a packet with the body
+    for (off = 0; off < reply.head_len; off += n) {
+        if ((n = send(connfd, reply.head + off, reply.head_len - off, MSG_MORE)) < 0) {
+            if (errno != EINTR) {
+                close(hit->fd);
+                return 0;
+            }
+            n = 0;
+        }
     }
-    else if (!strcmp("Proxy-Connection", header_name)) {
-        return 1;
+    stats_add(STAT_BYTES_CACHED, reply.head_len + hit->size);
+    if (disk_cache_send(connfd, hit) < 0) {
+        return 0;
     }
-    return 0;
+    out->bytes = reply.head_len + hit->size;
+    return keep_alive;
 }
 
-// generate request strings to forward request
-void generate_forward_request(rio_t* client_request_rio, char* client_request_buf,
- char* forward_request_buf, char* host_name, char* new_uri)
+/*
+* send_object - write the cached object in block to connfd, its head
+* telling whether the connection stays open after it
+*/
+int send_object(int connfd, s_buf_block* block, int keep_alive)
 {
     int n;
-    char header_name[MAXLINE];
+    long head_len = resp_head_len(block->buf, block->valid_buf_size);
+    char resp[RESP_HEAD_SIZE];
+    struct iovec iov[2];
+
+    if ((n = resp_connection_head(block->buf, head_len, keep_alive, resp, sizeof(resp))) < 0) {
+        return -1;
+    }
+    iov[0].iov_base = resp;
+    iov[0].iov_len = n;
+    iov[1].iov_base = block->buf + head_len;
+    iov[1].iov_len = block->valid_buf_size - head_len;
+    return rio_writev(connfd, iov, 2);
+}
 
-    memset(forward_request_buf, 0x0, MAXLINE);
-    strcat(forward_request_buf, "GET ");
-    strcat(forward_request_buf, new_uri);
-    strcat(forward_request_buf, " HTTP/1.0\r\n");
-    int host_name_hdr_flag = 0;
+// render the totals of every thread and close the connection
+int send_stats(int connfd, int format)
+{
+    char buf[STATS_RESPONSE_SIZE];
+
+    rio_writen(connfd, buf, stats_render(buf, sizeof(buf), format));
+    return 0;
+}
 
-    if ((n = rio_readlineb(client_request_rio, client_request_buf, MAXLINE)) < 0 ) {
-        printf("read from client error\n");
-        return ;
+/*
+* fetch_from_server - send request over a pooled keep-alive connection
+* and relay the response, framed by Content-Length or chunked encoding,
+* in RELAY_CHUNK_SIZE pieces through buf. the cacheable prefix goes to a
+* cache builder; once the response cannot be cached the rest of a known
+* length body is spliced. a pooled connection that turns out to be
+* stale is replaced by a fresh one once. the response head is held back
+* until it is complete and relayed without its hop-by-hop headers, with
+* a Connection header for keep_alive and the framing. when request
+* revalidates the stale cached object, a 304 refreshes the object and
+* the client gets the cached copy instead. a leading fetch lands
+* its flight as soon as followers can be answered: the stale object was
+* refreshed, or the response will not be cached. return 1 if the whole
+* response reached the client and carried its own length
+*/
+int fetch_from_server(int connfd, char* host_name, int port, struct iovec* request, int request_iovcnt, char* uri, int* leader, char* buf, s_buf_block* stale, int keep_alive, req_outcome* out)
+{
+    int fd, n, used, reused, tries, appended, len;
+    int complete = 0; // the whole response reached the client
+    int framed; // and it was delimited by Content-Length or chunks
+    int cacheable = 1;
+    int held = 1; // the head is kept in the builder until it is known
+    int not_modified = 0;
+    long left, moved, head_len;
+    long long start; // of the connect or of the wait for the first byte
+    resp_framer framer;
+    s_cache_builder builder;
+    s_cache_meta meta;
+    char resp[RESP_HEAD_SIZE]; // the head as the client gets it
+    struct iovec iov[2];
+
+    for (tries = 0; ; tries++) {
+        reused = tries == 0 && (fd = upstream_take(host_name, port)) >= 0;
+        if (!reused) {
+            start = stats_now();
+            if ((fd = upstream_connect(host_name, port)) < 0) {
+                stats_add(STAT_UPSTREAM_ERRORS, 1);
+                return 0;
+            }
+            stats_time(STAGE_CONNECT, stats_now() - start);
+        }
+        if (rio_writev(fd, request, request_iovcnt) >= 0) {
+            start = stats_now();
+            while ((n = read(fd, buf, RELAY_CHUNK_SIZE)) < 0 && errno == EINTR)
+                ;
+            if (n > 0) {
+                stats_time(STAGE_TTFB, stats_now() - start);
+                break;
+            }
+        }
+        close(fd);
+        if (!reused) {
+            stats_add(STAT_UPSTREAM_ERRORS, 1);
+            return 0;
+        }
     }
-    while(strcmp(client_request_buf, "\r\n")) {
-        get_header_name(client_request_buf, header_name);
-        if (!be_ignore_header(header_name)) {
-            if (!strcmp("Host",header_name)) {
-                host_name_hdr_flag = 1;
+
+    out->result = "MISS";
+    init_resp_framer(&framer);
+    init_cache_builder(&builder);
+    while (1) {
+        used = feed_resp_framer(&framer, buf, n);
+        if (used < n) {
+            framer.keep_alive = 0; // bytes past the response, do not trust it
+        }
+        appended = 0;
+        if (held) {
+            if (!append_to_cache_builder(&builder, buf, used)) {
+                break; // an absurdly long head
             }
-            strcat(forward_request_buf, client_request_buf);
+            appended = 1;
+            if (framer.state != RESP_HEAD) {
+                held = 0;
+                if (stale != NULL && framer.status == 304) {
+                    not_modified = 1;
+                    complete = framer.state == RESP_DONE;
+                    break;
+                }
+                // the object changed or was never cached, relay the new response
+                if ((head_len = resp_strip_head(&builder, &framer)) < 0) {
+                    break; // too long to relay
+                }
+                len = resp_connection_head(builder.pblock->buf, head_len,
+                    keep_alive && resp_is_framed(&framer), resp, sizeof(resp));
+                iov[0].iov_base = resp;
+                iov[0].iov_len = len;
+                iov[1].iov_base = builder.pblock->buf + head_len;
+                iov[1].iov_len = builder.pblock->valid_buf_size - head_len;
+                if (rio_writev(connfd, iov, 2) < 0) {
+                    break;
+                }
+                len += iov[1].iov_len;
+                stats_add(STAT_BYTES_RELAYED, len);
+                out->bytes += len;
+            }
+        } else if (rio_writen(connfd, buf, used) < 0) {
+            break; // client went away
+        } else {
+            stats_add(STAT_BYTES_RELAYED, used);
+            out->bytes += used;
         }
-        if ((n = rio_readlineb(client_request_rio, client_request_buf, MAXLINE)) < 0 ) {
-            printf("read from client error\n");
-            return;
+        if (cacheable && ((framer.state != RESP_HEAD && !resp_is_cacheable(&framer))
+                || (!appended && !append_to_cache_builder(&builder, buf, used)))) {
+            free_cache_builder(&builder);
+            cacheable = 0;
+            land_early(uri, leader);
         }
+        if (framer.state == RESP_DONE) {
+            complete = 1;
+            break;
+        }
+        // never cached, so move the rest of the body, or of the current
+        // chunk, without copying it through user space
+        if (!cacheable && (left = resp_body_left(&framer)) != 0) {
+            moved = splice_relay(fd, connfd, left);
+            if (moved > 0) {
+                stats_add(STAT_BYTES_RELAYED, moved);
+                out->bytes += moved;
+            }
+            if (left < 0) {
+                complete = moved >= 0;
+                break;
+            }
+            if (moved != left) {
+                break;
+            }
+            resp_body_moved(&framer, moved);
+            if (framer.state == RESP_DONE) {
+                complete = 1;
+                break;
+            }
+            // a chunked body goes on with the line that closes the chunk
+        }
+        while ((n = read(fd, buf, RELAY_CHUNK_SIZE)) < 0 && errno == EINTR)
+            ;
+        if (n <= 0) {
+            // only an unframed body may end with the connection
+            complete = n == 0 && framer.state == RESP_UNTIL_CLOSE;
+            break;
+        }
+    }
+    if (not_modified) {
+        free_cache_builder(&builder);
+        resp_cache_meta(&framer, &meta);
+        refresh_cache_block(stale, meta.expires);
+        land_early(uri, leader);
+        upstream_release(host_name, port, fd, complete && framer.keep_alive);
+        log_debug("revalidated: %s", uri);
+        stats_add(STAT_REVALIDATED, 1);
+        out->result = "REVAL";
+        keep_alive = keep_alive && stale->framed;
+        if ((len = send_object(connfd, stale, keep_alive)) < 0) {
+            return 0;
+        }
+        stats_add(STAT_BYTES_CACHED, len);
+        out->status = 200;
+        out->bytes = len;
+        return keep_alive;
     }
-    if (!host_name_hdr_flag) {
-        strcat(forward_request_buf, "Host: ");
-        strcat(forward_request_buf, host_name);
-        strcat(forward_request_buf, "\r\n");
+    if (out->bytes > 0) {
+        out->status = framer.status;
+    }
+    // cache only complete responses that stayed within MAX_OBJECT_SIZE
+    framed = complete && resp_is_framed(&framer);
+    if (complete && cacheable && (!framer.chunked || resp_dechunk(&builder))) {
+        resp_cache_meta(&framer, &meta);
+        commit_cache_builder(&builder, uri, framed, &meta, &cache);
+    } else {
+        free_cache_builder(&builder);
+    }
+    upstream_release(host_name, port, fd,
+        complete && framer.keep_alive && framer.state == RESP_DONE);
+    return framed;
+}
+
+void land_early(char* uri, int* leader)
+{
+    if (*leader) {
+        flight_land(uri);
+        *leader = 0;
     }
-    strcat(forward_request_buf, user_agent_hdr);
-    strcat(forward_request_buf, accept_hdr);
-    strcat(forward_request_buf, accept_encoding_hdr);
-    strcat(forward_request_buf, connection_hdr);
-    strcat(forward_request_buf, proxy_connection_hdr);
-    strcat(forward_request_buf, "\r\n");
 }
@@ -0,0 +1,14 @@
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "csapp.h"
+#include "mycache.h"
+
+// target server port
+#define SERVER_PORT 80 // default port of server
+#define RELAY_CHUNK_SIZE MAXBUF // bytes relayed per read from the server
+
+// the object cache shared by every serving mode
+extern s_cache cache;
+
+#endif /* __PROXY_H__ */
@@ -0,0 +1,164 @@
+/*
+* range.c - 206 and 416 responses built from cached objects
+*
+* the cached response is kept whole, head and body, so a range is one
+* walk over the head lines: the status line turns into 206, Content-Length
+* is replaced by the length of the slice plus a Content-Range, the
+* validators are noted for If-Range and every other header is copied.
+* the body bytes are then sent straight from the cached copy
+*/
+#define _GNU_SOURCE
+#include "csapp.h"
+#include "request.h"
+#include "range.h"
+
+static int parse_range(const char *spec, int len, long length, long *first, long *last);
+static const char *parse_number(const char *p, const char *end, long *value);
+static int line_is(const char *line, int len, const char *name);
+static const char *line_value(const char *line, const char *eol, int *len);
+
+int range_reply_for(const char *req, req_span range, req_span if_range,
+                    const char *resp, int resp_len, long total, int keep_alive,
+                    range_reply *reply)
+{
+    const char *connection = keep_alive ? "keep-alive" : "close";
+    const char *end, *p, *eol, *sp, *value;
+    const char *etag = NULL, *modified = NULL;
+    int head_len, version_len, len, etag_len = 0, modified_len = 0, rc, n;
+    long length, first = 0, last = 0;
+
+    // the whole head must be at hand, and the object a plain 200
+    if (range.len < 0 || (end = memmem(resp, resp_len, "\r\n\r\n", 4)) == NULL)
+        return 0;
+    head_len = end + 4 - resp;
+    length = total - head_len;
+    if ((sp = memchr(resp, ' ', head_len)) == NULL || strncmp(sp, " 200", 4))
+        return 0;
+    version_len = sp - resp;
+    if ((rc = parse_range(req + range.off, range.len, length, &first, &last)) < 0)
+        return 0;
+
+    n = snprintf(reply->head, RANGE_HEAD_SIZE, "%.*s 206 Partial Content\r\n", version_len, resp);
+    eol = memchr(resp, '\n', head_len);
+    for (p = eol + 1; p < end + 2; p = eol + 1) {
+        eol = memchr(p, '\n', end + 2 - p);
+        len = eol + 1 - p;
+        if (line_is(p, len, "Transfer-Encoding"))
+            return 0; // a chunked body is not the bytes the range counts
+        if (line_is(p, len, "Content-Length") || line_is(p, len, "Content-Range"))
+            continue;
+        if (line_is(p, len, "ETag"))
+            etag = line_value(p, eol, &etag_len);
+        else if (line_is(p, len, "Last-Modified"))
+            modified = line_value(p, eol, &modified_len);
+        if (n + len + 128 > RANGE_HEAD_SIZE)
+            return 0; // leaves room for the three headers below
+        memcpy(reply->head + n, p, len);
+        n += len;
+    }
+
+    // If-Range names the copy the client holds, a range of another one is useless
+    if (if_range.len >= 0) {
+        if (if_range.len >= 1 && req[if_range.off] == '"') {
+            value = etag;
+            len = etag_len;
+        } else {
+            value = modified;
+            len = modified_len;
+        }
+        if (value == NULL || len != if_range.len || strncmp(value, req + if_range.off, len))
+            return 0;
+    }
+
+    if (rc == 0) {
+        reply->status = 416;
+        reply->head_len = snprintf(reply->head, RANGE_HEAD_SIZE,
+                                   "%.*s 416 Range Not Satisfiable\r\n"
+                                   "Content-Range: bytes */%ld\r\n"
+                                   "Content-Length: 0\r\n"
+                                   "Connection: %s\r\n\r\n", version_len, resp, length,
+                                   connection);
+        reply->body_off = head_len;
+        reply->body_len = 0;
+        return 1;
+    }
+    n += snprintf(reply->head + n, RANGE_HEAD_SIZE - n,
+                  "Content-Range: bytes %ld-%ld/%ld\r\n"
+                  "Content-Length: %ld\r\n"
+                  "Connection: %s\r\n\r\n", first, last, length, last - first + 1,
+                  connection);
+    reply->status = 206;
+    reply->head_len = n;
+    reply->body_off = head_len + first;
+    reply->body_len = last - first + 1;
+    return 1;
+}
+
+/*
+* parse_range - parse spec, a single bytes=first-last, bytes=first- or
+* bytes=-suffix, for a body of length bytes. return 1 with the inclusive
+* *first and *last, 0 if it lies past the end and -1 if the header is to
+* be ignored: malformed, another unit or several ranges
+*/
+static int parse_range(const char *spec, int len, long length, long *first, long *last)
+{
+    const char *p = spec + 6, *end = spec + len;
+    long a, b;
+
+    if (len < 6 || strncasecmp(spec, "bytes=", 6) || memchr(p, ',', end - p) != NULL)
+        return -1;
+    while (p < end && *p == ' ')
+        p++;
+    p = parse_number(p, end, &a);
+    if (p == end || *p != '-')
+        return -1;
+    p = parse_number(p + 1, end, &b);
+    while (p < end && *p == ' ')
+        p++;
+    if (p != end || (a < 0 && b < 0) || (b >= 0 && a > b))
+        return -1;
+    if (a < 0) { // the last b bytes
+        if (b == 0 || length == 0)
+            return 0;
+        *first = b < length ? length - b : 0;
+        *last = length - 1;
+        return 1;
+    }
+    if (a >= length)
+        return 0;
+    *first = a;
+    *last = b >= 0 && b < length ? b : length - 1;
+    return 1;
+}
+
+// read the digits at p into *value, -1 if there are none; return where they end
+static const char *parse_number(const char *p, const char *end, long *value)
+{
+    *value = -1;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        if (*value < LONG_MAX / 10) // an absurd position stays past any end
+            *value = (*value < 0 ? 0 : *value * 10) + (*p - '0');
+    }
+    return p;
+}
+
+// the header line of len bytes is called name
+static int line_is(const char *line, int len, const char *name)
+{
+    int n = strlen(name);
+
+    return len > n && line[n] == ':' && !strncasecmp(line, name, n);
+}
+
+// the value of a header line ending at eol, without blanks or CRLF
+static const char *line_value(const char *line, const char *eol, int *len)
+{
+    const char *p = memchr(line, ':', eol - line) + 1;
+
+    while (p < eol && (*p == ' ' || *p == '\t'))
+        p++;
+    while (eol > p && (eol[-1] == '\r' || eol[-1] == '\n' || eol[-1] == ' '))
+        eol--;
+    *len = eol - p;
+    return p;
+}
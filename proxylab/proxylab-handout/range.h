@@ -0,0 +1,40 @@
+#ifndef __RANGE_H__
+#define __RANGE_H__
+
+#include "csapp.h"
+#include "request.h"
+
+/*
+* range.h - partial responses from cached objects. a GET with a single
+* byte range is answered from the full cached response with a 206 that
+* carries the cached headers and the slice of the body, or a 416 if the
+* range lies past its end. multiple ranges, a failed If-Range and
+* chunked bodies fall back to the whole object, which a client must
+* accept in place of a 206. the cached head carries no Connection header,
+* the reply gets one for the decision of the proxy
+*/
+
+#define RANGE_HEAD_SIZE MAXBUF // longest cached head a partial response is built from
+
+/* $begin rangereply */
+typedef struct {
+    char head[RANGE_HEAD_SIZE]; // head of the 206 or 416 response
+    int head_len;
+    int status;
+    long body_off; // of the first body byte to send, in the cached response
+    long body_len; // body bytes to send after head
+} range_reply;
+/* $end rangereply */
+
+/*
+* range_reply_for - answer the Range and If-Range headers of the request
+* in req, spans of len -1 if absent, from a cached 200 response of total
+* bytes whose first resp_len bytes are in resp, on a connection kept open
+* after it if keep_alive. return 1 with reply filled in, or 0 if the
+* whole response should be sent instead
+*/
+int range_reply_for(const char *req, req_span range, req_span if_range,
+                    const char *resp, int resp_len, long total, int keep_alive,
+                    range_reply *reply);
+
+#endif /* __RANGE_H__ */
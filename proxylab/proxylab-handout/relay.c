@@ -0,0 +1,126 @@
+/*
+* relay.c - zero-copy relay of uncacheable responses
+*
+* bytes go socket -> pipe -> socket with splice(), so the kernel moves
+* page references instead of copying the payload into the proxy and back
+* out again. every thread keeps one pipe for all of its requests, closed
+* when the thread exits so retired pool workers do not leak it
+*/
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include "csapp.h"
+#include "relay.h"
+
+static __thread int relay_pipe[2] = {-1, -1};
+static pthread_key_t pipe_key; // closes the pipe of an exiting thread
+static pthread_once_t pipe_once = PTHREAD_ONCE_INIT;
+
+static long copy_relay(int infd, int outfd, long len);
+static int open_pipe(void);
+static void make_pipe_key(void);
+static void close_pipe(void *arg);
+static void reset_pipe(void);
+
+/*
+* splice_relay - return the number of bytes moved, or -1 on an error on
+* either socket. falls back to copying when splice() is not supported
+* for these descriptors
+*/
+long splice_relay(int infd, int outfd, long len)
+{
+    long total = 0;
+    ssize_t in, out;
+    size_t want;
+
+    if (relay_pipe[0] < 0 && open_pipe() < 0)
+        return copy_relay(infd, outfd, len);
+
+    while (len < 0 || total < len) {
+        want = SPLICE_CHUNK_SIZE;
+        if (len >= 0 && len - total < (long)want)
+            want = len - total;
+        in = splice(infd, NULL, relay_pipe[1], NULL, want,
+                    SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in == 0)
+            break;
+        if (in < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EINVAL && total == 0)
+                return copy_relay(infd, outfd, len);
+            return -1;
+        }
+        while (in > 0) {
+            out = splice(relay_pipe[0], NULL, outfd, NULL, in,
+                         SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0 && errno == EINTR)
+                continue;
+            if (out <= 0) {
+                reset_pipe(); // bytes left in the pipe belong to this response
+                return -1;
+            }
+            in -= out;
+            total += out;
+        }
+    }
+    return total;
+}
+
+// plain read/write relay used when splice() is unavailable
+static long copy_relay(int infd, int outfd, long len)
+{
+    char buf[MAXBUF];
+    long total = 0;
+    ssize_t n;
+    size_t want;
+
+    while (len < 0 || total < len) {
+        want = MAXBUF;
+        if (len >= 0 && len - total < (long)want)
+            want = len - total;
+        if ((n = read(infd, buf, want)) == 0)
+            break;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (rio_writen(outfd, buf, n) < 0)
+            return -1;
+        total += n;
+    }
+    return total;
+}
+
+// create the pipe of this thread and have it closed at thread exit
+static int open_pipe(void)
+{
+    Pthread_once(&pipe_once, make_pipe_key);
+    if (pipe(relay_pipe) < 0)
+        return -1;
+    pthread_setspecific(pipe_key, relay_pipe);
+    return 0;
+}
+
+static void make_pipe_key(void)
+{
+    if (pthread_key_create(&pipe_key, close_pipe) != 0)
+        unix_error("pthread_key_create error");
+}
+
+// runs at thread exit while the pipe is open
+static void close_pipe(void *arg)
+{
+    int *fds = (int *)arg;
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void reset_pipe(void)
+{
+    pthread_setspecific(pipe_key, NULL);
+    close(relay_pipe[0]);
+    close(relay_pipe[1]);
+    relay_pipe[0] = relay_pipe[1] = -1;
+}
@@ -0,0 +1,14 @@
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+/*
+* relay.h - moving response bytes between sockets without a round trip
+* through user space, for responses that will never be cached
+*/
+
+#define SPLICE_CHUNK_SIZE 65536 // bytes moved per splice() call
+
+// move len bytes, or everything until EOF if len < 0, from infd to outfd
+long splice_relay(int infd, int outfd, long len);
+
+#endif /* __RELAY_H__ */
@@ -0,0 +1,186 @@
+/*
+* reqbench.c - request parsing microbenchmark. Parses a browser style
+*     request and builds the forward request, once with the single pass
+*     parser and writev pieces of request.c and once the way proxy.c
+*     used to (sscanf, a per header memset and strcat into one buffer).
+*     The head is padded with extra headers to show how both
+*     scale with the header count. First the worst case of the forward
+*     request is checked to fit FORWARD_IOV_MAX pieces.
+*
+* usage: reqbench [-i iterations] [-x max_extra_headers]
+*/
+#include "csapp.h"
+#include "request.h"
+
+static const char *browser_head =
+    "GET http://www.example.com:8080/static/js/app.3f2a9c.js?v=1712 HTTP/1.1\r\n"
+    "Host: www.example.com:8080\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Accept: */*\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Referer: http://www.example.com:8080/dashboard/overview\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+    "Cookie: session=7c1e0a4b9d2f4e6a8b3c5d7e9f1a2b3c; theme=dark; _ga=GA1.1.1234567890.1712345678\r\n"
+    "If-None-Match: W/\"5e1-18f2a7c3b90\"\r\n";
+
+/* the old path of proxy.c, kept here as the baseline */
+static void legacy_header_name(char *header, char *header_name)
+{
+    char *colon = strchr(header, ':');
+
+    memset(header_name, 0x0, MAXLINE);
+    if (colon != NULL)
+        memcpy(header_name, header, colon - header);
+}
+
+static int legacy_ignore(char *name)
+{
+    return !strcmp("User-Agent", name) || !strcmp("Accept", name)
+        || !strcmp("Accept-Encoding", name) || !strcmp("Connection", name)
+        || !strcmp("Proxy-Connection", name);
+}
+
+static int legacy_forward(char *head, char *out)
+{
+    char method[16], uri[MAXLINE], version[16], host[MAXLINE], line[MAXLINE];
+    char name[MAXLINE];
+    char *p = head, *eol, *path;
+    int has_host = 0;
+
+    if (sscanf(p, "%15s %8191s %15s", method, uri, version) != 3)
+        return -1;
+    path = strchr(uri + 7, '/');
+    strncpy(host, uri + 7, path - uri - 7);
+    host[path - uri - 7] = '\0';
+    memset(out, 0x0, MAXLINE);
+    strcat(out, "GET ");
+    strcat(out, path);
+    strcat(out, " HTTP/1.1\r\n");
+    for (p = strstr(p, "\r\n") + 2; strncmp(p, "\r\n", 2); p = eol + 2) {
+        eol = strstr(p, "\r\n");
+        memcpy(line, p, eol - p + 2);
+        line[eol - p + 2] = '\0';
+        legacy_header_name(line, name);
+        if (!legacy_ignore(name)) {
+            if (!strcmp("Host", name))
+                has_host = 1;
+            strcat(out, line);
+        }
+    }
+    if (!has_host) {
+        strcat(out, "Host: ");
+        strcat(out, host);
+        strcat(out, "\r\n");
+    }
+    strcat(out, "User-Agent: Mozilla/5.0\r\nAccept: */*\r\n\r\n");
+    return strlen(out);
+}
+
+static int gather_forward(char *head, int len)
+{
+    http_request r;
+    struct iovec iov[FORWARD_IOV_MAX];
+    int i, iovcnt, total = 0;
+
+    if (parse_http_request(&r, head, len) <= 0)
+        return -1;
+    iovcnt = forward_request_iov(&r, head, NULL, iov);
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    return total;
+}
+
+/*
+* the most pieces a client can get out of forward_request_iov: every
+* recorded header apart from its neighbours, a Host only past the
+* recorded ones and a stale block with both validators. the array has
+* guard slots that must stay untouched
+*/
+static int check_worst_case(void)
+{
+    static char head[REQ_HEAD_SIZE];
+    char block[sizeof(s_buf_block) + 64];
+    s_buf_block *stale = (s_buf_block *)block;
+    struct iovec iov[FORWARD_IOV_MAX + 4];
+    http_request r;
+    int i, len, iovcnt, ok;
+
+    memset(block, 0, sizeof(block));
+    stale->etag = "\"v1\"";
+    stale->last_modified = "Mon, 01 Jan 2024 00:00:00 GMT";
+    len = sprintf(head, "GET http://www.example.com/ HTTP/1.0\r\n");
+    for (i = 0; i < REQ_MAX_HEADERS; i++)
+        len += sprintf(head + len, "X-H%d: v\r\njunk line %d\r\n", i, i);
+    len += sprintf(head + len, "Host: www.example.com\r\nIf-None-Match: \"v0\"\r\n\r\n");
+    memset(iov, 0, sizeof(iov));
+    if (parse_http_request(&r, head, len) != len)
+        return 0;
+    iovcnt = forward_request_iov(&r, head, stale, iov);
+    ok = iovcnt == FORWARD_IOV_MAX && !r.has_host;
+    for (i = iovcnt; i < FORWARD_IOV_MAX + 4; i++)
+        ok = ok && iov[i].iov_base == NULL;
+    printf("worst case forward request: %d of %d pieces, %s\n", iovcnt, FORWARD_IOV_MAX,
+           ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void run(int extra, int iterations)
+{
+    static char head[REQ_HEAD_SIZE], out[REQ_HEAD_SIZE + MAXLINE];
+    volatile int sink = 0;
+    double start, legacy, gather;
+    int i, len;
+
+    len = sprintf(head, "%s", browser_head);
+    for (i = 0; i < extra; i++)
+        len += sprintf(head + len, "X-Extra-%d: tracking-%08d-value\r\n", i, i * 7919);
+    len += sprintf(head + len, "\r\n");
+
+    start = now_ns();
+    for (i = 0; i < iterations; i++)
+        sink += legacy_forward(head, out);
+    legacy = (now_ns() - start) / iterations;
+
+    start = now_ns();
+    for (i = 0; i < iterations; i++)
+        sink += gather_forward(head, len);
+    gather = (now_ns() - start) / iterations;
+
+    printf("%7d %7d %12.0f %12.0f %8.1fx\n", 15 + extra, len, legacy, gather, legacy / gather);
+}
+
+int main(int argc, char **argv)
+{
+    int c, extra, iterations = 100000, max_extra = 32;
+
+    while ((c = getopt(argc, argv, "i:x:")) != -1) {
+        switch (c) {
+        case 'i': iterations = atoi(optarg); break;
+        case 'x': max_extra = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-i iterations] [-x max_extra_headers]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (!check_worst_case())
+        exit(1);
+    printf("%7s %7s %12s %12s %9s\n", "headers", "bytes", "legacy ns", "gather ns", "speedup");
+    for (extra = 0; extra <= max_extra; extra = extra ? extra * 2 : 8)
+        run(extra, iterations);
+    return 0;
+}
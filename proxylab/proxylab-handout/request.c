@@ -0,0 +1,244 @@
+/*
+* request.c - single pass HTTP/1.x request head parser
+*
+* one walk over the bytes, line by line with memchr(), splits the
+* request line, the absolute uri and every header into spans of the
+* read buffer; nothing is copied and no header is scanned twice. the
+* headers the proxy cares about (Host, Connection, Proxy-Connection,
+* Range and the ones it replaces) are recognised as their line is split
+*/
+#define _GNU_SOURCE
+#include "csapp.h"
+#include "proxy.h"
+#include "request.h"
+
+/* You won't lose style points for including these long lines in your code */
+static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
+static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
+static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
+static const char *connection_hdr = "Connection: keep-alive\r\n";
+
+static int parse_uri(http_request *r, const char *buf);
+static void end_header(http_request *r, const char *buf, req_header *h);
+static int span_has(const char *buf, req_span s, const char *str);
+static struct iovec *iov_put(struct iovec *v, const void *base, size_t len);
+static struct iovec *iov_str(struct iovec *v, const char *str);
+
+int req_head_len(const char *buf, int n, int from)
+{
+    const char *p = buf + from, *end = buf + n;
+
+    // a newline ends the head if the line before it is empty, CR aside
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        if ((p - buf >= 1 && p[-1] == '\n') || (p - buf >= 2 && p[-1] == '\r' && p[-2] == '\n'))
+            return p + 1 - buf;
+        p++;
+    }
+    return 0;
+}
+
+int parse_http_request(http_request *r, const char *buf, int n)
+{
+    const char *p, *end = buf + n, *eol, *stop, *sp, *colon;
+    req_header h;
+
+    r->header_num = 0;
+    r->has_host = 0;
+    r->range = r->if_range = (req_span){0, -1};
+    // request line: method, uri and version separated by single blanks
+    if ((eol = memchr(buf, '\n', n)) == NULL)
+        return 0;
+    stop = eol > buf && eol[-1] == '\r' ? eol - 1 : eol;
+    if ((sp = memchr(buf, ' ', stop - buf)) == NULL)
+        return -1;
+    r->method = (req_span){0, sp - buf};
+    p = sp + 1;
+    if ((sp = memchr(p, ' ', stop - p)) == NULL)
+        return -1;
+    r->uri = (req_span){p - buf, sp - p};
+    r->version = (req_span){sp + 1 - buf, stop - sp - 1};
+    if (parse_uri(r, buf) < 0)
+        return -1;
+    // HTTP/1.1 clients are persistent unless they say otherwise
+    r->keep_alive = req_span_is(buf, r->version, "HTTP/1.1");
+
+    for (p = eol + 1; (eol = memchr(p, '\n', end - p)) != NULL; p = eol + 1) {
+        stop = eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+        if (stop == p)
+            return eol + 1 - buf; // the blank line
+        // a line without a colon is not a header and is dropped
+        if ((colon = memchr(p, ':', stop - p)) == NULL)
+            continue;
+        h.line = (req_span){p - buf, eol + 1 - p};
+        h.name = (req_span){p - buf, colon - p};
+        for (sp = colon + 1; sp < stop && (*sp == ' ' || *sp == '\t'); sp++)
+            ;
+        while (stop > sp && (stop[-1] == ' ' || stop[-1] == '\t'))
+            stop--;
+        h.value = (req_span){sp - buf, stop - sp};
+        end_header(r, buf, &h);
+    }
+    return 0;
+}
+
+// split an absolute http uri into host, port and path
+static int parse_uri(http_request *r, const char *buf)
+{
+    const char *uri = buf + r->uri.off;
+    int i = 7, port = 0;
+
+    if (r->uri.len < 7 || strncasecmp(uri, "http://", 7))
+        return -1;
+    r->host.off = r->uri.off + i;
+    while (i < r->uri.len && uri[i] != ':' && uri[i] != '/')
+        i++;
+    r->host.len = r->uri.off + i - r->host.off;
+    if (r->host.len == 0)
+        return -1;
+    r->port = SERVER_PORT;
+    if (i < r->uri.len && uri[i] == ':') {
+        while (++i < r->uri.len && uri[i] != '/') {
+            if (uri[i] < '0' || uri[i] > '9' || (port = port * 10 + uri[i] - '0') > 65535)
+                return -1;
+        }
+        if (port == 0)
+            return -1;
+        r->port = port;
+    }
+    r->path = (req_span){r->uri.off + i, r->uri.len - i};
+    return 0;
+}
+
+// note what a complete header means to the proxy and record it
+static void end_header(http_request *r, const char *buf, req_header *h)
+{
+    if (req_span_is(buf, h->name, "Host")) {
+        // a Host past the recorded headers is dropped, the proxy sends its own
+        r->has_host |= r->header_num < REQ_MAX_HEADERS;
+    } else if (req_span_is(buf, h->name, "Connection")
+               || req_span_is(buf, h->name, "Proxy-Connection")) {
+        // hop-by-hop headers from the client decide its own connection
+        if (span_has(buf, h->value, "close"))
+            r->keep_alive = 0;
+        else if (span_has(buf, h->value, "keep-alive"))
+            r->keep_alive = 1;
+    } else if (req_span_is(buf, h->name, "Range")) {
+        r->range = h->value; // forwarded as is, and served from the cache on a hit
+    } else if (req_span_is(buf, h->name, "If-Range")) {
+        r->if_range = h->value;
+    }
+    h->ignored = be_ignore_header(buf + h->name.off, h->name.len);
+    if (r->header_num < REQ_MAX_HEADERS)
+        r->header[r->header_num++] = *h;
+}
+
+int req_span_is(const char *buf, req_span s, const char *str)
+{
+    return (int)strlen(str) == s.len && !strncasecmp(buf + s.off, str, s.len);
+}
+
+// the span contains str, ignoring case
+static int span_has(const char *buf, req_span s, const char *str)
+{
+    int i, len = strlen(str);
+
+    for (i = 0; i + len <= s.len; i++) {
+        if (!strncasecmp(buf + s.off + i, str, len))
+            return 1;
+    }
+    return 0;
+}
+
+char *req_span_str(const char *buf, req_span s, char *dst, int size)
+{
+    int len = s.len < size - 1 ? s.len : size - 1;
+
+    memcpy(dst, buf + s.off, len);
+    dst[len] = '\0';
+    return dst;
+}
+
+int be_ignore_header(const char *name, int len)
+{
+    static const char *ignored[] = {
+        "User-Agent", "Accept", "Accept-Encoding", "Connection",
+        "Proxy-Connection", "Keep-Alive", "TE", "Upgrade",
+        // a revalidation sends the validators of the cached copy instead
+        "If-None-Match", "If-Modified-Since", NULL
+    };
+    int i;
+
+    for (i = 0; ignored[i] != NULL; i++) {
+        if ((int)strlen(ignored[i]) == len && !strncasecmp(ignored[i], name, len))
+            return 1;
+    }
+    return 0;
+}
+
+static struct iovec *iov_put(struct iovec *v, const void *base, size_t len)
+{
+    v->iov_base = (void *)base;
+    v->iov_len = len;
+    return v + 1;
+}
+
+static struct iovec *iov_str(struct iovec *v, const char *str)
+{
+    return iov_put(v, str, strlen(str));
+}
+
+/*
+* forward_request_iov - the request line with the uri path, the client
+* headers the proxy passes on, a Host header if the client sent none,
+* the fixed proxy headers and the validators of stale. neighbouring
+* client headers are contiguous in buf and share one piece. iov holds
+* FORWARD_IOV_MAX pieces, what the worst case needs
+*/
+int forward_request_iov(http_request *r, char *buf, s_buf_block *stale, struct iovec *iov)
+{
+    struct iovec *v = iov;
+    int i, next_off = -1; // where the last piece taken from buf ends
+
+    v = iov_str(v, "GET ");
+    if (r->path.len > 0)
+        v = iov_put(v, buf + r->path.off, r->path.len);
+    else
+        v = iov_str(v, "/");
+    // a 1.0 client gets a 1.0 response, which is never chunked
+    if (req_span_is(buf, r->version, "HTTP/1.0"))
+        v = iov_str(v, " HTTP/1.0\r\n");
+    else
+        v = iov_str(v, " HTTP/1.1\r\n");
+    for (i = 0; i < r->header_num; i++) {
+        req_header *h = &r->header[i];
+
+        if (h->ignored)
+            continue;
+        if (h->line.off == next_off)
+            v[-1].iov_len += h->line.len;
+        else
+            v = iov_put(v, buf + h->line.off, h->line.len);
+        next_off = h->line.off + h->line.len;
+    }
+    if (!r->has_host) {
+        v = iov_str(v, "Host: ");
+        v = iov_put(v, buf + r->host.off, r->host.len);
+        v = iov_str(v, "\r\n");
+    }
+    v = iov_str(v, user_agent_hdr);
+    v = iov_str(v, accept_hdr);
+    v = iov_str(v, accept_encoding_hdr);
+    v = iov_str(v, connection_hdr);
+    if (stale != NULL && stale->etag != NULL) {
+        v = iov_str(v, "If-None-Match: ");
+        v = iov_str(v, stale->etag);
+        v = iov_str(v, "\r\n");
+    }
+    if (stale != NULL && stale->last_modified != NULL) {
+        v = iov_str(v, "If-Modified-Since: ");
+        v = iov_str(v, stale->last_modified);
+        v = iov_str(v, "\r\n");
+    }
+    v = iov_str(v, "\r\n");
+    return v - iov;
+}
@@ -0,0 +1,69 @@
+#ifndef __REQUEST_H__
+#define __REQUEST_H__
+
+#include "csapp.h"
+#include "mycache.h"
+
+/*
+* request.h - single pass parsing of client request heads. the parser
+* only records where each part lies in the read buffer, and the request
+* forwarded to the server is gathered from those pieces with writev()
+* instead of being copied together
+*/
+
+#define REQ_HEAD_SIZE (2 * MAXLINE) // longest request head accepted
+#define REQ_MAX_HEADERS 64 // headers recorded, later ones are dropped
+/*
+* pieces of a forward request at worst: the request line, one per
+* recorded header, a Host of its own, the fixed headers, the two
+* validators of a stale block and the blank line
+*/
+#define FORWARD_IOV_MAX (3 + REQ_MAX_HEADERS + 3 + 4 + 6 + 1)
+
+// bytes [off, off + len) of the request buffer
+typedef struct {
+    int off;
+    int len;
+} req_span;
+
+typedef struct {
+    req_span line; // whole line including CRLF
+    req_span name;
+    req_span value; // without surrounding blanks
+    int ignored; // replaced by a header of the proxy
+} req_header;
+
+typedef struct {
+    req_span method;
+    req_span uri; // absolute uri, the cache key
+    req_span version;
+    req_span host; // parts of the uri
+    req_span path; // empty if the uri names no path
+    int port;
+    int keep_alive; // the client wants the connection kept open
+    int has_host; // a recorded header of the client is Host
+    req_span range; // values of Range and If-Range, len -1 if absent
+    req_span if_range;
+    int header_num;
+    req_header header[REQ_MAX_HEADERS];
+} http_request;
+
+/*
+* the length of the request head in buf[0..n), up to the first blank line
+* after the request line, or 0 if it is not complete. bytes before from
+* were already scanned by an earlier call. both serving modes end a head
+* here and accept at most REQ_HEAD_SIZE bytes of it
+*/
+int req_head_len(const char *buf, int n, int from);
+// parse the head in buf[0..n), return its length, 0 if incomplete, -1 if malformed
+int parse_http_request(http_request *r, const char *buf, int n);
+// the span of buf equals str, ignoring case
+int req_span_is(const char *buf, req_span s, const char *str);
+// copy span of buf into dst of size bytes as a string, truncated if needed
+char *req_span_str(const char *buf, req_span s, char *dst, int size);
+// hop-by-hop and fixed headers are replaced by the proxy's own
+int be_ignore_header(const char *name, int len);
+// gather the request forwarded for r into iov, revalidating stale if not NULL
+int forward_request_iov(http_request *r, char *buf, s_buf_block *stale, struct iovec *iov);
+
+#endif /* __REQUEST_H__ */
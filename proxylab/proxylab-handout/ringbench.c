@@ -0,0 +1,149 @@
+/*
+* ringbench.c - stress test and throughput benchmark of the connection
+*     hand-off rings. the stress run pushes producer-tagged sequence
+*     numbers through a tiny lfsbuf_t so producers and consumers keep
+*     hitting the full and empty cases, and checks that every item comes
+*     out exactly once and in per-producer order. the benchmark then moves
+*     items through sbuf_t and lfsbuf_t with the same thread mix
+*
+* usage: ringbench [-p producers] [-c consumers] [-i items] [-n slots]
+*/
+#include "csapp.h"
+#include "sbuf.h"
+#include "lfsbuf.h"
+
+#define STRESS_SLOTS 4
+#define ITEM_BITS 24 // low bits of an item are the sequence number
+
+static int producers = 2;
+static int consumers = 2;
+static int items = 1 << 20; // per producer, fits ITEM_BITS
+static int slots = 16;
+static int use_lf; // which ring the threads below drive
+static sbuf_t sbuf;
+static lfsbuf_t lfsbuf;
+static unsigned char *seen; // stress: times each item came out
+static volatile int errors;
+
+static void insert(int item)
+{
+    if (use_lf)
+        lfsbuf_insert(&lfsbuf, item);
+    else
+        sbuf_insert(&sbuf, item);
+}
+
+static int remove_item(void)
+{
+    return use_lf ? lfsbuf_remove(&lfsbuf) : sbuf_remove(&sbuf);
+}
+
+static void *producer_thread(void *vargp)
+{
+    int id = (int)(long)vargp, i;
+
+    for (i = 0; i < items; i++)
+        insert(id << ITEM_BITS | i);
+    return NULL;
+}
+
+static void *consumer_thread(void *vargp)
+{
+    int check = (int)(long)vargp;
+    int last[producers], item, id, seq, i;
+
+    for (i = 0; i < producers; i++)
+        last[i] = -1;
+    while ((item = remove_item()) >= 0) {
+        if (!check)
+            continue;
+        id = item >> ITEM_BITS;
+        seq = item & ((1 << ITEM_BITS) - 1);
+        if (seq <= last[id] || __sync_add_and_fetch(&seen[(long)id * items + seq], 1) != 1)
+            __sync_add_and_fetch(&errors, 1);
+        last[id] = seq;
+    }
+    return NULL;
+}
+
+// move producers * items through the ring, return the elapsed seconds
+static double run(int check)
+{
+    pthread_t ptid[producers], ctid[consumers];
+    struct timeval start, end;
+    int i;
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < consumers; i++)
+        Pthread_create(&ctid[i], NULL, consumer_thread, (void *)(long)check);
+    for (i = 0; i < producers; i++)
+        Pthread_create(&ptid[i], NULL, producer_thread, (void *)(long)i);
+    for (i = 0; i < producers; i++)
+        Pthread_join(ptid[i], NULL);
+    for (i = 0; i < consumers; i++)
+        insert(-1); // one stop marker per consumer
+    for (i = 0; i < consumers; i++)
+        Pthread_join(ctid[i], NULL);
+    gettimeofday(&end, NULL);
+    return (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+}
+
+static int stress(void)
+{
+    long i, total = (long)producers * items;
+
+    seen = Calloc(total, 1);
+    use_lf = 1;
+    lfsbuf_init(&lfsbuf, STRESS_SLOTS);
+    run(1);
+    lfsbuf_deinit(&lfsbuf);
+    for (i = 0; i < total; i++) {
+        if (seen[i] != 1)
+            errors++;
+    }
+    Free(seen);
+    printf("stress %s: %ld items through %d slots, %d errors\n",
+           errors ? "FAILED" : "ok", total, STRESS_SLOTS, errors);
+    return errors == 0;
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+    double secs;
+
+    while ((c = getopt(argc, argv, "p:c:i:n:")) != -1) {
+        switch (c) {
+        case 'p': producers = atoi(optarg); break;
+        case 'c': consumers = atoi(optarg); break;
+        case 'i': items = atoi(optarg); break;
+        case 'n': slots = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-p producers] [-c consumers] "
+                    "[-i items] [-n slots]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (items >= 1 << ITEM_BITS || producers >= 1 << (31 - ITEM_BITS)) {
+        fprintf(stderr, "too many items or producers\n");
+        exit(1);
+    }
+
+    printf("producers=%d consumers=%d items/producer=%d slots=%d\n",
+           producers, consumers, items, slots);
+    if (!stress())
+        exit(1);
+
+    printf("%-8s %14s\n", "ring", "items/s");
+    use_lf = 0;
+    sbuf_init(&sbuf, slots);
+    secs = run(0);
+    sbuf_deinit(&sbuf);
+    printf("%-8s %14.0f\n", "sbuf", (double)producers * items / secs);
+    use_lf = 1;
+    lfsbuf_init(&lfsbuf, slots);
+    secs = run(0);
+    lfsbuf_deinit(&lfsbuf);
+    printf("%-8s %14.0f\n", "lfsbuf", (double)producers * items / secs);
+    return 0;
+}
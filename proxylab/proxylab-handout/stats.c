@@ -0,0 +1,272 @@
+/*
+* stats.c - per-thread counters and latency histograms
+*
+* a thread takes a block on its first update: one a finished thread left
+* behind, so its counts carry on, or a new one pushed onto the list with
+* a CAS. after that every update is a load and a store to memory only
+* this thread writes, no lock and no atomic read-modify-write. the
+* endpoint walks the list and sums the blocks with relaxed loads, so a
+* total may miss updates made while it reads, never tear one. the
+* histograms bucket by power of two, each split into STATS_HALF linear
+* steps like an HDR histogram
+*/
+#define _GNU_SOURCE
+#include <sys/resource.h>
+#include "csapp.h"
+#include "stats.h"
+#include "log.h"
+#include "accesslog.h"
+
+#define BUMP(x, n) __atomic_store_n(&(x), (x) + (n), __ATOMIC_RELAXED)
+#define PEEK(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+typedef struct stats_block {
+    long long counter[STAT_NUM];
+    long long count[STAGE_NUM][STATS_BUCKETS];
+    long long sum[STAGE_NUM]; // ns, for the mean
+    long long max[STAGE_NUM];
+    volatile int owned; // a live thread updates this block
+    struct stats_block *next;
+} stats_block;
+
+// one stage summed over every block
+typedef struct {
+    long long count[STATS_BUCKETS];
+    long long total, sum, max;
+} stage_total;
+
+static stats_block *blocks; // every block ever made, newest first
+static __thread stats_block *self;
+static pthread_key_t owner_key; // gives self back when its thread exits
+static long long *accept_ns; // accept time of every open fd below accept_max
+static int accept_max;
+static time_t started;
+
+static const char *counter_name[STAT_NUM] = {
+    "connections", "requests", "hits", "disk_hits", "misses", "coalesced",
+    "revalidated", "partial", "upstream_errors", "bytes_relayed", "bytes_cached"
+};
+static const char *stage_name[STAGE_NUM] = {
+    "queue", "parse", "lookup", "connect", "ttfb"
+};
+
+static stats_block *my_block(void);
+static void disown(void *arg);
+static int bucket_of(long long v);
+static long long bucket_value(int i);
+static long long percentile(stage_total *t, double p);
+static int render_text(char *buf, int size, long long *counter, stage_total *stage);
+static int render_json(char *buf, int size, long long *counter, stage_total *stage);
+
+void init_stats(void)
+{
+    struct rlimit rl;
+
+    started = time(NULL);
+    if (pthread_key_create(&owner_key, disown) != 0)
+        unix_error("pthread_key_create error");
+    // queue times are kept for the fds the process may open
+    accept_max = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+        && rl.rlim_cur < (1 << 20) ? (int)rl.rlim_cur : 1 << 20;
+    accept_ns = Calloc(accept_max, sizeof(long long));
+}
+
+long long stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void stats_add(stats_counter which, long long n)
+{
+    stats_block *b = my_block();
+
+    BUMP(b->counter[which], n);
+}
+
+void stats_time(stats_stage stage, long long ns)
+{
+    stats_block *b = my_block();
+
+    if (ns < 0)
+        ns = 0;
+    BUMP(b->count[stage][bucket_of(ns)], 1);
+    BUMP(b->sum[stage], ns);
+    if (ns > b->max[stage])
+        __atomic_store_n(&b->max[stage], ns, __ATOMIC_RELAXED);
+}
+
+void stats_accepted(int fd)
+{
+    if (fd >= 0 && fd < accept_max)
+        accept_ns[fd] = stats_now(); // the pool's locks order it before the worker
+    stats_add(STAT_CONNECTIONS, 1);
+}
+
+void stats_dequeued(int fd)
+{
+    if (fd >= 0 && fd < accept_max)
+        stats_time(STAGE_QUEUE, stats_now() - accept_ns[fd]);
+}
+
+int stats_request(const char *head, int len)
+{
+    int n = strlen("GET " STATS_PATH);
+    const char *eol;
+
+    if (len <= n || strncmp(head, "GET " STATS_PATH, n)
+        || (head[n] != ' ' && head[n] != '?'))
+        return 0;
+    if (head[n] == '?' && (eol = memchr(head, '\n', len)) != NULL
+        && memmem(head + n, eol - head - n, "format=json", 11) != NULL)
+        return STATS_JSON;
+    return STATS_TEXT;
+}
+
+int stats_render(char *buf, int size, int format)
+{
+    long long counter[STAT_NUM] = {0};
+    stage_total stage[STAGE_NUM];
+    char body[STATS_RESPONSE_SIZE];
+    stats_block *b;
+    long long v;
+    int i, j, n;
+
+    memset(stage, 0, sizeof(stage));
+    for (b = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); b != NULL; b = b->next) {
+        for (i = 0; i < STAT_NUM; i++)
+            counter[i] += PEEK(b->counter[i]);
+        for (i = 0; i < STAGE_NUM; i++) {
+            for (j = 0; j < STATS_BUCKETS; j++) {
+                v = PEEK(b->count[i][j]);
+                stage[i].count[j] += v;
+                stage[i].total += v;
+            }
+            stage[i].sum += PEEK(b->sum[i]);
+            if (PEEK(b->max[i]) > stage[i].max)
+                stage[i].max = PEEK(b->max[i]);
+        }
+    }
+    if (format == STATS_JSON)
+        n = render_json(body, sizeof(body), counter, stage);
+    else
+        n = render_text(body, sizeof(body), counter, stage);
+    n = snprintf(buf, size, "HTTP/1.1 200 OK\r\n"
+                 "Content-Type: %s\r\n"
+                 "Content-Length: %d\r\n"
+                 "Cache-Control: no-store\r\n"
+                 "Connection: close\r\n\r\n%s",
+                 format == STATS_JSON ? "application/json" : "text/plain", n, body);
+    return n < size ? n : size - 1;
+}
+
+// the block of the calling thread, taken on its first update
+static stats_block *my_block(void)
+{
+    stats_block *b;
+
+    if (self != NULL)
+        return self;
+    for (b = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); b != NULL; b = b->next)
+        if (!b->owned && __sync_bool_compare_and_swap(&b->owned, 0, 1))
+            break;
+    if (b == NULL) {
+        b = Calloc(1, sizeof(stats_block));
+        b->owned = 1;
+        do {
+            b->next = blocks;
+        } while (!__sync_bool_compare_and_swap(&blocks, b->next, b));
+    }
+    pthread_setspecific(owner_key, b);
+    return self = b;
+}
+
+// a retiring worker leaves its counts for the next thread to continue
+static void disown(void *arg)
+{
+    __atomic_store_n(&((stats_block *)arg)->owned, 0, __ATOMIC_RELEASE);
+}
+
+static int bucket_of(long long v)
+{
+    int shift;
+
+    if (v < STATS_SUB)
+        return v;
+    shift = 63 - __builtin_clzll(v) - (STATS_SUB_BITS - 1);
+    return STATS_SUB + (shift - 1) * STATS_HALF + (int)(v >> shift) - STATS_HALF;
+}
+
+// highest value that falls in bucket i
+static long long bucket_value(int i)
+{
+    int shift;
+
+    if (i < STATS_SUB)
+        return i;
+    shift = (i - STATS_SUB) / STATS_HALF + 1;
+    return ((long long)((i - STATS_SUB) % STATS_HALF + STATS_HALF + 1) << shift) - 1;
+}
+
+static long long percentile(stage_total *t, double p)
+{
+    long long seen = 0, want = (long long)(p * t->total + 0.999999);
+    int i;
+
+    if (t->total == 0)
+        return 0;
+    if (want < 1)
+        want = 1;
+    for (i = 0; i < STATS_BUCKETS; i++)
+        if ((seen += t->count[i]) >= want)
+            return bucket_value(i) < t->max ? bucket_value(i) : t->max;
+    return t->max;
+}
+
+static int render_text(char *buf, int size, long long *counter, stage_total *stage)
+{
+    int i, n;
+
+    n = snprintf(buf, size, "uptime_secs %ld\n", (long)(time(NULL) - started));
+    for (i = 0; i < STAT_NUM; i++)
+        n += snprintf(buf + n, size - n, "%s %lld\n", counter_name[i], counter[i]);
+    n += snprintf(buf + n, size - n, "log_dropped %lld\n", log_dropped());
+    n += snprintf(buf + n, size - n, "access_dropped %lld\n\n", access_log_dropped());
+    n += snprintf(buf + n, size - n, "%-8s %10s %10s %10s %10s %10s %10s %10s\n", "stage",
+                  "count", "mean_us", "p50_us", "p90_us", "p99_us", "p999_us", "max_us");
+    for (i = 0; i < STAGE_NUM; i++)
+        n += snprintf(buf + n, size - n,
+                      "%-8s %10lld %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                      stage_name[i], stage[i].total,
+                      stage[i].total ? stage[i].sum / 1e3 / stage[i].total : 0.0,
+                      percentile(&stage[i], 0.5) / 1e3, percentile(&stage[i], 0.9) / 1e3,
+                      percentile(&stage[i], 0.99) / 1e3, percentile(&stage[i], 0.999) / 1e3,
+                      stage[i].max / 1e3);
+    return n;
+}
+
+static int render_json(char *buf, int size, long long *counter, stage_total *stage)
+{
+    int i, n;
+
+    n = snprintf(buf, size, "{\"uptime_secs\":%ld,\"counters\":{",
+                 (long)(time(NULL) - started));
+    for (i = 0; i < STAT_NUM; i++)
+        n += snprintf(buf + n, size - n, "%s\"%s\":%lld", i ? "," : "",
+                      counter_name[i], counter[i]);
+    n += snprintf(buf + n, size - n, "},\"log_dropped\":%lld,\"access_dropped\":%lld,"
+                  "\"stages\":{", log_dropped(), access_log_dropped());
+    for (i = 0; i < STAGE_NUM; i++)
+        n += snprintf(buf + n, size - n,
+                      "%s\"%s\":{\"count\":%lld,\"mean_us\":%.1f,\"p50_us\":%.1f,"
+                      "\"p90_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}",
+                      i ? "," : "", stage_name[i], stage[i].total,
+                      stage[i].total ? stage[i].sum / 1e3 / stage[i].total : 0.0,
+                      percentile(&stage[i], 0.5) / 1e3, percentile(&stage[i], 0.9) / 1e3,
+                      percentile(&stage[i], 0.99) / 1e3, percentile(&stage[i], 0.999) / 1e3,
+                      stage[i].max / 1e3);
+    n += snprintf(buf + n, size - n, "}}\n");
+    return n;
+}
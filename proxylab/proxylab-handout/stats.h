@@ -0,0 +1,61 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+/*
+* stats.h - live counters and per-stage latency histograms of the proxy.
+* every thread updates a block of its own with plain stores, the
+* endpoint sums all blocks when it is asked. a request for STATS_PATH
+* sent straight to the proxy (not through it) gets the totals as text,
+* or as JSON with the query ?format=json
+*/
+
+#define STATS_PATH "/__proxy_stats"
+#define STATS_SUB_BITS 4 // histogram buckets per power of two: 2^(bits - 1), ~6% error
+#define STATS_SUB (1 << STATS_SUB_BITS)
+#define STATS_HALF (STATS_SUB / 2)
+#define STATS_BUCKETS (STATS_SUB + (64 - STATS_SUB_BITS) * STATS_HALF)
+#define STATS_RESPONSE_SIZE MAXBUF // rendered response, head included
+
+// stretches of a request whose duration is recorded, in ns
+typedef enum {
+    STAGE_QUEUE, // accepted until a pool worker takes the connection
+    STAGE_PARSE, // parsing the request head
+    STAGE_LOOKUP, // memory and disk cache lookup
+    STAGE_CONNECT, // connecting to the origin, pooled connections skip it
+    STAGE_TTFB, // forward request sent until the first response byte
+    STAGE_NUM
+} stats_stage;
+
+typedef enum {
+    STAT_CONNECTIONS, // client connections accepted
+    STAT_REQUESTS, // request heads read
+    STAT_HITS, // answered from the memory cache
+    STAT_DISK_HITS, // answered from the disk tier
+    STAT_MISSES, // forwarded to the origin
+    STAT_COALESCED, // waited for another fetch of the same uri
+    STAT_REVALIDATED, // stale objects the origin confirmed with a 304
+    STAT_PARTIAL, // range requests answered from the caches with a 206 or 416
+    STAT_UPSTREAM_ERRORS, // origin could not be reached or sent nothing
+    STAT_BYTES_RELAYED, // response bytes from the origin to clients
+    STAT_BYTES_CACHED, // response bytes from the caches to clients
+    STAT_NUM
+} stats_counter;
+
+// response formats of the endpoint
+#define STATS_TEXT 1
+#define STATS_JSON 2
+
+void init_stats(void);
+// monotonic clock in ns, for stats_time()
+long long stats_now(void);
+void stats_add(stats_counter which, long long n);
+void stats_time(stats_stage stage, long long ns);
+// the listener accepted fd, and a pool worker took it over
+void stats_accepted(int fd);
+void stats_dequeued(int fd);
+// STATS_TEXT or STATS_JSON if head asks for the endpoint, 0 otherwise
+int stats_request(const char *head, int len);
+// render the whole HTTP response into buf, return its length
+int stats_render(char *buf, int size, int format);
+
+#endif /* __STATS_H__ */
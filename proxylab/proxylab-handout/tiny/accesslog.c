@@ -0,0 +1,277 @@
+/*
+* accesslog.c - asynchronous access log on per-thread SPSC rings
+*
+* a thread takes a ring on its first record, the same way stats.c hands
+* out blocks: one a finished thread left behind, or a new one pushed onto
+* the list with a CAS. only the owner moves head and only the writer
+* moves tail, so a record is a bounds check, a clock read, a copy into
+* the slot and a release store. the writer sleeps ACCESS_FLUSH_MSECS
+* between passes unless a pass found a ring half full, formats every
+* record it finds and appends the pass to the log with one write()
+*/
+#define _GNU_SOURCE
+#include "csapp.h"
+#include "accesslog.h"
+
+typedef struct access_ring {
+    volatile unsigned int head; // next slot to fill, moved by the owner
+    char pad1[60];
+    volatile unsigned int tail; // next slot to write out, moved by the writer
+    char pad2[60];
+    volatile int owned; // a live thread fills this ring
+    struct access_ring *next;
+    access_record rec[ACCESS_RING_SIZE];
+} access_ring;
+
+static int enabled; // set once before any request thread starts
+static access_ring *rings; // every ring ever made, newest first
+static __thread access_ring *self;
+static pthread_key_t owner_key; // gives self back when its thread exits
+static long long dropped;
+static const char *log_path;
+static int log_fd = -1;
+static long long log_size; // bytes in the current log file
+static volatile sig_atomic_t reopen_wanted; // set by SIGHUP
+
+static access_ring *my_ring(void);
+static void disown(void *arg);
+static void copy_field(char *dst, const char *src, int size);
+static void *writer_thread(void *vargp);
+static int drain(void);
+static int format_record(char *buf, int size, access_record *rec, long long wall_offset);
+static int open_log(void);
+static void rotate(void);
+static void hup_handler(int sig);
+
+int access_log_open(const char *path)
+{
+    pthread_t tid;
+    sigset_t mask;
+
+    log_path = path;
+    if (open_log() < 0)
+        return -1;
+    if (pthread_key_create(&owner_key, disown) != 0)
+        unix_error("pthread_key_create error");
+    Signal(SIGHUP, hup_handler);
+    Pthread_create(&tid, NULL, writer_thread, NULL);
+    // threads started from here on leave SIGHUP to the writer
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    atexit(access_log_flush); // records of a server exiting on an error are not lost
+    enabled = 1;
+    return 0;
+}
+
+long long access_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void access_log(const char *method, const char *uri, int status, long long bytes,
+                long long start_ns, const char *result)
+{
+    access_ring *r;
+    access_record *rec;
+    unsigned int head;
+
+    if (!enabled)
+        return;
+    r = my_ring();
+    head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == ACCESS_RING_SIZE) {
+        __sync_add_and_fetch(&dropped, 1); // the writer is a ring behind
+        return;
+    }
+    rec = &r->rec[head % ACCESS_RING_SIZE];
+    rec->start_ns = start_ns;
+    rec->end_ns = access_now();
+    rec->bytes = bytes;
+    rec->status = status;
+    copy_field(rec->method, method, sizeof(rec->method));
+    copy_field(rec->result, result, sizeof(rec->result));
+    copy_field(rec->uri, uri, sizeof(rec->uri));
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void access_log_flush(void)
+{
+    if (enabled)
+        drain();
+}
+
+long long access_log_dropped(void)
+{
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+// the ring of the calling thread, taken on its first record
+static access_ring *my_ring(void)
+{
+    access_ring *r;
+
+    if (self != NULL)
+        return self;
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next)
+        if (!r->owned && __sync_bool_compare_and_swap(&r->owned, 0, 1))
+            break;
+    if (r == NULL) {
+        r = Calloc(1, sizeof(access_ring));
+        r->owned = 1;
+        do {
+            r->next = rings;
+        } while (!__sync_bool_compare_and_swap(&rings, r->next, r));
+    }
+    pthread_setspecific(owner_key, r);
+    return self = r;
+}
+
+// a retiring thread leaves its unwritten records to the writer
+static void disown(void *arg)
+{
+    __atomic_store_n(&((access_ring *)arg)->owned, 0, __ATOMIC_RELEASE);
+}
+
+// copy src into a field of size bytes, cut and terminated
+static void copy_field(char *dst, const char *src, int size)
+{
+    int n = strnlen(src, size - 1);
+
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+}
+
+static void *writer_thread(void *vargp)
+{
+    struct timespec pause = { 0, ACCESS_FLUSH_MSECS * 1000000L };
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        if (!drain())
+            nanosleep(&pause, NULL); // a SIGHUP cuts it short
+    }
+    return NULL;
+}
+
+/*
+* drain - write out every record the rings hold, rotating or reopening
+* the log first if asked. return 1 if a ring was at least half full, so
+* the writer should not sleep before the next pass
+*/
+static int drain(void)
+{
+    static char out[ACCESS_BATCH_SIZE];
+    static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+    access_ring *r;
+    unsigned int head, tail;
+    int len = 0, busy = 0;
+    long long wall_offset; // CLOCK_REALTIME minus CLOCK_MONOTONIC
+    struct timespec mono, real;
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    wall_offset = (real.tv_sec - mono.tv_sec) * 1000000000LL + real.tv_nsec - mono.tv_nsec;
+    pthread_mutex_lock(&drain_lock);
+    if (reopen_wanted) {
+        reopen_wanted = 0;
+        open_log();
+    } else if (log_size >= ACCESS_ROTATE_BYTES) {
+        rotate();
+    }
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        tail = r->tail;
+        if (head - tail >= ACCESS_RING_SIZE / 2)
+            busy = 1;
+        for (; tail != head; tail++) {
+            if (len + ACCESS_URI_SIZE + 128 > ACCESS_BATCH_SIZE) {
+                rio_writen(log_fd, out, len); // only a burst past the batch splits it
+                log_size += len;
+                len = 0;
+            }
+            len += format_record(out + len, ACCESS_BATCH_SIZE - len,
+                                 &r->rec[tail % ACCESS_RING_SIZE], wall_offset);
+        }
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    }
+    if (len > 0) {
+        rio_writen(log_fd, out, len);
+        log_size += len;
+    }
+    pthread_mutex_unlock(&drain_lock);
+    return busy;
+}
+
+/*
+* format_record - one log line: local time, method, uri, status, bytes
+* sent, latency in us and how the request was served. unknown status
+* and bytes are written as -
+*/
+static int format_record(char *buf, int size, access_record *rec, long long wall_offset)
+{
+    static time_t last_sec = -1;
+    static char stamp[32]; // date and time of last_sec
+    char status[16], bytes[32];
+    long long wall = rec->end_ns + wall_offset;
+    time_t sec = wall / 1000000000LL;
+    struct tm tm;
+
+    if (sec != last_sec) {
+        last_sec = sec;
+        localtime_r(&sec, &tm);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+    }
+    if (rec->status > 0)
+        snprintf(status, sizeof(status), "%d", rec->status);
+    else
+        strcpy(status, "-");
+    if (rec->bytes >= 0)
+        snprintf(bytes, sizeof(bytes), "%lld", rec->bytes);
+    else
+        strcpy(bytes, "-");
+    return snprintf(buf, size, "%s.%03lld %s %s %s %s %lldus %s\n", stamp,
+                    wall / 1000000 % 1000, rec->method, rec->uri, status, bytes,
+                    (rec->end_ns - rec->start_ns) / 1000, rec->result);
+}
+
+// (re)open log_path for appending, keep the old file if it cannot be
+static int open_log(void)
+{
+    struct stat st;
+    int fd;
+
+    if ((fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+        return -1;
+    if (log_fd >= 0)
+        close(log_fd);
+    log_fd = fd;
+    log_size = fstat(fd, &st) == 0 ? st.st_size : 0;
+    return 0;
+}
+
+// shift path.N to path.N+1, dropping the oldest, and start a new path
+static void rotate(void)
+{
+    char from[MAXLINE], to[MAXLINE];
+    int i;
+
+    for (i = ACCESS_ROTATE_KEEP - 1; i >= 1; i--) {
+        snprintf(from, sizeof(from), "%s.%d", log_path, i);
+        snprintf(to, sizeof(to), "%s.%d", log_path, i + 1);
+        rename(from, to); // missing ones are fine
+    }
+    snprintf(to, sizeof(to), "%s.1", log_path);
+    if (rename(log_path, to) == 0)
+        open_log();
+    else
+        log_size = 0; // cannot rotate, do not retry every pass
+}
+
+static void hup_handler(int sig)
+{
+    reopen_wanted = 1;
+}
@@ -3,34 +3,38 @@
  */
 /* $begin adder */
 #include "csapp.h"
+#include "cgi.h"
 
 int main(void) {
     char *buf, *p;
     char arg1[MAXLINE], arg2[MAXLINE], content[MAXLINE];
-    int n1=0, n2=0;
+    int n1, n2;
 
-    /* Extract the two arguments */
-    if ((buf = getenv("QUERY_STRING")) != NULL) {
-	p = strchr(buf, '&');
-	*p = '\0';
-	strcpy(arg1, buf);
-	strcpy(arg2, p+1);
-	n1 = atoi(arg1);
-	n2 = atoi(arg2);
-    }
+    /* One pass per request, Tiny keeps the process for the next one */
+    while (cgi_accept() >= 0) {
+	n1 = n2 = 0;
+
+	/* Extract the two arguments */
+	if ((buf = getenv("QUERY_STRING")) != NULL
+	    && (p = strchr(buf, '&')) != NULL) {
+	    *p = '\0';
+	    strcpy(arg1, buf);
+	    strcpy(arg2, p+1);
+	    n1 = atoi(arg1);
+	    n2 = atoi(arg2);
+	}
 
-    /* Make the response body */
-    sprintf(content, "Welcome to add.com: ");
-    sprintf(content, "%sTHE Internet addition portal.\r\n<p>", content);
-    sprintf(content, "%sThe answer is: %d + %d = %d\r\n<p>", 
-	    content, n1, n2, n1 + n2);
-    sprintf(content, "%sThanks for visiting!\r\n", content);
-  
-    /* Generate the HTTP response */
-    printf("Content-length: %d\r\n", (int)strlen(content));
-    printf("Content-type: text/html\r\n\r\n");
-    printf("%s", content);
-    fflush(stdout);
+	/* Make the response body */
+	sprintf(content, "Welcome to add.com: "
+		"THE Internet addition portal.\r\n<p>"
+		"The answer is: %d + %d = %d\r\n<p>"
+		"Thanks for visiting!\r\n", n1, n2, n1 + n2);
+
+	/* Generate the HTTP response */
+	printf("Content-length: %d\r\n", (int)strlen(content));
+	printf("Content-type: text/html\r\n\r\n");
+	printf("%s", content);
+    }
     exit(0);
 }
 /* $end adder */
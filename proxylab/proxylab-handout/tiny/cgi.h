@@ -0,0 +1,70 @@
+#ifndef __CGI_H__
+#define __CGI_H__
+
+/*
+ * cgi.h - FastCGI style request loop for Tiny's CGI programs
+ *
+ *     while (cgi_accept() >= 0) {
+ *         ... read QUERY_STRING, print the response to stdout ...
+ *     }
+ *
+ * The first pass serves the request the program was started for, so
+ * under any plain CGI server the loop runs exactly once. Started by
+ * Tiny, the program keeps running: each later pass reports the previous
+ * response done and waits for the next request, whose client socket
+ * becomes stdout, already holding the head Tiny sent along, and whose
+ * query string becomes QUERY_STRING.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "cgipool.h"
+
+static int cgi_accept(void) {
+    static int requests = 0;
+    char query[CGI_MSG_SIZE + 1], cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { query, CGI_MSG_SIZE };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int clientfd = -1;
+    ssize_t n;
+
+    if (requests++ == 0)
+        return 0;
+    /* finish the response and let go of its client */
+    fflush(stdout);
+    if (getenv(CGI_WORKER_ENV) == NULL)
+        return -1; /* not started by Tiny */
+    close(STDOUT_FILENO);
+    if (write(CGI_WORKER_FD, "", 1) != 1)
+        return -1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    if ((n = recvmsg(CGI_WORKER_FD, &msg, 0)) <= 0)
+        return -1; /* Tiny retired this worker */
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&clientfd, CMSG_DATA(cmsg), sizeof(int));
+    if (clientfd < 0)
+        return -1;
+    if (clientfd != STDOUT_FILENO) {
+        dup2(clientfd, STDOUT_FILENO);
+        close(clientfd);
+    }
+    clearerr(stdout);
+    query[n] = '\0';
+    setenv("QUERY_STRING", query, 1);
+    /* the head follows the query string, the program prints the rest */
+    if (strlen(query) < (size_t)n)
+        fputs(query + strlen(query) + 1, stdout);
+    return 0;
+}
+
+#endif /* __CGI_H__ */
@@ -0,0 +1,325 @@
+/*
+ * cgipool.c - persistent CGI workers for Tiny
+ *
+ * Every worker is a CGI process with a SOCK_SEQPACKET socket to Tiny.
+ * A request goes to an idle worker of the same program as one message
+ * carrying the client socket (SCM_RIGHTS), QUERY_STRING and the response
+ * head; the worker writes the head, answers the client directly and
+ * sends one byte back when it is done.
+ * Without an idle worker a new process is forked for the request, as
+ * classic CGI did, up to CGI_MAX_WORKERS; past that an idle worker of
+ * another program is retired, or the request waits up to CGI_WAIT_SECS
+ * and is then turned away. The status line goes out only with a hand-off
+ * that cannot fail any more: a pooled worker writes it once it has the
+ * request, and Tiny writes it for a new process once its socket exists.
+ * A worker that died while idle, or a turned away request, has sent
+ * nothing, so the request is retried or answered with 503.
+ * Tiny's thread never waits for the CGI run itself: a reaper thread
+ * watches every worker socket, marks workers idle, retires the ones
+ * whose socket closed, kills the ones busy for CGI_RUN_SECS and collects
+ * the processes of retired workers with waitpid(WNOHANG).
+ */
+#define _GNU_SOURCE
+#include <sys/epoll.h>
+#include "csapp.h"
+#include "cgipool.h"
+
+/* $begin cgipool */
+typedef struct cgi_worker {
+    pid_t pid;
+    int sock;                    /* Tiny's end, -1 once retired */
+    char *prog;                  /* path of the CGI program */
+    int idle;                    /* waiting for its next request */
+    time_t since;                /* busy or retired since, monotonic */
+    struct cgi_worker *next;
+} cgi_worker;
+/* $end cgipool */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed;   /* a worker went idle or away */
+static cgi_worker *workers;      /* live workers */
+static cgi_worker *retired;      /* freed by the reaper once collected */
+static int worker_num;           /* live workers and spawns in progress */
+static int epfd;
+
+static void *reaper_thread(void *vargp);
+static time_t now_secs(void);
+static int serve(int clientfd, char *filename, char *cgiargs, char *head, int wait);
+static cgi_worker *find_idle(char *prog);
+static int send_request(int sock, int clientfd, char *cgiargs, char *head);
+static int spawn_worker(int clientfd, char *filename, char *cgiargs, char *head);
+static void retire_worker(cgi_worker *w);
+
+/*
+ * cgipool_init - start the reaper
+ */
+void cgipool_init(void) {
+    pthread_condattr_t attr;
+    pthread_t tid;
+
+    /* waits for a worker are bounded on the monotonic clock */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&changed, &attr);
+    pthread_condattr_destroy(&attr);
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("epoll_create1 error");
+    Pthread_create(&tid, NULL, reaper_thread, NULL);
+}
+
+/*
+ * cgipool_serve - run filename for the client on clientfd, writing head
+ *     to it first. returns 0 once a worker has the request, or -1 with
+ *     nothing sent if no worker freed up within CGI_WAIT_SECS
+ */
+int cgipool_serve(int clientfd, char *filename, char *cgiargs, char *head) {
+    return serve(clientfd, filename, cgiargs, head, 1);
+}
+
+/*
+ * cgipool_try_serve - cgipool_serve() for event loops, -1 right away
+ *     while every worker is busy
+ */
+int cgipool_try_serve(int clientfd, char *filename, char *cgiargs, char *head) {
+    return serve(clientfd, filename, cgiargs, head, 0);
+}
+
+static time_t now_secs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/*
+ * serve - claim an idle worker or a free slot under the lock, then talk
+ *     to the client and the worker without it. waits for one if wait
+ */
+static int serve(int clientfd, char *filename, char *cgiargs, char *head, int wait) {
+    struct timespec deadline;
+    cgi_worker *w;
+    int sock;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += CGI_WAIT_SECS;
+    pthread_mutex_lock(&lock);
+    while (1) {
+        if ((w = find_idle(filename)) != NULL) {
+            /* a private descriptor outlives a retirement meanwhile */
+            if ((sock = fcntl(w->sock, F_DUPFD_CLOEXEC, 0)) < 0)
+                break;
+            w->idle = 0;
+            w->since = now_secs();
+            pthread_mutex_unlock(&lock);
+            if (send_request(sock, clientfd, cgiargs, head) == 0) {
+                close(sock);
+                return 0;
+            }
+            /* died since it reported idle, the reaper sees the hang up;
+               nothing reached the client, another worker may take it */
+            close(sock);
+            pthread_mutex_lock(&lock);
+            continue;
+        }
+        if (worker_num < CGI_MAX_WORKERS) {
+            worker_num++; /* the slot is ours while forking without the lock */
+            pthread_mutex_unlock(&lock);
+            return spawn_worker(clientfd, filename, cgiargs, head);
+        }
+        /* make room by retiring an idle worker of another program */
+        if ((w = find_idle(NULL)) != NULL) {
+            retire_worker(w);
+            continue;
+        }
+        if (!wait || pthread_cond_timedwait(&changed, &lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&lock);
+    return -1;
+}
+
+/*
+ * reaper_thread - mark workers idle as they report back, retire the ones
+ *     that went away or are stuck, and free retired workers once their
+ *     own process is collected
+ */
+static void *reaper_thread(void *vargp) {
+    struct epoll_event events[64];
+    cgi_worker *w, *next, **pp;
+    char done[16];
+    time_t now;
+    int i, n;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        if ((n = epoll_wait(epfd, events, 64, CGI_REAP_MSECS)) < 0) {
+            if (errno != EINTR)
+                unix_error("epoll_wait error");
+            n = 0;
+        }
+        pthread_mutex_lock(&lock);
+        for (i = 0; i < n; i++) {
+            w = events[i].data.ptr;
+            if (w->sock < 0)
+                continue; /* retired while the events were collected */
+            if (read(w->sock, done, sizeof(done)) > 0)
+                w->idle = 1;
+            else
+                retire_worker(w);
+        }
+        now = now_secs();
+        for (w = workers; w != NULL; w = next) {
+            next = w->next;
+            if (!w->idle && now - w->since >= CGI_RUN_SECS) {
+                kill(-w->pid, SIGKILL); /* hung, its slot is needed */
+                retire_worker(w);
+            }
+        }
+        /* only pool workers are waited for, by pid */
+        for (pp = &retired; (w = *pp) != NULL; ) {
+            if (waitpid(w->pid, NULL, WNOHANG) != 0) {
+                *pp = w->next;
+                Free(w->prog);
+                Free(w);
+                continue;
+            }
+            if (now - w->since >= CGI_RUN_SECS)
+                kill(-w->pid, SIGKILL); /* ignored the closed socket */
+            pp = &w->next;
+        }
+        pthread_cond_broadcast(&changed);
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+/* an idle worker running prog, or of any program if prog is NULL */
+static cgi_worker *find_idle(char *prog) {
+    cgi_worker *w;
+
+    for (w = workers; w != NULL; w = w->next)
+        if (w->idle && (prog == NULL || !strcmp(w->prog, prog)))
+            return w;
+    return NULL;
+}
+
+/*
+ * send_request - pass the client socket, the query string and the head
+ *     for the worker to write first to a waiting worker on sock, as one
+ *     message: cgiargs, its NUL, then head
+ */
+static int send_request(int sock, int clientfd, char *cgiargs, char *head) {
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov[2] = { { cgiargs, strlen(cgiargs) + 1 },
+                            { head, strlen(head) } };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    if (iov[0].iov_len + iov[1].iov_len > CGI_MSG_SIZE)
+        return -1;
+    memset(&msg, 0, sizeof(msg));
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &clientfd, sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+/*
+ * spawn_worker - write head and fork and exec filename for this request
+ *     the classic way, stdout on the client, plus the socket it keeps
+ *     talking to Tiny on if it loops on cgi_accept(). -1 with nothing
+ *     sent if there is no socket for it
+ */
+static int spawn_worker(int clientfd, char *filename, char *cgiargs, char *head) {
+    char *argv[] = { filename, NULL };
+    char **envp, query[MAXLINE];
+    cgi_worker *w;
+    struct epoll_event ev;
+    int sv[2], i, n = 0;
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        pthread_mutex_lock(&lock);
+        worker_num--;
+        pthread_cond_broadcast(&changed);
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    rio_writen(clientfd, head, strlen(head));
+    /* Real server would set all CGI vars here */
+    for (i = 0; environ[i] != NULL; i++)
+        ;
+    envp = Malloc((i + 3) * sizeof(char *));
+    for (i = 0; environ[i] != NULL; i++)
+        if (strncmp(environ[i], "QUERY_STRING=", 13))
+            envp[n++] = environ[i];
+    snprintf(query, sizeof(query), "QUERY_STRING=%s", cgiargs);
+    envp[n++] = query;
+    envp[n++] = CGI_WORKER_ENV "=1";
+    envp[n] = NULL;
+
+    if ((pid = Fork()) == 0) { /* child */
+        sigset_t mask;
+
+        /* a group of its own, so a kill takes its children along */
+        setpgid(0, 0);
+        /* the program starts with no signal blocked, the server blocks SIGHUP */
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        Dup2(clientfd, STDOUT_FILENO);   /* Redirect stdout to client */
+        if (sv[1] == CGI_WORKER_FD)
+            fcntl(sv[1], F_SETFD, 0);
+        else
+            Dup2(sv[1], CGI_WORKER_FD);
+        /* other clients' sockets must not live on in the worker */
+        if (close_range(CGI_WORKER_FD + 1, ~0U, 0) < 0)
+            for (i = CGI_WORKER_FD + 1; i < getdtablesize(); i++)
+                close(i);
+        execve(filename, argv, envp);
+        _exit(127);
+    }
+    Free(envp);
+    close(sv[1]);
+
+    w = Malloc(sizeof(cgi_worker));
+    w->pid = pid;
+    w->sock = sv[0];
+    w->prog = Malloc(strlen(filename) + 1);
+    strcpy(w->prog, filename);
+    w->idle = 0;
+    w->since = now_secs();
+    pthread_mutex_lock(&lock);
+    w->next = workers;
+    workers = w;
+    ev.events = EPOLLIN;
+    ev.data.ptr = w;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, w->sock, &ev) < 0)
+        unix_error("epoll_ctl error");
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+/* close the socket of w, which makes its cgi_accept() return -1 */
+static void retire_worker(cgi_worker *w) {
+    cgi_worker **pp = &workers;
+
+    while (*pp != w)
+        pp = &(*pp)->next;
+    *pp = w->next;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, w->sock, NULL);
+    close(w->sock);
+    w->sock = -1;
+    w->idle = 0;
+    w->since = now_secs();
+    w->next = retired;
+    retired = w;
+    worker_num--;
+    pthread_cond_broadcast(&changed);
+}
@@ -0,0 +1,29 @@
+#ifndef __CGIPOOL_H__
+#define __CGIPOOL_H__
+
+#include "csapp.h"
+
+/*
+ * cgipool.h - persistent CGI worker processes for Tiny. A CGI program
+ *     is started the classic way for its first request, with a unix
+ *     socket to Tiny on CGI_WORKER_FD and CGI_WORKER_ENV set. A program
+ *     that loops on cgi_accept() (cgi.h) then reports back after each
+ *     response and is handed later requests over that socket, client
+ *     socket, QUERY_STRING and the head to write first included, so it
+ *     is never forked again.
+ *     A program that just exits is reaped and started anew next time
+ */
+
+#define CGI_MAX_WORKERS 16       /* live worker processes, all programs */
+#define CGI_WORKER_FD 3          /* the worker's end of its socket */
+#define CGI_WORKER_ENV "TINY_CGI_WORKER" /* set in a worker's environment */
+#define CGI_MSG_SIZE (2 * MAXLINE) /* query string and head of a request */
+#define CGI_REAP_MSECS 1000      /* reaper wakes up at least this often */
+#define CGI_WAIT_SECS 5          /* longest wait for a free worker */
+#define CGI_RUN_SECS 30          /* a worker busy for longer is killed */
+
+void cgipool_init(void);
+int cgipool_serve(int clientfd, char *filename, char *cgiargs, char *head);
+int cgipool_try_serve(int clientfd, char *filename, char *cgiargs, char *head);
+
+#endif /* __CGIPOOL_H__ */
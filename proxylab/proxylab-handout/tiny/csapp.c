@@ -572,6 +572,45 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_writev - robustly write the iovcnt buffers of iov in order
+ *    (unbuffered), gathered into as few writes as the kernel takes.
+ *    The iov array itself is left untouched.
+ */
+/* $begin rio_writev */
+ssize_t rio_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    ssize_t nwritten, total = 0;
+    size_t rest;
+    int i = 0;
+
+    while (i < iovcnt) {
+	if ((nwritten = writev(fd, iov + i,
+			       iovcnt - i < IOV_MAX ? iovcnt - i : IOV_MAX)) < 0) {
+	    if (errno == EINTR)  /* interrupted by sig handler return */
+		continue;        /* and call writev() again */
+	    else
+		return -1;       /* errno set by writev() */
+	}
+	total += nwritten;
+	/* skip the buffers that went out whole */
+	while (i < iovcnt && (size_t)nwritten >= iov[i].iov_len) {
+	    nwritten -= iov[i].iov_len;
+	    i++;
+	}
+	/* finish a buffer cut short before gathering the rest */
+	if (i < iovcnt && nwritten > 0) {
+	    rest = iov[i].iov_len - nwritten;
+	    if (rio_writen(fd, (char *)iov[i].iov_base + nwritten, rest) < 0)
+		return -1;
+	    total += rest;
+	    i++;
+	}
+    }
+    return total;
+}
+/* $end rio_writev */
+
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -693,6 +732,12 @@ void Rio_writen(int fd, void *usrbuf, size_t n)
 	unix_error("Rio_writen error");
 }
 
+void Rio_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    if (rio_writev(fd, iov, iovcnt) < 0)
+	unix_error("Rio_writev error");
+}
+
 void Rio_readinitb(rio_t *rp, int fd)
 {
     rio_readinitb(rp, fd);
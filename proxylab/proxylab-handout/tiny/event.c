@@ -0,0 +1,375 @@
+/*
+ * event.c - epoll serving mode of Tiny
+ *
+ * Every loop thread owns an SO_REUSEPORT listener, so the kernel spreads
+ * new connections over the loops, and its own epoll instance. Sockets
+ * are non-blocking and edge-triggered; each event runs the state machine
+ * of its connection until the socket would block:
+ *
+ *   READ_REQUEST -> WRITE_HEAD -> SEND_FILE -> closed
+ *
+ * The request head is collected as it arrives, each read scanning only
+ * the new bytes for its end. A static file is sent with sendfile() from
+ * the open file cache, the connection keeps the offset across partial
+ * sends. A CGI request leaves the loop once it has a worker: the socket
+ * turns blocking again and goes to a CGI worker, which the pool finds
+ * without waiting. When every worker is busy the client gets a 503.
+ */
+#define _GNU_SOURCE
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include "csapp.h"
+#include "cgipool.h"
+#include "tiny.h"
+#include "event.h"
+#include "accesslog.h"
+
+typedef enum {
+    CONN_READ_REQUEST,           /* reading the request head */
+    CONN_WRITE_HEAD,             /* writing out, the response head or error */
+    CONN_SEND_FILE               /* sending the body of a static file */
+} conn_state;
+
+/* $begin eventconn */
+typedef struct {
+    conn_state state;
+    int fd;
+    int epfd;                    /* epoll instance of the owning loop */
+    char req[EVENT_REQ_SIZE + 1]; /* request head, nul terminated */
+    int req_len;
+    char out[EVENT_OUT_SIZE];    /* bytes to write before any file */
+    int out_len, out_off;
+    file_entry *file;            /* pinned static file, NULL otherwise */
+    off_t offset;                /* next byte of file to send */
+    char *prog;                  /* CGI program to run, NULL otherwise */
+    char *cgiargs;
+    long long start;             /* request head complete, for the access log */
+    char method[8];
+    char *uri;                   /* as sent, NULL until the head is parsed */
+    int status;
+} conn;
+/* $end eventconn */
+
+typedef struct {
+    int epfd;
+    int listenfd;
+    int port;
+} event_loop;
+
+static void *loop_thread(void *vargp);
+static void loop_start(event_loop *lp);
+static int open_reuseport_listenfd(int port);
+static void accept_all(event_loop *lp);
+static void conn_drive(conn *c);
+static void conn_close(conn *c);
+static int read_request(conn *c);
+static void start_response(conn *c);
+static int run_cgi(conn *c);
+static int flush_out(conn *c);
+static int send_file(conn *c);
+
+/*
+ * event_main - start loop_num event loops on port, the calling thread
+ *     runs the last one
+ */
+void event_main(int port, int loop_num) {
+    int i;
+    pthread_t tid;
+    event_loop *lp;
+
+    for (i = 0; i < loop_num; i++) {
+        lp = Malloc(sizeof(event_loop));
+        lp->port = port;
+        if (i == loop_num - 1)
+            loop_start(lp);
+        else
+            Pthread_create(&tid, NULL, loop_thread, lp);
+    }
+}
+
+static void *loop_thread(void *vargp) {
+    Pthread_detach(pthread_self());
+    loop_start((event_loop *)vargp);
+    return NULL;
+}
+
+/* open the listener and the epoll instance of lp and serve forever */
+static void loop_start(event_loop *lp) {
+    struct epoll_event events[EVENT_MAX_EVENTS];
+    struct epoll_event ev;
+    int i, n;
+
+    lp->listenfd = open_reuseport_listenfd(lp->port);
+    if ((lp->epfd = epoll_create1(0)) < 0)
+        unix_error("epoll_create1 error");
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL; /* the listener */
+    if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, lp->listenfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+
+    while (1) {
+        if ((n = epoll_wait(lp->epfd, events, EVENT_MAX_EVENTS, -1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("epoll_wait error");
+        }
+        /* a connection has one socket, so it fires at most once per batch
+           and can be freed as soon as it is done */
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL)
+                accept_all(lp);
+            else
+                conn_drive(events[i].data.ptr);
+        }
+    }
+}
+
+/* non-blocking listener that shares its port with the other loops */
+static int open_reuseport_listenfd(int port) {
+    int listenfd, optval = 1;
+    struct sockaddr_in serveraddr;
+
+    if ((listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+        unix_error("socket error");
+    Setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+    Setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int));
+    bzero((char *) &serveraddr, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serveraddr.sin_port = htons((unsigned short)port);
+    Bind(listenfd, (SA *)&serveraddr, sizeof(serveraddr));
+    Listen(listenfd, LISTENQ);
+    return listenfd;
+}
+
+/* accept until the backlog is empty, as the listener is edge-triggered */
+static void accept_all(event_loop *lp) {
+    int connfd;
+    conn *c;
+    struct epoll_event ev;
+
+    while ((connfd = accept4(lp->listenfd, NULL, NULL,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        c = Malloc(sizeof(conn));
+        c->state = CONN_READ_REQUEST;
+        c->fd = connfd;
+        c->epfd = lp->epfd;
+        c->req_len = 0;
+        c->out_len = c->out_off = 0;
+        c->file = NULL;
+        c->offset = 0;
+        c->prog = c->cgiargs = NULL;
+        c->uri = NULL;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+            close(connfd);
+            Free(c);
+        }
+    }
+}
+
+/*
+ * conn_drive - advance c until its response is sent or the socket
+ *     would block
+ */
+static void conn_drive(conn *c) {
+    int rc;
+
+    while (1) {
+        switch (c->state) {
+        case CONN_READ_REQUEST:
+            if ((rc = read_request(c)) == 0)
+                return;
+            if (rc < 0) {
+                conn_close(c);
+                return;
+            }
+            start_response(c);
+            break;
+
+        case CONN_WRITE_HEAD:
+            if ((rc = flush_out(c)) == 0)
+                return;
+            if (rc < 0) {
+                conn_close(c);
+                return;
+            }
+            if (c->file != NULL) {
+                c->state = CONN_SEND_FILE;
+                break;
+            }
+            if (c->prog != NULL && run_cgi(c) == 0)
+                break; /* no free worker, out holds a 503 */
+            conn_close(c); /* sent, or handed to a CGI worker */
+            return;
+
+        case CONN_SEND_FILE:
+            if ((rc = send_file(c)) == 0)
+                return;
+            conn_close(c);
+            return;
+        }
+    }
+}
+
+/*
+ * conn_close - close the socket and free c, no event in the batch refers
+ *     to it. the registration goes first: it belongs to the socket, not
+ *     the fd, and a CGI worker or a child that has not yet exec'ed keeps
+ *     the socket open after this close
+ */
+static void conn_close(conn *c) {
+    if (c->uri != NULL) {
+        access_log(c->method, c->uri, c->status,
+                   c->prog != NULL ? -1 : c->out_off + c->offset, c->start,
+                   c->prog != NULL ? "CGI" : c->file != NULL ? "STATIC" : "ERROR");
+        Free(c->uri);
+    }
+    epoll_ctl(c->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    if (c->file != NULL)
+        filecache_put(c->file);
+    if (c->prog != NULL) {
+        Free(c->prog);
+        Free(c->cgiargs);
+    }
+    Free(c);
+}
+
+/*
+ * read_request - read what the client sent so far, return 1 once the
+ *     head is complete, 0 if more is needed and -1 on error or overflow
+ */
+static int read_request(conn *c) {
+    int n, from;
+
+    while (1) {
+        n = read(c->fd, c->req + c->req_len, EVENT_REQ_SIZE - c->req_len);
+        if (n > 0) {
+            /* the blank line may straddle the previous read */
+            from = c->req_len > 3 ? c->req_len - 3 : 0;
+            c->req_len += n;
+            c->req[c->req_len] = '\0';
+            if (strstr(c->req + from, "\r\n\r\n"))
+                return 1;
+            if (c->req_len == EVENT_REQ_SIZE)
+                return -1;
+        } else if (n == 0) {
+            return -1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+/*
+ * start_response - route the complete request and queue its head or the
+ *     whole error response in out. the CGI pool sends the status line
+ */
+static void start_response(conn *c) {
+    char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char filename[MAXLINE], cgiargs[MAXLINE];
+    tiny_error err;
+    int n;
+
+    c->state = CONN_WRITE_HEAD;
+    if (sscanf(c->req, "%s %s %s", method, uri, version) != 3) {
+        c->out_len = 0; /* nothing to answer, as in doit() */
+        return;
+    }
+    /* parse_uri() cuts the query off, the log gets the uri as sent */
+    c->start = access_now();
+    n = strnlen(method, sizeof(c->method) - 1);
+    memcpy(c->method, method, n);
+    c->method[n] = '\0';
+    c->uri = Malloc(strlen(uri) + 1);
+    strcpy(c->uri, uri);
+    c->status = 200;
+    switch (route_request(method, uri, filename, cgiargs, &c->file, &err)) {
+    case ROUTE_STATIC:
+        c->out_len = static_head(c->out, sizeof(c->out), filename, c->file);
+        break;
+    case ROUTE_DYNAMIC:
+        c->out_len = 0;
+        c->prog = Malloc(strlen(filename) + 1);
+        strcpy(c->prog, filename);
+        c->cgiargs = Malloc(strlen(cgiargs) + 1);
+        strcpy(c->cgiargs, cgiargs);
+        break;
+    default:
+        c->out_len = error_response(c->out, sizeof(c->out), &err);
+        c->status = atoi(err.errnum);
+        break;
+    }
+}
+
+/*
+ * run_cgi - hand the client to a CGI worker, which writes to it with
+ *     plain stdio. returns 1 once c is done with, or 0 with a 503 in out
+ *     if every worker is busy, the loop does not wait for one
+ */
+static int run_cgi(conn *c) {
+    tiny_error err = { c->prog, "503", "Service Unavailable",
+                       "Tiny has no free CGI worker" };
+    int flags = fcntl(c->fd, F_GETFL);
+
+    if (flags < 0 || fcntl(c->fd, F_SETFL, flags & ~O_NONBLOCK) < 0)
+        return 1;
+    if (cgipool_try_serve(c->fd, c->prog, c->cgiargs, DYNAMIC_HEAD) == 0)
+        return 1;
+    fcntl(c->fd, F_SETFL, flags);
+    c->out_len = error_response(c->out, sizeof(c->out), &err);
+    c->out_off = 0;
+    c->status = 503;
+    Free(c->prog);
+    Free(c->cgiargs);
+    c->prog = c->cgiargs = NULL;
+    return 0;
+}
+
+/*
+ * flush_out - write the rest of out, return 1 when all of it is written,
+ *     0 if the socket would block and -1 on error. a head is held back
+ *     to share a packet with the file
+ */
+static int flush_out(conn *c) {
+    int n, more = c->file != NULL ? MSG_MORE : 0;
+
+    while (c->out_off < c->out_len) {
+        n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, more);
+        if (n > 0) {
+            c->out_off += n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/*
+ * send_file - sendfile the rest of the static file, return 1 when all
+ *     of it is sent, 0 if the socket would block and -1 on error
+ */
+static int send_file(conn *c) {
+    ssize_t n;
+
+    while (c->offset < c->file->st.st_size) {
+        n = sendfile(c->fd, c->file->fd, &c->offset,
+                     c->file->st.st_size - c->offset);
+        if (n > 0)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n < 0 && errno == EINTR)
+            continue;
+        return -1; /* client went away or the file shrank */
+    }
+    return 1;
+}
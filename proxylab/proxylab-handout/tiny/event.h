@@ -0,0 +1,17 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+/*
+ * event.h - epoll serving mode of Tiny. Every loop thread owns an
+ *     SO_REUSEPORT listener and an epoll instance, reads requests
+ *     without blocking and streams static files with sendfile()
+ */
+
+#define EVENT_MAX_EVENTS 64          /* events handled per epoll_wait */
+#define EVENT_REQ_SIZE MAXLINE       /* max request head bytes */
+#define EVENT_OUT_SIZE (MAXLINE + MAXBUF) /* response head, or a whole error */
+
+/* run loop_num event loops on port, never returns */
+void event_main(int port, int loop_num);
+
+#endif /* __EVENT_H__ */
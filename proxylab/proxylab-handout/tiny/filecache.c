@@ -0,0 +1,291 @@
+/*
+ * filecache.c - open file and stat cache for Tiny's static content
+ *
+ * One mutex guards a hash table and an lru list of at most
+ * FILECACHE_SIZE entries. Readers pin an entry while they send from its
+ * fd, so an entry that is evicted or invalidated meanwhile is only
+ * closed by the last reader. A watcher thread drains inotify and drops
+ * every entry whose file was written, truncated, renamed or unlinked.
+ * Files are watched, stat'ed and opened without the mutex; the watches
+ * of the latest changes are remembered, so an entry whose file changed
+ * while it was being opened is handed out but not cached.
+ */
+#include <sys/inotify.h>
+#include "csapp.h"
+#include "filecache.h"
+
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF)
+#define RECENT_CHANGES 64        /* watches of the latest changes remembered */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static file_entry *bucket[FILECACHE_BUCKETS];
+static file_entry *head, *tail;
+static int entry_num;
+static int inotify_fd = -1;      /* -1 falls back to periodic stat */
+static unsigned long changes;    /* changes seen, watches changed or removed */
+static int recent_wd[RECENT_CHANGES]; /* by change number % RECENT_CHANGES */
+
+static void *watch_thread(void *vargp);
+static unsigned int name_hash(char *name);
+static file_entry *find_entry(char *name);
+static file_entry *open_entry(char *name);
+static int still_same(file_entry *e);
+static void note_change(int wd);
+static int changed_since(int wd, unsigned long seen);
+static void forget_watch(int wd);
+static void drop_entry(file_entry *e);
+static void release_entry(file_entry *e);
+static void lru_unlink(file_entry *e);
+static void lru_push_front(file_entry *e);
+
+/*
+ * filecache_init - start watching for changes, or fall back to stat
+ */
+void filecache_init(void) {
+    pthread_t tid;
+
+    if ((inotify_fd = inotify_init()) < 0) {
+        fprintf(stderr, "inotify unavailable, checking files every %ds\n",
+                FILECACHE_CHECK_SECS);
+        return;
+    }
+    Pthread_create(&tid, NULL, watch_thread, NULL);
+}
+
+/*
+ * filecache_get - return the entry of filename pinned, opening and
+ *     caching it on a miss. NULL with errno set if it cannot be stat'ed
+ */
+file_entry *filecache_get(char *filename) {
+    file_entry *e, *fresh;
+    unsigned long seen;
+
+    pthread_mutex_lock(&lock);
+    if ((e = find_entry(filename)) != NULL) {
+        e->refcnt++;
+        if (e->wd >= 0 || still_same(e)) {
+            if (find_entry(filename) == e && e != head) {
+                lru_unlink(e);
+                lru_push_front(e);
+            }
+            pthread_mutex_unlock(&lock);
+            return e;
+        }
+        if (find_entry(filename) == e)
+            drop_entry(e);
+        release_entry(e);
+    }
+    seen = changes;
+    pthread_mutex_unlock(&lock);
+
+    if ((fresh = open_entry(filename)) == NULL)
+        return NULL;
+    fresh->refcnt = 1;
+    pthread_mutex_lock(&lock);
+    if ((e = find_entry(filename)) != NULL) {
+        /* cached by another thread meanwhile, hand out that one */
+        e->refcnt++;
+        forget_watch(fresh->wd);
+    } else if (changed_since(fresh->wd, seen)) {
+        /* changed while it was opened and may be stale, do not keep it */
+        forget_watch(fresh->wd);
+        fresh->wd = -1;
+        e = fresh;
+        fresh = NULL;
+    } else {
+        if (entry_num == FILECACHE_SIZE)
+            drop_entry(tail);
+        fresh->hnext = bucket[name_hash(filename)];
+        bucket[name_hash(filename)] = fresh;
+        lru_push_front(fresh);
+        entry_num++;
+        fresh->refcnt = 2;
+        e = fresh;
+        fresh = NULL;
+    }
+    pthread_mutex_unlock(&lock);
+    if (fresh != NULL)
+        release_entry(fresh); /* never shared, no lock needed */
+    return e;
+}
+
+/*
+ * filecache_put - unpin an entry returned by filecache_get
+ */
+void filecache_put(file_entry *e) {
+    pthread_mutex_lock(&lock);
+    release_entry(e);
+    pthread_mutex_unlock(&lock);
+}
+
+/* drop the entries of every file inotify reports as changed */
+static void *watch_thread(void *vargp) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    file_entry *e, *next;
+    ssize_t n;
+    char *p;
+
+    Pthread_detach(pthread_self());
+    while ((n = read(inotify_fd, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("inotify read error");
+        }
+        pthread_mutex_lock(&lock);
+        for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event *)p;
+            note_change(ev->wd);
+            /* several names may lead to the same file and watch */
+            for (e = head; e != NULL; e = next) {
+                next = e->next;
+                if (e->wd == ev->wd)
+                    drop_entry(e);
+            }
+        }
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+static unsigned int name_hash(char *name) {
+    unsigned int h = 2166136261u;
+
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h & (FILECACHE_BUCKETS - 1);
+}
+
+static file_entry *find_entry(char *name) {
+    file_entry *e;
+
+    for (e = bucket[name_hash(name)]; e != NULL; e = e->hnext)
+        if (!strcmp(e->name, name))
+            return e;
+    return NULL;
+}
+
+/*
+ * open_entry - stat and open name into a new entry, watching it before
+ *     it is read. called without the lock
+ */
+static file_entry *open_entry(char *name) {
+    file_entry *e = Malloc(sizeof(file_entry));
+
+    e->wd = inotify_fd < 0 ? -1 : inotify_add_watch(inotify_fd, name, WATCH_MASK);
+    e->fd = -1;
+    if (stat(name, &e->st) < 0) {
+        int saved = errno;
+        pthread_mutex_lock(&lock);
+        forget_watch(e->wd);
+        pthread_mutex_unlock(&lock);
+        Free(e);
+        errno = saved;
+        return NULL;
+    }
+    /* only regular files are opened, a fifo would block the thread */
+    if (S_ISREG(e->st.st_mode))
+        e->fd = open(name, O_RDONLY, 0);
+    e->name = Malloc(strlen(name) + 1);
+    strcpy(e->name, name);
+    e->checked = time(NULL);
+    e->prev = e->next = e->hnext = NULL;
+    return e;
+}
+
+/*
+ * still_same - without change notifications, stat the file of the
+ *     pinned e at most every FILECACHE_CHECK_SECS to see it is the same.
+ *     called with the lock held, which is released around the stat
+ */
+static int still_same(file_entry *e) {
+    struct stat st;
+    time_t now = time(NULL);
+    int same;
+
+    if (e->checked + FILECACHE_CHECK_SECS > now)
+        return 1;
+    pthread_mutex_unlock(&lock);
+    same = stat(e->name, &st) == 0 && st.st_ino == e->st.st_ino
+        && st.st_mtime == e->st.st_mtime && st.st_size == e->st.st_size;
+    pthread_mutex_lock(&lock);
+    if (same)
+        e->checked = now;
+    return same;
+}
+
+static void note_change(int wd) {
+    recent_wd[changes++ % RECENT_CHANGES] = wd;
+}
+
+/* a change to wd was noted since seen, or too many to tell */
+static int changed_since(int wd, unsigned long seen) {
+    if (wd < 0)
+        return 0;
+    if (changes - seen > RECENT_CHANGES)
+        return 1;
+    for (; seen != changes; seen++)
+        if (recent_wd[seen % RECENT_CHANGES] == wd)
+            return 1;
+    return 0;
+}
+
+/* stop watching wd unless a cached entry still needs it */
+static void forget_watch(int wd) {
+    file_entry *e;
+
+    if (wd < 0)
+        return;
+    for (e = head; e != NULL; e = e->next)
+        if (e->wd == wd)
+            return;
+    inotify_rm_watch(inotify_fd, wd);
+    note_change(wd); /* a file being opened may share the watch */
+}
+
+/* unlink e from the table, stop watching and drop the cache's reference */
+static void drop_entry(file_entry *e) {
+    file_entry **pp = &bucket[name_hash(e->name)];
+
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    lru_unlink(e);
+    entry_num--;
+    forget_watch(e->wd);
+    release_entry(e);
+}
+
+static void release_entry(file_entry *e) {
+    if (--e->refcnt > 0)
+        return;
+    if (e->fd >= 0)
+        close(e->fd);
+    Free(e->name);
+    Free(e);
+}
+
+static void lru_unlink(file_entry *e) {
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push_front(file_entry *e) {
+    e->prev = NULL;
+    e->next = head;
+    if (head)
+        head->prev = e;
+    else
+        tail = e;
+    head = e;
+}
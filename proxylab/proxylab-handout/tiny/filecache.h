@@ -0,0 +1,36 @@
+#ifndef __FILECACHE_H__
+#define __FILECACHE_H__
+
+#include "csapp.h"
+
+/*
+ * filecache.h - bounded cache of open static files for Tiny. An entry
+ *     keeps the fd and the stat result of a file, so a hit costs no
+ *     open, stat or mmap. Entries are dropped when inotify reports a
+ *     change, or, for files without a watch, when a stat done at most
+ *     every FILECACHE_CHECK_SECS sees a new mtime or size
+ */
+
+#define FILECACHE_SIZE 256       /* most files kept open */
+#define FILECACHE_BUCKETS 512    /* hash buckets, power of two */
+#define FILECACHE_CHECK_SECS 1   /* stat interval without a watch */
+
+/* $begin filecache */
+typedef struct file_entry {
+    char *name;                  /* path as requested */
+    int fd;                      /* open for reading, -1 if not a readable file */
+    struct stat st;
+    int refcnt;                  /* the cache's reference plus readers */
+    int wd;                      /* inotify watch, -1 to check by stat */
+    time_t checked;              /* last stat, without a watch */
+    struct file_entry *hnext;    /* next in the hash bucket */
+    struct file_entry *prev;     /* lru neighbours, head is newest */
+    struct file_entry *next;
+} file_entry;
+/* $end filecache */
+
+void filecache_init(void);
+file_entry *filecache_get(char *filename);
+void filecache_put(file_entry *e);
+
+#endif /* __FILECACHE_H__ */
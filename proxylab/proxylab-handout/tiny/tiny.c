@@ -3,9 +3,14 @@
  * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the 
  *     GET method to serve static and dynamic content.
  */
+#include <sys/sendfile.h>
 #include "csapp.h"
-#include "sbuf.h"
-#include "mycache.h"
+#include "lfsbuf.h"
+#include "filecache.h"
+#include "cgipool.h"
+#include "tiny.h"
+#include "event.h"
+#include "accesslog.h"
 
 #define THREAD_NUM 5
 #define SBUF_SIZE 16
@@ -13,32 +18,60 @@
 void* thread_func(void *vargp);
 void doit(int fd);
 void read_requesthdrs(rio_t *rp);
-int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
-void get_filetype(char *filename, char *filetype);
-void serve_dynamic(int fd, char *filename, char *cgiargs);
-void clienterror(int fd, char *cause, char *errnum, 
-		 char *shortmsg, char *longmsg);
+long long serve_static(int fd, char *filename, file_entry *file);
+int serve_dynamic(int fd, char *filename, char *cgiargs);
+int clienterror(int fd, char *cause, char *errnum, 
+		char *shortmsg, char *longmsg);
 
-sbuf_t sbuf;
+lfsbuf_t sbuf;                   /* accepted connections, lock-free */
 
 int main(int argc, char **argv) 
 {
-    int i, listenfd, connfd, port;
+    int c, i, listenfd, connfd, port;
+    int event_mode = 0;          /* serve with epoll loops instead of threads */
+    int loop_num = sysconf(_SC_NPROCESSORS_ONLN); /* event loops, one per core */
+    char *access_path = NULL;    /* access log file, off if NULL */
     struct sockaddr_in clientaddr;
     socklen_t clientlen = sizeof(clientaddr);
     pthread_t tid;
 
     /* Check command line args */
-    if (argc != 2) {
-	   fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((c = getopt(argc, argv, "en:a:")) != -1) {
+	switch (c) {
+	case 'e':
+	    event_mode = 1;
+	    break;
+	case 'n':
+	    loop_num = atoi(optarg);
+	    break;
+	case 'a':
+	    access_path = optarg;
+	    break;
+	default:
+	    optind = argc; /* fall through to usage */
+	    break;
+	}
+    }
+    if (optind != argc - 1) {
+	   fprintf(stderr, "usage: %s [-e] [-n loops] [-a access_log] <port>\n", argv[0]);
 	   exit(1);
     }
-    port = atoi(argv[1]);
-    sbuf_init(&sbuf, SBUF_SIZE);
+    port = atoi(argv[optind]);
+    Signal(SIGPIPE, SIG_IGN); /* a client going away only fails its write */
+    /* One line per request, written in batches by a background thread */
+    if (access_path != NULL && access_log_open(access_path) < 0) {
+	fprintf(stderr, "cannot open access log %s\n", access_path);
+	exit(1);
+    }
+    filecache_init();
+    cgipool_init();
+    if (event_mode)
+	event_main(port, loop_num > 0 ? loop_num : 1);
+
+    lfsbuf_init(&sbuf, SBUF_SIZE);
     listenfd = Open_listenfd(port);
 
-    for (int i = 0; i < THREAD_NUM; i++)
+    for (i = 0; i < THREAD_NUM; i++)
     {
         Pthread_create(&tid, NULL, thread_func, NULL);
     }
@@ -46,7 +79,7 @@ int main(int argc, char **argv)
     while (1) {
     	
     	connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-    	sbuf_insert(&sbuf, connfd);
+    	lfsbuf_insert(&sbuf, connfd);
     }
 }
 /* $end tinymain */
@@ -57,7 +90,7 @@ int main(int argc, char **argv)
 void *thread_func(void *vargp) {
     Pthread_detach(pthread_self());
     while (1) {
-        int connfd = sbuf_remove(&sbuf);
+        int connfd = lfsbuf_remove(&sbuf);
         doit(connfd);
         Close(connfd);
     }
@@ -67,62 +100,109 @@ void *thread_func(void *vargp) {
  */
 /* $begin doit */
 void doit(int fd) {
-    int is_static;
-    struct stat sbuf;
+    file_entry *file;
+    tiny_error err;
     char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char filename[MAXLINE], cgiargs[MAXLINE];
+    char filename[MAXLINE], cgiargs[MAXLINE], path[MAXLINE];
     rio_t rio;
+    long long start;
   
     /* Read request line and headers */
     Rio_readinitb(&rio, fd);
-    Rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%s %s %s", method, uri, version);
+    if (rio_readlineb(&rio, buf, MAXLINE) <= 0)
+	return; /* EOF or a reset, only this client is affected */
+    if (sscanf(buf, "%s %s %s", method, uri, version) != 3)
+	return;
+    read_requesthdrs(&rio);
+    start = access_now();
+
+    /* parse_uri() cuts the query off, the log gets the uri as sent */
+    strcpy(path, uri);
+    switch (route_request(method, path, filename, cgiargs, &file, &err)) {
+    case ROUTE_STATIC: /* Serve static content from the open file cache */
+	access_log(method, uri, 200, serve_static(fd, filename, file), start, "STATIC");
+	filecache_put(file);
+	break;
+    case ROUTE_DYNAMIC: /* Serve dynamic content */
+	if (serve_dynamic(fd, filename, cgiargs) == 0) {
+	    access_log(method, uri, 200, -1, start, "CGI");
+	    break;
+	}
+	access_log(method, uri, 503,
+		   clienterror(fd, filename, "503", "Service Unavailable",
+			       "Tiny has no free CGI worker"),
+		   start, "ERROR");
+	break;
+    default:
+	access_log(method, uri, atoi(err.errnum),
+		   clienterror(fd, err.cause, err.errnum, err.shortmsg, err.longmsg),
+		   start, "ERROR");
+	break;
+    }
+}
+/* $end doit */
+
+/*
+ * route_request - decide how to answer a request line: a static file,
+ *     pinned in *file, a CGI program, or the error described in *err
+ */
+/* $begin route_request */
+int route_request(char *method, char *uri, char *filename, char *cgiargs,
+		  file_entry **file, tiny_error *err) {
+    struct stat sbuf;
+
     if (strcasecmp(method, "GET")) { 
-       clienterror(fd, method, "501", "Not Implemented",
-                "Tiny does not implement this method");
-        return;
+	*err = (tiny_error){ method, "501", "Not Implemented",
+			     "Tiny does not implement this method" };
+	return ROUTE_ERROR;
     }
-    read_requesthdrs(&rio);
 
     /* Parse URI from GET request */
-    is_static = parse_uri(uri, filename, cgiargs);
-    if (stat(filename, &sbuf) < 0) {
-	clienterror(fd, filename, "404", "Not found",
-		    "Tiny couldn't find this file");
-	return;
+    if (parse_uri(uri, filename, cgiargs)) { /* Static content */
+	if ((*file = filecache_get(filename)) == NULL) {
+	    *err = (tiny_error){ filename, "404", "Not found",
+				 "Tiny couldn't find this file" };
+	    return ROUTE_ERROR;
+	}
+	if (!(S_ISREG((*file)->st.st_mode)) || !(S_IRUSR & (*file)->st.st_mode)
+	    || (*file)->fd < 0) {
+	    filecache_put(*file);
+	    *err = (tiny_error){ filename, "403", "Forbidden",
+				 "Tiny couldn't read the file" };
+	    return ROUTE_ERROR;
+	}
+	return ROUTE_STATIC;
     }
 
-    if (is_static) { /* Serve static content */
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-	    clienterror(fd, filename, "403", "Forbidden",
-			"Tiny couldn't read the file");
-	    return;
-	}
-	serve_static(fd, filename, sbuf.st_size);
+    /* Dynamic content */
+    if (stat(filename, &sbuf) < 0) {
+	*err = (tiny_error){ filename, "404", "Not found",
+			     "Tiny couldn't find this file" };
+	return ROUTE_ERROR;
     }
-    else { /* Serve dynamic content */
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-	    clienterror(fd, filename, "403", "Forbidden",
-			"Tiny couldn't run the CGI program");
-	    return;
-	}
-	serve_dynamic(fd, filename, cgiargs);
+    if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
+	*err = (tiny_error){ filename, "403", "Forbidden",
+			     "Tiny couldn't run the CGI program" };
+	return ROUTE_ERROR;
     }
+    return ROUTE_DYNAMIC;
 }
-/* $end doit */
+/* $end route_request */
 
 /*
- * read_requesthdrs - read and parse HTTP request headers
+ * read_requesthdrs - read and skip HTTP request headers, the access log
+ *     records the request instead of echoing every header to stdout
  */
 /* $begin read_requesthdrs */
 void read_requesthdrs(rio_t *rp) {
     char buf[MAXLINE];
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
+    /* stop at EOF too, buf would keep the last line forever */
+    if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+	return;
     while(strcmp(buf, "\r\n")) {
-	Rio_readlineb(rp, buf, MAXLINE);
-	printf("%s", buf);
+	if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+	    return;
     }
     return;
 }
@@ -160,27 +240,52 @@ int parse_uri(char *uri, char *filename, char *cgiargs) {
 /* $end parse_uri */
 
 /*
- * serve_static - copy a file back to the client 
+ * serve_static - send a cached open file back to the client, the body
+ *     goes from the page cache to the socket with sendfile(). return the
+ *     bytes sent
  */
 /* $begin serve_static */
-void serve_static(int fd, char *filename, int filesize) {
-    int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
+long long serve_static(int fd, char *filename, file_entry *file) {
+    int n, head;
+    off_t offset = 0;
+    ssize_t sent;
+    char buf[MAXBUF];
  
-    /* Send response headers to client */
+    /* Send response headers to client, held back to share a packet with the body */
+    n = head = static_head(buf, sizeof(buf), filename, file);
+    while ((sent = send(fd, buf, n, MSG_MORE)) < n) {
+	if (sent < 0 && errno != EINTR)
+	    return head - n;
+	if (sent > 0) {
+	    memmove(buf, buf + sent, n - sent);
+	    n -= sent;
+	}
+    }
+
+    /* Send response body to client, reading at offset leaves the shared fd alone */
+    while (offset < file->st.st_size) {
+	sent = sendfile(fd, file->fd, &offset, file->st.st_size - offset);
+	if (sent < 0 && errno == EINTR)
+	    continue;
+	if (sent <= 0)
+	    break; /* client went away or the file shrank */
+    }
+    return head + offset;
+}
+
+/*
+ * static_head - format the response headers of a static file into buf,
+ *     return their length
+ */
+int static_head(char *buf, int size, char *filename, file_entry *file) {
+    char filetype[MAXLINE];
+
     get_filetype(filename, filetype);
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
-    Rio_writen(fd, buf, strlen(buf));
-
-    /* Send response body to client */
-    srcfd = Open(filename, O_RDONLY, 0);
-    srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    Close(srcfd);
-    Rio_writen(fd, srcp, filesize);
-    Munmap(srcp, filesize);
+    return snprintf(buf, size, "HTTP/1.0 200 OK\r\n"
+		    "Server: Tiny Web Server\r\n"
+		    "Content-length: %lld\r\n"
+		    "Content-type: %s\r\n\r\n",
+		    (long long)file->st.st_size, filetype);
 }
 
 /*
@@ -199,49 +304,54 @@ void get_filetype(char *filename, char *filetype) {
 /* $end serve_static */
 
 /*
- * serve_dynamic - run a CGI program on behalf of the client
+ * serve_dynamic - run a CGI program on behalf of the client, in a
+ *     persistent worker process when one is idle. -1 with nothing sent
+ *     if every worker stayed busy
  */
 /* $begin serve_dynamic */
-void serve_dynamic(int fd, char *filename, char *cgiargs) {
-    char buf[MAXLINE], *emptylist[] = { NULL };
-
-    /* Return first part of HTTP response */
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-  
-    if (Fork() == 0) { /* child */
-	/* Real server would set all CGI vars here */
-	setenv("QUERY_STRING", cgiargs, 1); 
-	Dup2(fd, STDOUT_FILENO);         /* Redirect stdout to client */
-	Execve(filename, emptylist, environ); /* Run CGI program */
-    }
-    Wait(NULL); /* Parent waits for and reaps child */
+int serve_dynamic(int fd, char *filename, char *cgiargs) {
+    /* The first part of the HTTP response goes out with the hand-off
+       to a worker, which answers the rest itself */
+    return cgipool_serve(fd, filename, cgiargs, DYNAMIC_HEAD);
 }
 /* $end serve_dynamic */
 
 /*
- * clienterror - returns an error message to the client
+ * clienterror - returns an error message to the client, and its length
+ *     or -1 if it could not be sent
  */
 /* $begin clienterror */
-void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) {
-    char buf[MAXLINE], body[MAXBUF];
+int clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) {
+    char buf[MAXLINE + MAXBUF];
+    tiny_error err = { cause, errnum, shortmsg, longmsg };
+    int n = error_response(buf, sizeof(buf), &err);
 
-    /* Build the HTTP response body */
-    sprintf(body, "<html><title>Tiny Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
-
-    /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+    /* Print the HTTP response, headers and body in one write */
+    if (rio_writen(fd, buf, n) < 0)
+	return -1; /* the client went away, nothing more to do */
+    return n;
 }
 /* $end clienterror */
+
+/*
+ * error_response - format the whole response of err into buf, return
+ *     its length
+ */
+int error_response(char *buf, int size, tiny_error *err) {
+    char body[MAXBUF];
+    int n;
+
+    /* Build the HTTP response body */
+    snprintf(body, sizeof(body), "<html><title>Tiny Error</title>"
+	     "<body bgcolor=""ffffff"">\r\n"
+	     "%s: %s\r\n"
+	     "<p>%s: %s\r\n"
+	     "<hr><em>The Tiny Web server</em>\r\n",
+	     err->errnum, err->shortmsg, err->longmsg, err->cause);
+
+    n = snprintf(buf, size, "HTTP/1.0 %s %s\r\n"
+		 "Content-type: text/html\r\n"
+		 "Content-length: %d\r\n\r\n%s",
+		 err->errnum, err->shortmsg, (int)strlen(body), body);
+    return n < size ? n : size - 1;
+}
@@ -0,0 +1,36 @@
+#ifndef __TINY_H__
+#define __TINY_H__
+
+#include "csapp.h"
+#include "filecache.h"
+
+/*
+ * tiny.h - request handling shared by Tiny's thread pool (tiny.c) and
+ *     its epoll serving mode (event.c). Both route a request the same
+ *     way and send the same bytes, they only differ in how they wait
+ */
+
+#define ROUTE_ERROR -1           /* err describes the response */
+#define ROUTE_DYNAMIC 0          /* run filename with cgiargs */
+#define ROUTE_STATIC 1           /* send the pinned *file */
+
+/* sent before a CGI program's own output */
+#define DYNAMIC_HEAD "HTTP/1.0 200 OK\r\nServer: Tiny Web Server\r\n"
+
+/* $begin tinyerror */
+typedef struct {
+    char *cause;                 /* method or file name it is about */
+    char *errnum;
+    char *shortmsg;
+    char *longmsg;
+} tiny_error;
+/* $end tinyerror */
+
+int route_request(char *method, char *uri, char *filename, char *cgiargs,
+                  file_entry **file, tiny_error *err);
+int parse_uri(char *uri, char *filename, char *cgiargs);
+int static_head(char *buf, int size, char *filename, file_entry *file);
+int error_response(char *buf, int size, tiny_error *err);
+void get_filetype(char *filename, char *filetype);
+
+#endif /* __TINY_H__ */
@@ -0,0 +1,166 @@
+/*
+* upstream.c - persistent connections to origin servers
+*
+* a finished keep-alive response leaves its connection in the pool of
+* its host:port, newest first. the next request for the same origin
+* takes it back and skips the DNS lookup and the TCP handshake. idle
+* connections expire after UPSTREAM_IDLE_SECS and at most
+* UPSTREAM_MAX_IDLE_PER_HOST are kept for each origin
+*/
+#include "csapp.h"
+#include "upstream.h"
+#include "dnscache.h"
+
+typedef struct idle_conn {
+    int fd;
+    time_t since; // when it went idle
+    struct idle_conn *next;
+} idle_conn;
+
+typedef struct upstream_host {
+    char *host_name;
+    int port;
+    int idle_num;
+    idle_conn *idle; // newest first
+    struct upstream_host *next;
+} upstream_host;
+
+static upstream_host *hosts[UPSTREAM_BUCKET_NUM];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static upstream_host *find_host(char *host_name, int port, int create);
+static void expire_idle(upstream_host *h, time_t now);
+static int still_open(int fd);
+
+void init_upstream_pool(void)
+{
+    memset(hosts, 0, sizeof(hosts));
+}
+
+int upstream_take(char *host_name, int port)
+{
+    upstream_host *h;
+    idle_conn *ic;
+    int fd;
+
+    while (1) {
+        pthread_mutex_lock(&pool_lock);
+        h = find_host(host_name, port, 0);
+        if (h == NULL || h->idle == NULL) {
+            pthread_mutex_unlock(&pool_lock);
+            return -1;
+        }
+        expire_idle(h, time(NULL));
+        if ((ic = h->idle) != NULL) {
+            h->idle = ic->next;
+            h->idle_num--;
+        }
+        pthread_mutex_unlock(&pool_lock);
+        if (ic == NULL)
+            return -1;
+        fd = ic->fd;
+        Free(ic);
+        // the server may have closed it while it sat in the pool
+        if (still_open(fd))
+            return fd;
+        close(fd);
+    }
+}
+
+int upstream_connect(char *host_name, int port)
+{
+    struct sockaddr_in serveraddr;
+    int fd;
+
+    bzero((char *) &serveraddr, sizeof(serveraddr));
+    if (dns_lookup(host_name, &serveraddr.sin_addr) < 0)
+        return -1;
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_port = htons((unsigned short)port);
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (connect(fd, (SA *)&serveraddr, sizeof(serveraddr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void upstream_release(char *host_name, int port, int fd, int reusable)
+{
+    upstream_host *h;
+    idle_conn *ic;
+    time_t now = time(NULL);
+
+    if (!reusable) {
+        close(fd);
+        return;
+    }
+    ic = Malloc(sizeof(idle_conn));
+    ic->fd = fd;
+    ic->since = now;
+    pthread_mutex_lock(&pool_lock);
+    h = find_host(host_name, port, 1);
+    expire_idle(h, now);
+    if (h->idle_num >= UPSTREAM_MAX_IDLE_PER_HOST) {
+        pthread_mutex_unlock(&pool_lock);
+        close(fd);
+        Free(ic);
+        return;
+    }
+    ic->next = h->idle;
+    h->idle = ic;
+    h->idle_num++;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// the entry of host:port, created on demand, call with pool_lock held
+static upstream_host *find_host(char *host_name, int port, int create)
+{
+    unsigned int hash = port;
+    char *p;
+    upstream_host *h;
+
+    for (p = host_name; *p; p++)
+        hash = hash * 31 + (unsigned char)tolower(*p);
+    hash %= UPSTREAM_BUCKET_NUM;
+    for (h = hosts[hash]; h; h = h->next) {
+        if (h->port == port && !strcasecmp(h->host_name, host_name))
+            return h;
+    }
+    if (!create)
+        return NULL;
+    h = Malloc(sizeof(upstream_host));
+    h->host_name = Malloc(strlen(host_name) + 1);
+    strcpy(h->host_name, host_name);
+    h->port = port;
+    h->idle_num = 0;
+    h->idle = NULL;
+    h->next = hosts[hash];
+    hosts[hash] = h;
+    return h;
+}
+
+// close connections idle for too long, they sit at the tail of the list
+static void expire_idle(upstream_host *h, time_t now)
+{
+    idle_conn **pp = &h->idle;
+    idle_conn *ic;
+
+    while (*pp != NULL && now - (*pp)->since < UPSTREAM_IDLE_SECS)
+        pp = &(*pp)->next;
+    while ((ic = *pp) != NULL) {
+        *pp = ic->next;
+        close(ic->fd);
+        Free(ic);
+        h->idle_num--;
+    }
+}
+
+// an idle connection must have nothing to read, EOF means it was closed
+static int still_open(int fd)
+{
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
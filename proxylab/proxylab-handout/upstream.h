@@ -0,0 +1,21 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+/*
+* upstream.h - pool of idle keep-alive connections to origin servers,
+* keyed by host:port
+*/
+
+#define UPSTREAM_BUCKET_NUM 64 // hash buckets of the host table
+#define UPSTREAM_MAX_IDLE_PER_HOST 8 // idle connections kept per host:port
+#define UPSTREAM_IDLE_SECS 15 // idle connections older than this are closed
+
+void init_upstream_pool(void);
+// an idle connection to host:port, or -1 if there is none
+int upstream_take(char *host_name, int port);
+// a new blocking connection to host:port through the DNS cache, or -1 on error
+int upstream_connect(char *host_name, int port);
+// hand fd back, it is pooled if reusable and closed otherwise
+void upstream_release(char *host_name, int port, int fd, int reusable);
+
+#endif /* __UPSTREAM_H__ */
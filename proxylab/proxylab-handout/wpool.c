@@ -0,0 +1,192 @@
+/*
+* wpool.c - work stealing worker pool
+*
+* the producer spreads items round robin over the deques of the live
+* workers, so it only ever contends with one worker at a time. a worker
+* drains its own deque from the front and, once that is empty, steals
+* from the back of the others before it goes to sleep. the pool grows
+* by one worker whenever an item is queued while no worker is idle,
+* i.e. all of them are blocked serving clients, and workers above
+* min_workers retire after WPOOL_IDLE_SECS without work
+*/
+#include "csapp.h"
+#include "wpool.h"
+
+static void spawn_worker(wpool_t *wp);
+static void *worker_thread(void *vargp);
+static int take_item(wpool_t *wp, wpool_slot *self, int *item);
+static int retire(wpool_slot *self);
+
+void wpool_init(wpool_t *wp, int min_workers, int max_workers, wpool_func func)
+{
+    int i;
+
+    if (min_workers < 1)
+        min_workers = 1;
+    if (max_workers < min_workers)
+        max_workers = min_workers;
+    wp->func = func;
+    wp->min_workers = min_workers;
+    wp->max_workers = max_workers;
+    wp->slot = Calloc(max_workers, sizeof(wpool_slot));
+    for (i = 0; i < max_workers; i++) {
+        pthread_mutex_init(&wp->slot[i].lock, NULL);
+        wp->slot[i].wp = wp;
+    }
+    wp->next = wp->pending = wp->idle = wp->workers = wp->full_waiters = 0;
+    pthread_mutex_init(&wp->lock, NULL);
+    pthread_cond_init(&wp->cond, NULL);
+    pthread_cond_init(&wp->space, NULL);
+    pthread_mutex_lock(&wp->lock);
+    for (i = 0; i < min_workers; i++)
+        spawn_worker(wp);
+    pthread_mutex_unlock(&wp->lock);
+}
+
+void wpool_insert(wpool_t *wp, int item)
+{
+    int i, start;
+    wpool_slot *s;
+
+    while (1) {
+        start = __sync_fetch_and_add(&wp->next, 1);
+        for (i = 0; i < wp->max_workers; i++) {
+            s = &wp->slot[(unsigned int)(start + i) % wp->max_workers];
+            if (!s->alive)
+                continue; // unlocked peek, checked again below
+            pthread_mutex_lock(&s->lock);
+            if (s->alive && s->rear - s->front < WPOOL_DEQUE_SIZE) {
+                s->buf[s->rear++ % WPOOL_DEQUE_SIZE] = item;
+                pthread_mutex_unlock(&s->lock);
+                break;
+            }
+            pthread_mutex_unlock(&s->lock);
+        }
+        if (i < wp->max_workers)
+            break;
+        // every live deque is full: add a worker or wait for room
+        pthread_mutex_lock(&wp->lock);
+        if (wp->workers < wp->max_workers) {
+            spawn_worker(wp);
+        } else {
+            wp->full_waiters++;
+            pthread_cond_wait(&wp->space, &wp->lock);
+            wp->full_waiters--;
+        }
+        pthread_mutex_unlock(&wp->lock);
+    }
+
+    // the full barrier pairs with the one of a worker going idle, so
+    // either it sees the item or we see it idle
+    __sync_add_and_fetch(&wp->pending, 1);
+    if (wp->idle > 0) {
+        pthread_mutex_lock(&wp->lock);
+        pthread_cond_signal(&wp->cond);
+        pthread_mutex_unlock(&wp->lock);
+    } else if (wp->workers < wp->max_workers) {
+        pthread_mutex_lock(&wp->lock);
+        if (wp->idle == 0 && wp->workers < wp->max_workers)
+            spawn_worker(wp);
+        pthread_mutex_unlock(&wp->lock);
+    }
+}
+
+// start a worker on a free slot, call with wp->lock held
+static void spawn_worker(wpool_t *wp)
+{
+    pthread_t tid;
+    wpool_slot *s;
+    int i;
+
+    for (i = 0; i < wp->max_workers; i++) {
+        s = &wp->slot[i];
+        pthread_mutex_lock(&s->lock);
+        if (!s->alive) {
+            s->alive = 1;
+            pthread_mutex_unlock(&s->lock);
+            wp->workers++;
+            Pthread_create(&tid, NULL, worker_thread, s);
+            return;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+static void *worker_thread(void *vargp)
+{
+    wpool_slot *self = (wpool_slot *)vargp;
+    wpool_t *wp = self->wp;
+    struct timespec deadline;
+    int item, rc;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        if (take_item(wp, self, &item)) {
+            wp->func(item);
+            continue;
+        }
+        pthread_mutex_lock(&wp->lock);
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += WPOOL_IDLE_SECS;
+        __sync_add_and_fetch(&wp->idle, 1);
+        rc = 0;
+        while (wp->pending == 0 && rc != ETIMEDOUT)
+            rc = pthread_cond_timedwait(&wp->cond, &wp->lock, &deadline);
+        __sync_sub_and_fetch(&wp->idle, 1);
+        if (wp->pending == 0 && wp->workers > wp->min_workers && retire(self)) {
+            wp->workers--;
+            pthread_mutex_unlock(&wp->lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&wp->lock);
+    }
+}
+
+/*
+* take_item - pop the oldest item of our own deque, or steal the newest
+* item of another one. return 1 with *item set, 0 if all looked empty
+*/
+static int take_item(wpool_t *wp, wpool_slot *self, int *item)
+{
+    int i, self_idx = self - wp->slot, found = 0;
+    wpool_slot *s;
+
+    pthread_mutex_lock(&self->lock);
+    if (self->front != self->rear) {
+        *item = self->buf[self->front++ % WPOOL_DEQUE_SIZE];
+        found = 1;
+    }
+    pthread_mutex_unlock(&self->lock);
+    for (i = 1; !found && i < wp->max_workers; i++) {
+        s = &wp->slot[(self_idx + i) % wp->max_workers];
+        if (s->front == s->rear)
+            continue; // unlocked peek
+        pthread_mutex_lock(&s->lock);
+        if (s->front != s->rear) {
+            *item = s->buf[--s->rear % WPOOL_DEQUE_SIZE];
+            found = 1;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    if (!found)
+        return 0;
+    __sync_sub_and_fetch(&wp->pending, 1);
+    if (wp->full_waiters > 0) {
+        pthread_mutex_lock(&wp->lock);
+        pthread_cond_signal(&wp->space);
+        pthread_mutex_unlock(&wp->lock);
+    }
+    return 1;
+}
+
+// close the deque of an idle worker, fails if an item slipped in
+static int retire(wpool_slot *self)
+{
+    int ok;
+
+    pthread_mutex_lock(&self->lock);
+    if ((ok = self->front == self->rear))
+        self->alive = 0;
+    pthread_mutex_unlock(&self->lock);
+    return ok;
+}
@@ -0,0 +1,46 @@
+#ifndef __WPOOL_H__
+#define __WPOOL_H__
+
+#include "csapp.h"
+
+/*
+* wpool.h - auto-sizing worker pool with per-worker deques and work
+* stealing, a drop-in for the sbuf_t producer/consumer hand-off
+*/
+
+#define WPOOL_DEQUE_SIZE 64 // queued items per worker
+#define WPOOL_IDLE_SECS 10 // idle workers above the minimum exit after this
+
+typedef void (*wpool_func)(int item);
+
+struct wpool;
+
+// one worker slot, its deque is filled by the producer and drained by the
+// owner from the front and by thieves from the back
+typedef struct {
+    pthread_mutex_t lock;
+    int alive; // a worker owns the slot and its deque accepts items
+    int front, rear; // buf[front % n] .. buf[(rear - 1) % n] are queued
+    int buf[WPOOL_DEQUE_SIZE];
+    struct wpool *wp;
+} __attribute__((aligned(64))) wpool_slot;
+
+typedef struct wpool {
+    wpool_func func; // run by a worker for every item
+    int min_workers, max_workers;
+    wpool_slot *slot; // max_workers slots
+    int next; // round robin position of the producer
+    int pending; // queued items over all deques
+    int idle; // workers asleep on cond
+    int workers; // live workers
+    int full_waiters; // producers waiting for a free deque slot
+    pthread_mutex_t lock; // guards workers and the sleeping on cond/space
+    pthread_cond_t cond; // items arrived
+    pthread_cond_t space; // deque slots freed
+} wpool_t;
+
+void wpool_init(wpool_t *wp, int min_workers, int max_workers, wpool_func func);
+// queue item for some worker, blocks while every deque is full
+void wpool_insert(wpool_t *wp, int item);
+
+#endif /* __WPOOL_H__ */